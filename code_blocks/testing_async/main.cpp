@@ -0,0 +1,127 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <future>
+#include <cstdio>
+#include <cstring>
+#include "xvfs.hpp"
+
+// проверка пула асинхронных вызовов: вызовы с одним хэшем выполняются в порядке вызова,
+// при заполненной очереди вызовы сразу отклоняются (ERROR_ASYNC_QUEUE_FULL)
+// программа возвращает 0, если все проверки прошли
+
+const std::string file_name = "testing_async.dat";
+const int files_size = 20;
+const int versions_size = 50;
+
+// содержимое и размер файла зависят от номера файла и версии, версия записана в начале файла
+std::string make_data(int file, int version) {
+    std::string data(100 + (file * 131 + version * 977) % 4000, '\0');
+    std::memcpy(&data[0], &version, sizeof(version));
+    for(size_t i = sizeof(version); i < data.size(); ++i) {
+        data[i] = (char)(file * 7 + version * 3 + i);
+    }
+    return data;
+}
+
+// прочитанный файл должен совпадать с версией version
+bool check_data(int file, int version, const xvfs::_xvfs_read_result& result) {
+    const std::string expected = make_data(file, version);
+    const bool is_ok = result.len == (long)expected.size() && std::memcmp(result.data, expected.data(), result.len) == 0;
+    if(result.data != NULL) delete[] result.data;
+    return is_ok;
+}
+
+// после каждой записи файла ставится его чтение, а в конце - удаление и еще одно чтение:
+// чтение должно вернуть версию, записанную непосредственно перед ним
+bool test_order() {
+    std::remove(file_name.c_str());
+    xvfs vfs(file_name, 512, xvfs::NO_COMPRESSION);
+    vfs.set_async_threads(4, files_size * (2 * versions_size + 2));
+    std::vector<std::future<bool>> writes;
+    std::vector<std::future<xvfs::_xvfs_read_result>> reads;
+    std::vector<std::future<bool>> deletes;
+    std::vector<std::future<xvfs::_xvfs_read_result>> deleted_reads;
+    for(int version = 0; version < versions_size; ++version) {
+        // файлы чередуются, поэтому очереди потоков пула перемешаны
+        for(int file = 0; file < files_size; ++file) {
+            const std::string data = make_data(file, version);
+            writes.push_back(vfs.async_write_file(file, data.data(), data.size()));
+            reads.push_back(vfs.async_read_file(file));
+        }
+    }
+    for(int file = 0; file < files_size; ++file) {
+        deletes.push_back(vfs.async_delete_file(file));
+        deleted_reads.push_back(vfs.async_read_file(file));
+    }
+    bool is_ok = true;
+    for(size_t i = 0; i < writes.size(); ++i) {
+        if(!writes[i].get()) is_ok = false;
+        if(!check_data((int)(i % files_size), (int)(i / files_size), reads[i].get())) is_ok = false;
+    }
+    for(int file = 0; file < files_size; ++file) {
+        if(!deletes[file].get()) is_ok = false;
+        xvfs::_xvfs_read_result result = deleted_reads[file].get();
+        if(result.len != xvfs::ERROR_VIRTUAL_FILE_NOT_FOUND) is_ok = false;
+        if(result.data != NULL) delete[] result.data;
+    }
+    return is_ok;
+}
+
+// единственный поток пула занят, очередь заполняется до max_tasks, следующие вызовы отклоняются
+bool test_queue_full() {
+    std::remove(file_name.c_str());
+    xvfs vfs(file_name, 512, xvfs::NO_COMPRESSION);
+    const size_t max_tasks = 4;
+    vfs.set_async_threads(1, max_tasks);
+    const std::string data = make_data(0, 1);
+    if(!vfs.write_file(0, const_cast<char*>(data.data()), data.size())) return false;
+    // обработчик держит поток пула, пока не откроется gate
+    std::promise<void> started;
+    std::promise<void> gate;
+    std::shared_future<void> gate_future = gate.get_future().share();
+    bool is_ok = vfs.async_read_file(0, [&started, gate_future](long, char* data) {
+        delete[] data;
+        started.set_value();
+        gate_future.wait();
+    });
+    if(!is_ok) return false;
+    started.get_future().wait();
+    std::vector<std::future<xvfs::_xvfs_read_result>> reads;
+    for(size_t i = 0; i < max_tasks; ++i) {
+        reads.push_back(vfs.async_read_file(0));
+    }
+    // очередь заполнена: future сразу готов, обработчик не вызывается
+    std::future<xvfs::_xvfs_read_result> rejected_read = vfs.async_read_file(0);
+    if(rejected_read.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        is_ok = false;
+    } else {
+        xvfs::_xvfs_read_result result = rejected_read.get();
+        if(result.len != xvfs::ERROR_ASYNC_QUEUE_FULL) is_ok = false;
+        if(result.data != NULL) delete[] result.data;
+    }
+    std::future<bool> rejected_write = vfs.async_write_file(1, data.data(), data.size());
+    if(rejected_write.wait_for(std::chrono::seconds(0)) != std::future_status::ready || rejected_write.get()) is_ok = false;
+    if(vfs.async_delete_file(0, [](bool) {})) is_ok = false;
+    gate.set_value();
+    // поставленные вызовы выполняются, после этого очередь снова принимает вызовы
+    for(size_t i = 0; i < reads.size(); ++i) {
+        if(!check_data(0, 1, reads[i].get())) is_ok = false;
+    }
+    if(!vfs.async_delete_file(0).get()) is_ok = false;
+    if(vfs.get_len_file(1) != xvfs::ERROR_VIRTUAL_FILE_NOT_FOUND) is_ok = false;
+    return is_ok;
+}
+
+int main() {
+    bool is_ok = true;
+    bool is_test = test_order();
+    std::cout << "order " << (is_test ? "ok" : "error") << std::endl;
+    is_ok = is_ok && is_test;
+    is_test = test_queue_full();
+    std::cout << "queue full " << (is_test ? "ok" : "error") << std::endl;
+    is_ok = is_ok && is_test;
+    std::remove(file_name.c_str());
+    std::cout << (is_ok ? "all tests ok" : "some tests failed") << std::endl;
+    return is_ok ? 0 : 1;
+}
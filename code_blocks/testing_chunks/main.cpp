@@ -0,0 +1,170 @@
+#include <iostream>
+#include <string>
+#include <map>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include "xvfs.hpp"
+
+// проверка сжатия больших файлов частями, чтения части файла (read_range) на границах частей
+// и сжатия частей в нескольких потоках
+// нужна библиотека zlib (макрос XFVS_USE_ZLIB), программа возвращает 0, если все проверки прошли
+
+const std::string file_name = "testing_chunks.dat";
+const unsigned long chunk_size = 65536;
+
+// данные сжимаются, кроме участков со случайными байтами
+std::string make_data(unsigned long seed, size_t size, bool is_random) {
+    std::string data(size, '\0');
+    for(size_t i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = is_random || (i / 1000) % 7 == 3 ? (char)(seed >> 16) : (char)('a' + (i / 5) % 26);
+    }
+    return data;
+}
+
+// получить заголовки файлов VFS по хэшу
+std::map<long long, xvfs::_xvfs_file_header> get_headers(xvfs& vfs) {
+    unsigned long sector_size = 0;
+    long compression_type = 0;
+    std::vector<xvfs::_xvfs_file_header> files;
+    std::vector<unsigned long> empty_sectors;
+    vfs.get_info(sector_size, compression_type, files, empty_sectors);
+    std::map<long long, xvfs::_xvfs_file_header> headers;
+    for(size_t i = 0; i < files.size(); ++i) headers[files[i].hash] = files[i];
+    return headers;
+}
+
+// прочитать часть файла и сравнить с ожидаемыми данными
+bool check_range(xvfs& vfs, long long hash, const std::string& file, unsigned long offset, unsigned long length) {
+    std::vector<char> buffer(length + 1, '\0');
+    const long len = vfs.read_range(hash, offset, length, &buffer[0]);
+    const long expected_len = offset >= file.size() ? 0 : (long)std::min((size_t)length, file.size() - offset);
+    if(len != expected_len || (len > 0 && std::memcmp(&buffer[0], file.data() + offset, len) != 0)) {
+        std::cout << "file " << hash << " offset " << offset << " length " << length << " len " << len << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// части файла вокруг каждой границы частей сжатия, в начале и в конце файла
+bool check_file(xvfs& vfs, long long hash, const std::string& file) {
+    char* data = NULL;
+    const long len = vfs.read_file(hash, data);
+    const bool is_equal = len == (long)file.size() && (len == 0 || std::memcmp(data, file.data(), len) == 0);
+    if(data != NULL) delete[] data;
+    if(!is_equal) {
+        std::cout << "file " << hash << " len " << len << std::endl;
+        return false;
+    }
+    const unsigned long size = file.size();
+    const unsigned long lengths[] = {0, 1, 100, chunk_size - 1, chunk_size, chunk_size + 1, 3 * chunk_size + 7};
+    for(unsigned long boundary = 0; boundary <= size + chunk_size; boundary += chunk_size) {
+        for(unsigned long length : lengths) {
+            if(boundary >= 1 && !check_range(vfs, hash, file, boundary - 1, length)) return false;
+            if(!check_range(vfs, hash, file, boundary, length)) return false;
+            if(!check_range(vfs, hash, file, boundary + 1, length)) return false;
+        }
+    }
+    // последний байт файла, чтение за концом файла и чтение всего файла
+    if(size > 0 && !check_range(vfs, hash, file, size - 1, 10)) return false;
+    if(!check_range(vfs, hash, file, size, 10)) return false;
+    if(!check_range(vfs, hash, file, size + 1000000, 10)) return false;
+    return check_range(vfs, hash, file, 0, size + 10);
+}
+
+bool test_chunks(int storage_type) {
+    std::remove(file_name.c_str());
+    std::map<long long, std::string> files;
+    std::map<long long, long> compression_types;
+    // размеры вокруг размера части сжатия
+    files[1] = make_data(1, 100, false);
+    files[2] = make_data(2, chunk_size, false);
+    files[3] = make_data(3, chunk_size + 1, false);
+    files[4] = make_data(4, 4 * chunk_size, false);
+    files[5] = make_data(5, 10 * chunk_size + 12345, false);
+    // файл без сжатия и файл, части которого не сжимаются
+    files[6] = make_data(6, 3 * chunk_size + 100, false);
+    compression_types[6] = xvfs::NO_COMPRESSION;
+    files[7] = make_data(7, 5 * chunk_size + 1, true);
+    {
+        xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_6, storage_type);
+        for(auto it = files.begin(); it != files.end(); ++it) {
+            auto it_type = compression_types.find(it->first);
+            const long compression_type = it_type == compression_types.end() ? (long)xvfs::USE_ZLIB_LEVEL_6 : it_type->second;
+            if(!vfs.write_file(it->first, &it->second[0], it->second.size(), compression_type)) return false;
+        }
+        std::map<long long, xvfs::_xvfs_file_header> headers = get_headers(vfs);
+        // файлы до размера части сжимаются целиком, большие файлы - частями
+        if(headers[2].compression_type != xvfs::USE_ZLIB_LEVEL_6) return false;
+        if(headers[3].compression_type != (xvfs::USE_ZLIB_LEVEL_6 | xvfs::CHUNKED_COMPRESSION)) return false;
+        if(headers[5].compression_type != (xvfs::USE_ZLIB_LEVEL_6 | xvfs::CHUNKED_COMPRESSION)) return false;
+        if(headers[6].compression_type != xvfs::NO_COMPRESSION) return false;
+        if(headers[7].compression_type != xvfs::NO_COMPRESSION) return false;
+        for(auto it = files.begin(); it != files.end(); ++it) {
+            if(!check_file(vfs, it->first, it->second)) return false;
+        }
+        // файла нет
+        char buffer[16];
+        if(vfs.read_range(100, 0, sizeof(buffer), buffer) != xvfs::ERROR_VIRTUAL_FILE_NOT_FOUND) return false;
+    }
+    // после повторного открытия
+    xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_6, storage_type);
+    for(auto it = files.begin(); it != files.end(); ++it) {
+        if(!check_file(vfs, it->first, it->second)) return false;
+    }
+    return true;
+}
+
+// части сжимаются и распаковываются в нескольких потоках, данные файла такие же, как при сжатии в одном потоке
+bool test_threads(int storage_type) {
+    std::map<long long, std::string> files;
+    for(long long hash = 1; hash <= 20; ++hash) {
+        files[hash] = make_data(hash, hash * chunk_size / 2 + hash * 1000, hash % 5 == 0);
+    }
+    std::map<long long, xvfs::_xvfs_file_header> single_thread_headers;
+    const unsigned threads[] = {1, 2, 4, 0};
+    for(unsigned thread_count : threads) {
+        std::remove(file_name.c_str());
+        {
+            xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_6, storage_type);
+            vfs.set_compression_threads(thread_count);
+            for(auto it = files.begin(); it != files.end(); ++it) {
+                if(!vfs.write_file(it->first, &it->second[0], it->second.size())) return false;
+            }
+            std::map<long long, xvfs::_xvfs_file_header> headers = get_headers(vfs);
+            if(thread_count == 1) single_thread_headers = headers;
+            for(auto it = files.begin(); it != files.end(); ++it) {
+                const xvfs::_xvfs_file_header& header = headers[it->first];
+                const xvfs::_xvfs_file_header& single_thread_header = single_thread_headers[it->first];
+                if(header.size != single_thread_header.size || header.compression_type != single_thread_header.compression_type) {
+                    std::cout << "threads " << thread_count << " file " << it->first << " size " << header.size << std::endl;
+                    return false;
+                }
+            }
+        }
+        // файлы, сжатые в нескольких потоках, читаются в одном потоке и наоборот
+        xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_6, storage_type);
+        vfs.set_compression_threads(thread_count == 1 ? 4 : 1);
+        for(auto it = files.begin(); it != files.end(); ++it) {
+            if(!check_file(vfs, it->first, it->second)) return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    const int storage_types[] = {xvfs::USE_PREAD_STORAGE, xvfs::USE_MMAP_STORAGE, xvfs::USE_FSTREAM_STORAGE};
+    bool is_ok = true;
+    for(int storage_type : storage_types) {
+        bool is_test = test_chunks(storage_type);
+        std::cout << "storage " << storage_type << " chunks " << (is_test ? "ok" : "error") << std::endl;
+        is_ok = is_ok && is_test;
+        is_test = test_threads(storage_type);
+        std::cout << "storage " << storage_type << " threads " << (is_test ? "ok" : "error") << std::endl;
+        is_ok = is_ok && is_test;
+    }
+    std::remove(file_name.c_str());
+    std::cout << (is_ok ? "all tests ok" : "some tests failed") << std::endl;
+    return is_ok ? 0 : 1;
+}
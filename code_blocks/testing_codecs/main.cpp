@@ -0,0 +1,142 @@
+#include <iostream>
+#include <string>
+#include <map>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <zlib.h>
+#include "xvfs.hpp"
+
+// проверка контекстов компрессии потоков: несколько VFS сжимают и читают файлы одновременно в разных потоках,
+// сжатие zlib через переиспользуемый поток дает те же данные, что и compress2
+// нужны библиотеки zlib и zstd (макросы XFVS_USE_ZLIB и XFVS_USE_ZSTD), программа возвращает 0, если все проверки прошли
+
+// данные сжимаются примерно в 3 раза
+std::string make_data(unsigned long seed, size_t size) {
+    std::string data(size, '\0');
+    for(size_t i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (char)('a' + ((seed >> 16) % 4) + (i / 64) % 8);
+    }
+    return data;
+}
+
+// получить заголовки файлов VFS по хэшу
+std::map<long long, xvfs::_xvfs_file_header> get_headers(xvfs& vfs) {
+    unsigned long sector_size = 0;
+    long compression_type = 0;
+    std::vector<xvfs::_xvfs_file_header> files;
+    std::vector<unsigned long> empty_sectors;
+    vfs.get_info(sector_size, compression_type, files, empty_sectors);
+    std::map<long long, xvfs::_xvfs_file_header> headers;
+    for(size_t i = 0; i < files.size(); ++i) headers[files[i].hash] = files[i];
+    return headers;
+}
+
+// прочитать файл и сравнить с ожидаемым содержимым
+bool check_file(xvfs& vfs, long long hash, const std::string& file) {
+    char* data = NULL;
+    const long len = vfs.read_file(hash, data);
+    const bool is_equal = len == (long)file.size() && (len == 0 || std::memcmp(data, file.data(), len) == 0);
+    if(data != NULL) delete[] data;
+    return is_equal;
+}
+
+// уровень zlib меняется от файла к файлу, размер сжатых данных совпадает с compress2
+bool test_zlib_levels() {
+    const std::string file_name = "testing_codecs.dat";
+    std::remove(file_name.c_str());
+    std::map<long long, std::string> files;
+    std::map<long long, long> compression_types;
+    xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_6);
+    for(long long hash = 0; hash < 90; ++hash) {
+        files[hash] = make_data(hash, 1000 + hash * 500);
+        compression_types[hash] = xvfs::USE_ZLIB_LEVEL_1 + (hash * 4) % 9;
+        if(!vfs.write_file(hash, &files[hash][0], files[hash].size(), compression_types[hash])) return false;
+    }
+    std::map<long long, xvfs::_xvfs_file_header> headers = get_headers(vfs);
+    for(auto it = files.begin(); it != files.end(); ++it) {
+        uLongf size = compressBound(it->second.size());
+        std::vector<unsigned char> data(size);
+        if(compress2(&data[0], &size, (const unsigned char*)it->second.data(), it->second.size(), compression_types[it->first]) != Z_OK) return false;
+        const xvfs::_xvfs_file_header& header = headers[it->first];
+        if(header.compression_type != compression_types[it->first] || header.size != size) {
+            std::cout << "file " << it->first << " size " << header.size << " compress2 " << size << std::endl;
+            return false;
+        }
+        if(!check_file(vfs, it->first, it->second)) return false;
+    }
+    return true;
+}
+
+// каждый поток работает со своей VFS и меняет тип компрессии от файла к файлу
+bool run_thread(int thread_index, std::atomic<int>& errors) {
+    const std::string file_name = "testing_codecs_" + std::to_string(thread_index) + ".dat";
+    std::remove(file_name.c_str());
+    const long compression_types[] = {
+        xvfs::USE_ZLIB_LEVEL_1, xvfs::USE_ZSTD_LEVEL_3, xvfs::USE_ZLIB_LEVEL_9, xvfs::NO_COMPRESSION,
+        xvfs::USE_ZSTD_LEVEL_NEG_1, xvfs::USE_ZLIB_LEVEL_6, xvfs::USE_ZSTD_LEVEL_1
+    };
+    const size_t compression_types_size = sizeof(compression_types) / sizeof(compression_types[0]);
+    std::map<long long, std::string> files;
+    {
+        xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_6);
+        // часть VFS сжимает большие файлы еще и в потоках сжатия частей
+        vfs.set_compression_threads(thread_index % 2 == 0 ? 1 : 2);
+        for(int step = 0; step < 400; ++step) {
+            const long long hash = step % 150;
+            const size_t size = step % 10 == 0 ? 200000 + step * 100 : 100 + step * 37;
+            files[hash] = make_data(thread_index * 1000 + step, size);
+            const long compression_type = compression_types[(step + thread_index) % compression_types_size];
+            if(!vfs.write_file(hash, &files[hash][0], files[hash].size(), compression_type)) {
+                ++errors;
+                return false;
+            }
+            if(!check_file(vfs, hash, files[hash])) {
+                ++errors;
+                return false;
+            }
+        }
+    }
+    xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_6);
+    for(auto it = files.begin(); it != files.end(); ++it) {
+        if(!check_file(vfs, it->first, it->second)) {
+            ++errors;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool test_threads() {
+    const int threads_size = 4;
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < threads_size; ++i) {
+        threads.push_back(std::thread([i, &errors]() {
+            run_thread(i, errors);
+        }));
+    }
+    for(size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+    for(int i = 0; i < threads_size; ++i) {
+        std::remove(("testing_codecs_" + std::to_string(i) + ".dat").c_str());
+    }
+    return errors == 0;
+}
+
+int main() {
+    bool is_ok = true;
+    bool is_test = test_zlib_levels();
+    std::cout << "zlib levels " << (is_test ? "ok" : "error") << std::endl;
+    is_ok = is_ok && is_test;
+    is_test = test_threads();
+    std::cout << "threads " << (is_test ? "ok" : "error") << std::endl;
+    is_ok = is_ok && is_test;
+    std::remove("testing_codecs.dat");
+    std::cout << (is_ok ? "all tests ok" : "some tests failed") << std::endl;
+    return is_ok ? 0 : 1;
+}
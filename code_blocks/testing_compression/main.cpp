@@ -0,0 +1,177 @@
+#include <iostream>
+#include <string>
+#include <map>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include "xvfs.hpp"
+
+// проверка записи без сжатия для плохо сжимаемых файлов и адаптивного сжатия
+// нужна библиотека zlib (макрос XFVS_USE_ZLIB), программа возвращает 0, если все проверки прошли
+
+const std::string file_name = "testing_compression.dat";
+
+// случайные байты, которые не сжимаются
+std::string make_random(unsigned long seed, size_t size) {
+    std::string data(size, '\0');
+    for(size_t i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (char)(seed >> 16);
+    }
+    return data;
+}
+
+// случайные символы из 16 букв, сжимаются примерно вдвое
+std::string make_letters(unsigned long seed, size_t size) {
+    std::string data(size, '\0');
+    for(size_t i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (char)('a' + ((seed >> 16) & 0x0F));
+    }
+    return data;
+}
+
+// повторяющийся текст, который хорошо сжимается
+std::string make_text(unsigned long seed, size_t size) {
+    const std::string words = "the quick brown fox jumps over the lazy dog ";
+    std::string data(size, '\0');
+    for(size_t i = 0; i < size; ++i) {
+        data[i] = words[(i + seed) % words.size()];
+    }
+    return data;
+}
+
+// получить заголовки файлов VFS по хэшу
+std::map<long long, xvfs::_xvfs_file_header> get_headers(xvfs& vfs) {
+    unsigned long sector_size = 0;
+    long compression_type = 0;
+    std::vector<xvfs::_xvfs_file_header> files;
+    std::vector<unsigned long> empty_sectors;
+    vfs.get_info(sector_size, compression_type, files, empty_sectors);
+    std::map<long long, xvfs::_xvfs_file_header> headers;
+    for(size_t i = 0; i < files.size(); ++i) headers[files[i].hash] = files[i];
+    return headers;
+}
+
+// сравнить все файлы VFS с ожидаемым содержимым после повторного открытия
+bool check_files(const std::map<long long, std::string>& files) {
+    xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_9);
+    if(!vfs.is_open()) return false;
+    for(auto it = files.begin(); it != files.end(); ++it) {
+        char* data = NULL;
+        long len = vfs.read_file(it->first, data);
+        const bool is_equal = len == (long)it->second.size() && std::memcmp(data, it->second.data(), len) == 0;
+        if(data != NULL) delete[] data;
+        if(!is_equal) {
+            std::cout << "file " << it->first << " len " << len << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// файл, который не стал меньше после сжатия, пишется без сжатия
+bool test_raw_storage() {
+    std::remove(file_name.c_str());
+    std::map<long long, std::string> files;
+    files[1] = make_random(1, 100000);
+    files[2] = make_text(2, 100000);
+    files[3] = make_letters(3, 100000);
+    files[4] = make_random(4, 100);
+    {
+        xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_9);
+        for(auto it = files.begin(); it != files.end(); ++it) {
+            if(!vfs.write_file(it->first, &it->second[0], it->second.size())) return false;
+        }
+        std::map<long long, xvfs::_xvfs_file_header> headers = get_headers(vfs);
+        if(headers[1].compression_type != xvfs::NO_COMPRESSION || headers[1].size != headers[1].real_size) return false;
+        if(headers[4].compression_type != xvfs::NO_COMPRESSION || headers[4].size != headers[4].real_size) return false;
+        // файлы больше 64 КБ сжимаются по частям
+        if(headers[2].compression_type != (xvfs::USE_ZLIB_LEVEL_9 | xvfs::CHUNKED_COMPRESSION) || headers[2].size >= headers[2].real_size / 10) return false;
+        if(headers[3].compression_type != (xvfs::USE_ZLIB_LEVEL_9 | xvfs::CHUNKED_COMPRESSION) || headers[3].size >= headers[3].real_size) return false;
+    }
+    return check_files(files);
+}
+
+// при адаптивном сжатии файлы, которые сжимаются хуже min_ratio, пишутся без сжатия
+bool test_min_ratio() {
+    std::remove(file_name.c_str());
+    std::map<long long, std::string> files;
+    files[1] = make_letters(1, 100000);
+    files[2] = make_text(2, 100000);
+    files[3] = make_letters(3, 20000);
+    // середина файла не сжимается, поэтому по пробному сжатию весь файл пишется без сжатия
+    files[4] = make_text(4, 100000) + make_random(4, 40000) + make_text(5, 100000);
+    {
+        xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_9);
+        vfs.set_adaptive_compression(true, 3.0);
+        for(auto it = files.begin(); it != files.end(); ++it) {
+            if(!vfs.write_file(it->first, &it->second[0], it->second.size())) return false;
+        }
+        std::map<long long, xvfs::_xvfs_file_header> headers = get_headers(vfs);
+        if(headers[1].compression_type != xvfs::NO_COMPRESSION) return false;
+        if(headers[2].compression_type != (xvfs::USE_ZLIB_LEVEL_9 | xvfs::CHUNKED_COMPRESSION)) return false;
+        if(headers[3].compression_type != xvfs::NO_COMPRESSION) return false;
+        if(headers[4].compression_type != xvfs::NO_COMPRESSION) return false;
+    }
+    // без адаптивного сжатия те же файлы сжимаются
+    {
+        xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_9);
+        for(auto it = files.begin(); it != files.end(); ++it) {
+            if(!vfs.write_file(it->first, &it->second[0], it->second.size())) return false;
+        }
+        std::map<long long, xvfs::_xvfs_file_header> headers = get_headers(vfs);
+        for(auto it = files.begin(); it != files.end(); ++it) {
+            const long chunked = it->second.size() > 65536 ? (long)xvfs::CHUNKED_COMPRESSION : 0L;
+            if(headers[it->first].compression_type != (xvfs::USE_ZLIB_LEVEL_9 | chunked)) return false;
+        }
+    }
+    return check_files(files);
+}
+
+// при медленном сжатии уровень понижается, но не выше типа компрессии VFS
+bool test_min_speed() {
+    std::remove(file_name.c_str());
+    std::map<long long, std::string> files;
+    {
+        xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_9);
+        // недостижимая скорость: уровень сжатия опускается до первого
+        vfs.set_adaptive_compression(true, 1.1, 1e15);
+        for(long long hash = 1; hash <= 100; ++hash) {
+            files[hash] = make_text(hash, 8192 + hash * 100);
+            if(!vfs.write_file(hash, &files[hash][0], files[hash].size())) return false;
+        }
+        // любая скорость выше минимальной: уровень сжатия остается уровнем VFS
+        vfs.set_adaptive_compression(true, 1.1, 1);
+        for(long long hash = 101; hash <= 200; ++hash) {
+            files[hash] = make_text(hash, 8192 + hash * 100);
+            if(!vfs.write_file(hash, &files[hash][0], files[hash].size())) return false;
+        }
+        std::map<long long, xvfs::_xvfs_file_header> headers = get_headers(vfs);
+        if(headers[1].compression_type != xvfs::USE_ZLIB_LEVEL_9) return false;
+        if(headers[100].compression_type != xvfs::USE_ZLIB_LEVEL_1) return false;
+        for(long long hash = 2; hash <= 100; ++hash) {
+            if(headers[hash].compression_type > headers[hash - 1].compression_type) return false;
+        }
+        for(long long hash = 101; hash <= 200; ++hash) {
+            if(headers[hash].compression_type != xvfs::USE_ZLIB_LEVEL_9) return false;
+        }
+    }
+    return check_files(files);
+}
+
+int main() {
+    bool is_ok = true;
+    bool is_test = test_raw_storage();
+    std::cout << "raw storage " << (is_test ? "ok" : "error") << std::endl;
+    is_ok = is_ok && is_test;
+    is_test = test_min_ratio();
+    std::cout << "min ratio " << (is_test ? "ok" : "error") << std::endl;
+    is_ok = is_ok && is_test;
+    is_test = test_min_speed();
+    std::cout << "min speed " << (is_test ? "ok" : "error") << std::endl;
+    is_ok = is_ok && is_test;
+    std::remove(file_name.c_str());
+    std::cout << (is_ok ? "all tests ok" : "some tests failed") << std::endl;
+    return is_ok ? 0 : 1;
+}
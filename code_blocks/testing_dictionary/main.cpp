@@ -0,0 +1,162 @@
+#include <iostream>
+#include <string>
+#include <map>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include "xvfs.hpp"
+
+// проверка обучения словаря zstd, сжатия небольших файлов со словарем и чтения после повторного открытия,
+// зарезервированные под словари хэши недоступны через публичные функции
+// нужна библиотека zstd (макрос XFVS_USE_ZSTD), программа возвращает 0, если все проверки прошли
+
+const std::string file_name = "testing_dictionary.dat";
+const long long dictionary_hash = 0x7876667300000000LL;
+
+// небольшая запись в формате JSON, записи похожи друг на друга
+std::string make_record(unsigned long seed, int version) {
+    unsigned long value = seed;
+    std::string data = "{\"id\":" + std::to_string(seed) + ",\"version\":" + std::to_string(version);
+    for(int i = 0; i < 6; ++i) {
+        value = value * 1103515245 + 12345;
+        data += ",\"field_" + std::to_string(i) + "\":\"value_" + std::to_string((value >> 16) % 1000) + "\"";
+    }
+    data += ",\"status\":\"" + std::string(value & 1 ? "enabled" : "disabled") + "\",\"tags\":[\"alpha\",\"beta\",\"gamma\"]}";
+    return data;
+}
+
+// получить заголовки файлов VFS по хэшу
+std::map<long long, xvfs::_xvfs_file_header> get_headers(xvfs& vfs) {
+    unsigned long sector_size = 0;
+    long compression_type = 0;
+    std::vector<xvfs::_xvfs_file_header> files;
+    std::vector<unsigned long> empty_sectors;
+    vfs.get_info(sector_size, compression_type, files, empty_sectors);
+    std::map<long long, xvfs::_xvfs_file_header> headers;
+    for(size_t i = 0; i < files.size(); ++i) headers[files[i].hash] = files[i];
+    return headers;
+}
+
+// записать файлы [from, to) и запомнить их содержимое
+bool write_records(xvfs& vfs, std::map<long long, std::string>& files, long long from, long long to, int version) {
+    for(long long hash = from; hash < to; ++hash) {
+        files[hash] = make_record(hash, version);
+        if(!vfs.write_file(hash, &files[hash][0], files[hash].size())) return false;
+    }
+    return true;
+}
+
+// число файлов [from, to), сжатых со словарем
+int count_dictionary_files(xvfs& vfs, long long from, long long to) {
+    std::map<long long, xvfs::_xvfs_file_header> headers = get_headers(vfs);
+    int count = 0;
+    for(long long hash = from; hash < to; ++hash) {
+        if(headers[hash].compression_type == xvfs::USE_ZSTD_DICTIONARY) ++count;
+    }
+    return count;
+}
+
+// сравнить все файлы VFS с ожидаемым содержимым
+bool check_files(xvfs& vfs, const std::map<long long, std::string>& files) {
+    for(auto it = files.begin(); it != files.end(); ++it) {
+        char* data = NULL;
+        long len = vfs.read_file(it->first, data);
+        const bool is_equal = len == (long)it->second.size() && std::memcmp(data, it->second.data(), len) == 0;
+        if(data != NULL) delete[] data;
+        if(!is_equal) {
+            std::cout << "file " << it->first << " len " << len << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// словарь обучается на небольших файлах, сохраняется в файле VFS и используется после повторного открытия
+bool test_dictionary() {
+    std::remove(file_name.c_str());
+    std::map<long long, std::string> files;
+    {
+        xvfs vfs(file_name, 64, xvfs::USE_ZSTD_LEVEL_3);
+        if(!write_records(vfs, files, 0, 4000, 1)) return false;
+        if(count_dictionary_files(vfs, 0, 4000) != 0) return false;
+        // в пакете изменений словарь не обучается
+        vfs.begin_batch();
+        const bool is_batch_train = vfs.train_dictionary();
+        vfs.rollback();
+        if(is_batch_train) return false;
+        if(!vfs.train_dictionary()) return false;
+        if(!write_records(vfs, files, 4000, 5000, 1)) return false;
+        if(count_dictionary_files(vfs, 4000, 5000) != 1000) return false;
+        // большие файлы сжимаются без словаря
+        files[5000] = std::string();
+        for(int i = 0; files[5000].size() <= 16384; ++i) files[5000] += make_record(i, 1);
+        if(!vfs.write_file(5000, &files[5000][0], files[5000].size())) return false;
+        if(get_headers(vfs)[5000].compression_type != xvfs::USE_ZSTD_LEVEL_3) return false;
+        if(!check_files(vfs, files)) return false;
+    }
+    // словарь читается из файла VFS
+    {
+        xvfs vfs(file_name, 64, xvfs::USE_ZSTD_LEVEL_3);
+        if(!check_files(vfs, files)) return false;
+        if(!write_records(vfs, files, 6000, 7000, 2)) return false;
+        if(count_dictionary_files(vfs, 6000, 7000) != 1000) return false;
+        // после повторного обучения файлы, сжатые старым словарем, читаются своим словарем
+        if(!vfs.train_dictionary(8192, 500)) return false;
+        if(!write_records(vfs, files, 7000, 8000, 3)) return false;
+        if(count_dictionary_files(vfs, 7000, 8000) != 1000) return false;
+        if(!check_files(vfs, files)) return false;
+    }
+    xvfs vfs(file_name, 64, xvfs::USE_ZSTD_LEVEL_3);
+    return check_files(vfs, files);
+}
+
+// словари не видны в get_info(), а хэши словарей нельзя записать, прочитать или удалить
+bool test_reserved_hashes() {
+    std::remove(file_name.c_str());
+    std::map<long long, std::string> files;
+    {
+        xvfs vfs(file_name, 64, xvfs::USE_ZSTD_LEVEL_3);
+        if(!write_records(vfs, files, 0, 2000, 1)) return false;
+        if(!vfs.train_dictionary()) return false;
+        std::map<long long, xvfs::_xvfs_file_header> headers = get_headers(vfs);
+        if(headers.size() != files.size()) return false;
+        for(auto it = headers.begin(); it != headers.end(); ++it) {
+            if((it->first & ~0xFFFFFFFFLL) == dictionary_hash) return false;
+        }
+        std::string data = make_record(0, 1);
+        char buffer[16];
+        char* read_data = NULL;
+        if(vfs.write_file(dictionary_hash, &data[0], data.size())) return false;
+        if(vfs.write_file(dictionary_hash | 1, &data[0], data.size(), xvfs::NO_COMPRESSION)) return false;
+        if(vfs.delete_file(dictionary_hash)) return false;
+        if(vfs.read_file(dictionary_hash, read_data) != xvfs::ERROR_VIRTUAL_FILE_NOT_FOUND || read_data != NULL) return false;
+        if(vfs.get_len_file(dictionary_hash) != xvfs::ERROR_VIRTUAL_FILE_NOT_FOUND) return false;
+        if(vfs.read_range(dictionary_hash, 0, sizeof(buffer), buffer) != xvfs::ERROR_VIRTUAL_FILE_NOT_FOUND) return false;
+        std::vector<long long> hashes = {0, dictionary_hash, 1};
+        std::vector<char*> files_data;
+        std::vector<long> lens;
+        const long count = vfs.read_files(hashes, files_data, lens);
+        for(size_t i = 0; i < files_data.size(); ++i) {
+            if(files_data[i] != NULL) delete[] files_data[i];
+        }
+        if(count != 2 || lens[1] != xvfs::ERROR_VIRTUAL_FILE_NOT_FOUND) return false;
+        if(!write_records(vfs, files, 2000, 2500, 1)) return false;
+        if(count_dictionary_files(vfs, 2000, 2500) != 500) return false;
+    }
+    // словарь остался на месте и после повторного открытия
+    xvfs vfs(file_name, 64, xvfs::USE_ZSTD_LEVEL_3);
+    if(!write_records(vfs, files, 2500, 3000, 2)) return false;
+    if(count_dictionary_files(vfs, 2500, 3000) != 500) return false;
+    return check_files(vfs, files);
+}
+
+int main() {
+    bool is_ok = test_dictionary();
+    std::cout << "dictionary " << (is_ok ? "ok" : "error") << std::endl;
+    const bool is_reserved_ok = test_reserved_hashes();
+    std::cout << "reserved hashes " << (is_reserved_ok ? "ok" : "error") << std::endl;
+    is_ok = is_ok && is_reserved_ok;
+    std::remove(file_name.c_str());
+    std::cout << (is_ok ? "all tests ok" : "some tests failed") << std::endl;
+    return is_ok ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+#include <iostream>
+#include <string>
+#include <map>
+#include <cstdio>
+#include <cstring>
+#include "xvfs.hpp"
+
+// проверка индекса файлов (B+ дерева): разделение корня, записи одного файла в нескольких листьях
+// и выгрузка неизмененных страниц, когда их больше, чем держится в памяти
+// программа возвращает 0, если все проверки прошли
+
+// при таком размере сектора страница индекса занимает ровно 4 КБ
+const int sector_size = 64;
+// файлов с данными
+const int data_files = 60000;
+// пустые файлы занимают только записи индекса, вместе с ними листьев больше,
+// чем неизмененных страниц держится в памяти
+const int empty_files = 350000;
+
+std::string make_data(int seed, size_t size) {
+    std::string data(size, '\0');
+    for(size_t i = 0; i < size; ++i) {
+        data[i] = (char)(seed * 131 + i * 7 + (i >> 8));
+    }
+    return data;
+}
+
+bool write_file(xvfs& vfs, std::map<std::string, std::string>& files, const std::string& name, const std::string& data) {
+    files[name] = data;
+    return vfs.write_file(name, const_cast<char*>(data.data()), data.size());
+}
+
+bool delete_file(xvfs& vfs, std::map<std::string, std::string>& files, const std::string& name) {
+    files.erase(name);
+    return vfs.delete_file(name);
+}
+
+// сравнить файлы VFS с ожидаемым содержимым, удаленные файлы не должны читаться
+bool check_files(xvfs& vfs, const std::map<std::string, std::string>& files, const std::map<std::string, std::string>& deleted_files) {
+    int errors = 0;
+    for(auto it = files.begin(); it != files.end(); ++it) {
+        char* data = NULL;
+        long len = vfs.read_file(it->first, data);
+        if(len != (long)it->second.size() || (len > 0 && std::memcmp(data, it->second.data(), len) != 0)) {
+            if(errors < 10) std::cout << "file " << it->first << " len " << len << std::endl;
+            ++errors;
+        }
+        if(data != NULL) delete[] data;
+    }
+    for(auto it = deleted_files.begin(); it != deleted_files.end(); ++it) {
+        if(files.find(it->first) != files.end()) continue;
+        char* data = NULL;
+        long len = vfs.read_file(it->first, data);
+        if(len >= 0) {
+            if(errors < 10) std::cout << "deleted file " << it->first << " len " << len << std::endl;
+            ++errors;
+        }
+        if(data != NULL) delete[] data;
+    }
+    if(errors > 0) std::cout << "errors: " << errors << std::endl;
+    return errors == 0;
+}
+
+bool test_index(int storage_type) {
+    const std::string file_name = "testing_index.dat";
+    std::remove(file_name.c_str());
+    std::map<std::string, std::string> files;
+    std::map<std::string, std::string> deleted_files;
+    {
+        // много файлов: корень индекса делится несколько раз
+        xvfs vfs(file_name, sector_size, xvfs::NO_COMPRESSION, storage_type);
+        if(!vfs.is_open()) return false;
+        for(int i = 0; i < data_files; ++i) {
+            const std::string name = "file_" + std::to_string(i);
+            if(!write_file(vfs, files, name, make_data(i, (i * 7919) % 600 + 1))) return false;
+        }
+        if(!check_files(vfs, files, deleted_files)) return false;
+        // удаленные файлы оставляют пустые участки, поэтому перезаписанные файлы занимают несколько экстентов,
+        // и записи одного файла попадают в соседние листья
+        for(int i = 0; i < data_files; i += 3) {
+            const std::string name = "file_" + std::to_string(i);
+            deleted_files[name] = files[name];
+            if(!delete_file(vfs, files, name)) return false;
+        }
+        for(int i = 1; i < data_files; i += 4) {
+            const std::string name = "file_" + std::to_string(i);
+            if(!write_file(vfs, files, name, make_data(i + 1, (i * 7877) % 4000 + 1000))) return false;
+        }
+        if(!check_files(vfs, files, deleted_files)) return false;
+    }
+    {
+        xvfs vfs(file_name, sector_size, xvfs::NO_COMPRESSION, storage_type);
+        if(!vfs.is_open() || !check_files(vfs, files, deleted_files)) return false;
+        for(int i = 0; i < empty_files; ++i) {
+            if(!write_file(vfs, files, "empty_" + std::to_string(i), "")) return false;
+        }
+    }
+    {
+        // чтение всех файлов загружает все листья, лишние неизмененные страницы выгружаются
+        xvfs vfs(file_name, sector_size, xvfs::NO_COMPRESSION, storage_type);
+        if(!vfs.is_open() || !check_files(vfs, files, deleted_files)) return false;
+        // изменения после выгрузки страниц снова загружают их с диска
+        for(int i = 0; i < data_files; i += 5) {
+            const std::string name = "file_" + std::to_string(i);
+            if(files.find(name) != files.end()) {
+                deleted_files[name] = files[name];
+                if(!delete_file(vfs, files, name)) return false;
+            } else {
+                if(!write_file(vfs, files, name, make_data(i + 2, i % 300))) return false;
+            }
+        }
+        for(int i = 0; i < empty_files; i += 7) {
+            const std::string name = "empty_" + std::to_string(i);
+            deleted_files[name] = files[name];
+            if(!delete_file(vfs, files, name)) return false;
+        }
+        if(!check_files(vfs, files, deleted_files)) return false;
+    }
+    {
+        // удаляются почти все файлы, опустевшие листья убираются из дерева
+        xvfs vfs(file_name, sector_size, xvfs::NO_COMPRESSION, storage_type);
+        if(!vfs.is_open() || !check_files(vfs, files, deleted_files)) return false;
+        std::map<std::string, std::string> all_files(files);
+        for(auto it = all_files.begin(); it != all_files.end(); ++it) {
+            if(it->first.compare(0, 5, "file_") == 0 && std::stoi(it->first.substr(5)) % 1000 == 1) continue;
+            deleted_files[it->first] = it->second;
+            if(!delete_file(vfs, files, it->first)) return false;
+        }
+        if(!check_files(vfs, files, deleted_files)) return false;
+    }
+    xvfs vfs(file_name, sector_size, xvfs::NO_COMPRESSION, storage_type);
+    return vfs.is_open() && check_files(vfs, files, deleted_files);
+}
+
+int main() {
+    const int storage_types[] = {xvfs::USE_PREAD_STORAGE, xvfs::USE_MMAP_STORAGE};
+    bool is_ok = true;
+    for(int storage_type : storage_types) {
+        bool is_test = test_index(storage_type);
+        std::cout << "storage " << storage_type << " index " << (is_test ? "ok" : "error") << std::endl;
+        is_ok = is_ok && is_test;
+    }
+    std::remove("testing_index.dat");
+    std::cout << (is_ok ? "all tests ok" : "some tests failed") << std::endl;
+    return is_ok ? 0 : 1;
+}
@@ -0,0 +1,286 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <map>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include "xvfs.hpp"
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+// проверка журнала изменений, контрольных точек и чтения файлов VFS старого формата
+// программа возвращает 0, если все проверки прошли
+
+const int sector_size = 64;
+
+// содержимое файла зависит только от номера шага
+std::string make_data(int step, size_t size) {
+    std::string data(size, '\0');
+    for(size_t i = 0; i < size; ++i) {
+        data[i] = (char)(step * 131 + i * 7 + (i >> 8));
+    }
+    return data;
+}
+
+// шаг step меняет файлы одинаково при каждом вызове,
+// без VFS (vfs == NULL) обновляется только ожидаемое содержимое
+bool apply_step(xvfs* vfs, std::map<std::string, std::string>& files, int step) {
+    const std::string name = "file_" + std::to_string(step % 700);
+    if(step % 5 == 3) {
+        files.erase(name);
+        if(vfs != NULL) vfs->delete_file(name);
+        return true;
+    }
+    // среди файлов есть пустые и занимающие много секторов
+    const size_t size = step % 11 == 0 ? 0 : (step * 7919) % 5000 + 1;
+    const std::string data = make_data(step, size);
+    files[name] = data;
+    if(vfs == NULL) return true;
+    return vfs->write_file(name, const_cast<char*>(data.data()), data.size());
+}
+
+// выполнить шаги [from, to) и завершить работу без деструктора xvfs и без контрольной точки при закрытии
+bool run_without_close(const std::string& file_name, int storage_type, int from, int to) {
+#   if defined(_WIN32)
+    // объект намеренно не удаляется
+    xvfs* vfs = new xvfs(file_name, sector_size, xvfs::NO_COMPRESSION, storage_type);
+    std::map<std::string, std::string> files;
+    for(int step = from; step < to; ++step) {
+        if(!apply_step(vfs, files, step)) return false;
+    }
+    return true;
+#   else
+    pid_t pid = fork();
+    if(pid < 0) return false;
+    if(pid == 0) {
+        xvfs* vfs = new xvfs(file_name, sector_size, xvfs::NO_COMPRESSION, storage_type);
+        std::map<std::string, std::string> files;
+        for(int step = from; step < to; ++step) {
+            if(!apply_step(vfs, files, step)) _exit(1);
+        }
+        _exit(0);
+    }
+    int status = 0;
+    if(waitpid(pid, &status, 0) != pid) return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#   endif
+}
+
+// сравнить все файлы VFS с ожидаемым содержимым
+bool check_files(const std::string& file_name, int storage_type, const std::map<std::string, std::string>& files, int max_step) {
+    xvfs vfs(file_name, sector_size, xvfs::NO_COMPRESSION, storage_type);
+    if(!vfs.is_open()) return false;
+    int errors = 0;
+    for(int i = 0; i < 700 && i < max_step; ++i) {
+        const std::string name = "file_" + std::to_string(i);
+        auto it = files.find(name);
+        char* data = NULL;
+        long len = vfs.read_file(name, data);
+        if(it == files.end()) {
+            if(len >= 0) ++errors;
+        } else
+        if(len != (long)it->second.size() || (len > 0 && std::memcmp(data, it->second.data(), len) != 0)) {
+            ++errors;
+        }
+        if(data != NULL) delete[] data;
+    }
+    if(errors > 0) std::cout << "errors: " << errors << std::endl;
+    return errors == 0;
+}
+
+// первый сектор файла VFS меняется только при записи заголовка, т.е. в контрольной точке
+std::string read_first_sector(const std::string& file_name) {
+    std::ifstream file(file_name, std::ios::binary);
+    std::string data(sector_size, '\0');
+    file.read(&data[0], sector_size);
+    return data;
+}
+
+// изменения из журнала применяются при открытии, контрольной точки при этом не было
+bool test_log_replay(int storage_type) {
+    const std::string file_name = "testing_log.dat";
+    std::remove(file_name.c_str());
+    { xvfs vfs(file_name, sector_size, xvfs::NO_COMPRESSION, storage_type); }
+    const std::string first_sector = read_first_sector(file_name);
+    const int steps = 200;
+    if(!run_without_close(file_name, storage_type, 0, steps)) return false;
+    if(read_first_sector(file_name) != first_sector) {
+        std::cout << "unexpected checkpoint" << std::endl;
+        return false;
+    }
+    std::map<std::string, std::string> files;
+    for(int step = 0; step < steps; ++step) apply_step(NULL, files, step);
+    // проверяем дважды: после первого открытия VFS закрывается с контрольной точкой
+    if(!check_files(file_name, storage_type, files, steps)) return false;
+    return check_files(file_name, storage_type, files, steps);
+}
+
+// журнал заполняется, изменения переходят в контрольную точку, а новые записи снова идут в журнал
+bool test_checkpoint(int storage_type) {
+    const std::string file_name = "testing_log.dat";
+    std::remove(file_name.c_str());
+    { xvfs vfs(file_name, sector_size, xvfs::NO_COMPRESSION, storage_type); }
+    const std::string first_sector = read_first_sector(file_name);
+    const int steps = 8000;
+    if(!run_without_close(file_name, storage_type, 0, steps)) return false;
+    if(read_first_sector(file_name) == first_sector) {
+        std::cout << "no checkpoint" << std::endl;
+        return false;
+    }
+    std::map<std::string, std::string> files;
+    for(int step = 0; step < steps; ++step) apply_step(NULL, files, step);
+    if(!check_files(file_name, storage_type, files, steps)) return false;
+    // после открытия с обычным закрытием пишем еще раз без закрытия
+    if(!run_without_close(file_name, storage_type, steps, steps + 300)) return false;
+    for(int step = steps; step < steps + 300; ++step) apply_step(NULL, files, step);
+    return check_files(file_name, storage_type, files, steps + 300);
+}
+
+// заголовок файла в VFS старого формата
+struct legacy_file_header {
+    long long hash;
+    unsigned long size;
+    unsigned long real_size;
+    unsigned long start_sector;
+};
+
+// записать данные цепочкой секторов старого формата: в конце сектора ссылка на следующий сектор
+void write_legacy_chain(std::vector<char>& file, const std::vector<unsigned long>& sectors, const std::string& data) {
+    const unsigned long sector_data_size = sector_size - sizeof(unsigned long);
+    for(size_t i = 0; i < sectors.size(); ++i) {
+        const size_t pos = sectors[i] * sector_size;
+        if(file.size() < pos + sector_size) file.resize(pos + sector_size, 0);
+        const size_t offset = i * sector_data_size;
+        const size_t part = std::min((size_t)sector_data_size, data.size() - offset);
+        std::memcpy(&file[pos], data.data() + offset, part);
+        const unsigned long next_sector = i + 1 < sectors.size() ? sectors[i + 1] : 0xFFFFFFFF;
+        std::memcpy(&file[pos + sector_data_size], &next_sector, sizeof(unsigned long));
+    }
+}
+
+// файл VFS, созданный старой версией, читается и переводится в новый формат
+bool test_legacy_format(int storage_type) {
+    const std::string file_name = "testing_log_legacy.dat";
+    std::remove(file_name.c_str());
+    const unsigned long sector_data_size = sector_size - sizeof(unsigned long);
+    // файлы по возрастанию хэша: пустой, непрерывный и файл с разбросанными в обратном порядке секторами
+    std::map<long long, std::string> files;
+    files[101] = "";
+    files[102] = make_data(102, 10 * sector_data_size + 5);
+    files[103] = make_data(103, 6 * sector_data_size);
+    std::vector<legacy_file_header> headers;
+    std::vector<unsigned long> empty_sectors;
+    const unsigned long header_size = 4 * sizeof(unsigned long) + sizeof(long) +
+        files.size() * sizeof(legacy_file_header) + 1 * sizeof(unsigned long);
+    const unsigned long header_sectors = (header_size + sector_data_size - 1) / sector_data_size;
+    std::vector<char> file;
+    std::vector<unsigned long> sectors_102;
+    for(unsigned long i = 0; i < 11; ++i) sectors_102.push_back(header_sectors + i);
+    // один сектор между файлами пустой
+    empty_sectors.push_back(header_sectors + 11);
+    std::vector<unsigned long> sectors_103;
+    for(unsigned long i = 0; i < 6; ++i) sectors_103.push_back(header_sectors + 17 - i);
+    write_legacy_chain(file, sectors_102, files[102]);
+    write_legacy_chain(file, sectors_103, files[103]);
+    write_legacy_chain(file, std::vector<unsigned long>(1, empty_sectors[0]), "");
+    legacy_file_header file_header;
+    std::memset(&file_header, 0, sizeof(file_header));
+    file_header.hash = 101;
+    file_header.start_sector = 0xFFFFFFFF;
+    headers.push_back(file_header);
+    file_header.hash = 102;
+    file_header.size = file_header.real_size = files[102].size();
+    file_header.start_sector = sectors_102[0];
+    headers.push_back(file_header);
+    file_header.hash = 103;
+    file_header.size = file_header.real_size = files[103].size();
+    file_header.start_sector = sectors_103[0];
+    headers.push_back(file_header);
+    // заголовок: размер, размер сектора, тип компрессии, файлы и пустые сектора
+    std::string header(header_size, '\0');
+    unsigned long offset = 0;
+    const unsigned long legacy_sector_size = sector_size;
+    const long compression_type = xvfs::NO_COMPRESSION;
+    const unsigned long files_size = headers.size();
+    const unsigned long empty_sectors_size = empty_sectors.size();
+    std::memcpy(&header[offset], &header_size, sizeof(header_size));
+    offset += sizeof(header_size);
+    std::memcpy(&header[offset], &legacy_sector_size, sizeof(legacy_sector_size));
+    offset += sizeof(legacy_sector_size);
+    std::memcpy(&header[offset], &compression_type, sizeof(compression_type));
+    offset += sizeof(compression_type);
+    std::memcpy(&header[offset], &files_size, sizeof(files_size));
+    offset += sizeof(files_size);
+    std::memcpy(&header[offset], &headers[0], headers.size() * sizeof(legacy_file_header));
+    offset += headers.size() * sizeof(legacy_file_header);
+    std::memcpy(&header[offset], &empty_sectors_size, sizeof(empty_sectors_size));
+    offset += sizeof(empty_sectors_size);
+    std::memcpy(&header[offset], &empty_sectors[0], sizeof(unsigned long));
+    std::vector<unsigned long> header_chain;
+    for(unsigned long i = 0; i < header_sectors; ++i) header_chain.push_back(i);
+    write_legacy_chain(file, header_chain, header);
+    {
+        std::ofstream out(file_name, std::ios::binary);
+        out.write(&file[0], file.size());
+    }
+
+    // первое открытие читает старый формат и меняет файлы
+    {
+        xvfs vfs(file_name, sector_size, xvfs::NO_COMPRESSION, storage_type);
+        if(!vfs.is_open()) return false;
+        for(auto it = files.begin(); it != files.end(); ++it) {
+            char* data = NULL;
+            long len = vfs.read_file(it->first, data);
+            const bool is_equal = len == (long)it->second.size() && (len == 0 || std::memcmp(data, it->second.data(), len) == 0);
+            if(data != NULL) delete[] data;
+            if(!is_equal) {
+                std::cout << "legacy file " << it->first << " len " << len << std::endl;
+                return false;
+            }
+        }
+        files.erase(102);
+        if(!vfs.delete_file(102)) return false;
+        files[104] = make_data(104, 3 * sector_data_size);
+        if(!vfs.write_file(104, &files[104][0], files[104].size())) return false;
+    }
+    // второе открытие читает уже новый формат
+    xvfs vfs(file_name, sector_size, xvfs::NO_COMPRESSION, storage_type);
+    if(!vfs.is_open()) return false;
+    for(long long hash = 101; hash <= 104; ++hash) {
+        char* data = NULL;
+        long len = vfs.read_file(hash, data);
+        auto it = files.find(hash);
+        bool is_equal = it == files.end() ? len < 0 :
+            len == (long)it->second.size() && (len == 0 || std::memcmp(data, it->second.data(), len) == 0);
+        if(data != NULL) delete[] data;
+        if(!is_equal) {
+            std::cout << "converted file " << hash << " len " << len << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    const int storage_types[] = {xvfs::USE_PREAD_STORAGE, xvfs::USE_MMAP_STORAGE};
+    bool is_ok = true;
+    for(int storage_type : storage_types) {
+        std::cout << "storage " << storage_type << std::endl;
+        bool is_test = test_log_replay(storage_type);
+        std::cout << "log replay " << (is_test ? "ok" : "error") << std::endl;
+        is_ok = is_ok && is_test;
+        is_test = test_checkpoint(storage_type);
+        std::cout << "checkpoint " << (is_test ? "ok" : "error") << std::endl;
+        is_ok = is_ok && is_test;
+        is_test = test_legacy_format(storage_type);
+        std::cout << "legacy format " << (is_test ? "ok" : "error") << std::endl;
+        is_ok = is_ok && is_test;
+    }
+    std::remove("testing_log.dat");
+    std::remove("testing_log_legacy.dat");
+    std::cout << (is_ok ? "all tests ok" : "some tests failed") << std::endl;
+    return is_ok ? 0 : 1;
+}
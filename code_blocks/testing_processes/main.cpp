@@ -0,0 +1,144 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include "xvfs.hpp"
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+// проверка работы одной VFS из двух процессов (set_shared_access()): изменения одного процесса
+// видны другому без повторного открытия, пакет изменений не пускает другой процесс к VFS
+// программа возвращает 0, если все проверки прошли
+
+const std::string file_name = "testing_processes.dat";
+const int files_size = 50;
+const int steps_size = 300;
+
+// содержимое и размер файла зависят от имени и версии, версия записана в начале файла
+std::string make_data(const std::string& name, int version) {
+    std::string data(100 + (version * 37) % 3000, '\0');
+    std::memcpy(&data[0], &version, sizeof(version));
+    for(size_t i = sizeof(version); i < data.size(); ++i) {
+        data[i] = (char)(name.size() * 13 + version * 7 + i);
+    }
+    return data;
+}
+
+// прочитанный файл должен совпадать с записанной версией, version < 0 - с любой
+bool check_file(xvfs& vfs, const std::string& name, int version) {
+    char* data = NULL;
+    const long len = vfs.read_file(name, data);
+    bool is_ok = len >= (long)sizeof(version);
+    if(is_ok) {
+        int file_version = 0;
+        std::memcpy(&file_version, data, sizeof(file_version));
+        const std::string expected = make_data(name, file_version);
+        is_ok = (version < 0 || version == file_version) &&
+            len == (long)expected.size() && std::memcmp(data, expected.data(), len) == 0;
+    }
+    if(data != NULL) delete[] data;
+    return is_ok;
+}
+
+std::string get_name(const std::string& prefix, int file) {
+    return prefix + "_" + std::to_string(file);
+}
+
+#if !defined(_WIN32)
+// процесс пишет свои файлы и читает уже записанные файлы другого процесса
+bool run_writer(int storage_type, const std::string& prefix, const std::string& other_prefix) {
+    xvfs vfs(file_name, 512, xvfs::NO_COMPRESSION, storage_type);
+    if(!vfs.set_shared_access(true)) return false;
+    bool is_ok = true;
+    for(int step = 0; step < steps_size; ++step) {
+        const std::string name = get_name(prefix, step % files_size);
+        const std::string data = make_data(name, step);
+        if(!vfs.write_file(name, const_cast<char*>(data.data()), data.size())) is_ok = false;
+        const std::string other_name = get_name(other_prefix, step % files_size);
+        if(vfs.get_len_file(other_name) >= 0 && !check_file(vfs, other_name, -1)) is_ok = false;
+    }
+    return is_ok;
+}
+
+// два процесса одновременно пишут и читают файлы, контрольные точки делают оба
+bool test_two_writers(int storage_type) {
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".shm").c_str());
+    {
+        xvfs vfs(file_name, 512, xvfs::NO_COMPRESSION, storage_type);
+    }
+    pid_t pid = fork();
+    if(pid < 0) return false;
+    if(pid == 0) {
+        _exit(run_writer(storage_type, "child", "parent") ? 0 : 1);
+    }
+    bool is_ok = run_writer(storage_type, "parent", "child");
+    int status = 0;
+    if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) is_ok = false;
+    // последние версии файлов обоих процессов
+    for(int reopen = 0; reopen < 2; ++reopen) {
+        xvfs vfs(file_name, 512, xvfs::NO_COMPRESSION, storage_type);
+        if(reopen == 0 && !vfs.set_shared_access(true)) return false;
+        for(int file = 0; file < files_size; ++file) {
+            const int version = steps_size - files_size + file;
+            if(!check_file(vfs, get_name("parent", file), version)) is_ok = false;
+            if(!check_file(vfs, get_name("child", file), version)) is_ok = false;
+        }
+    }
+    return is_ok;
+}
+
+// процесс, открывший VFS раньше, видит файл другого процесса без повторного открытия,
+// а пакет изменений не пускает другой процесс записать файл до commit()
+bool test_batch(int storage_type) {
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".shm").c_str());
+    xvfs vfs(file_name, 512, xvfs::NO_COMPRESSION, storage_type);
+    if(!vfs.set_shared_access(true)) return false;
+    const std::string data = make_data("batch", 1);
+    if(!vfs.begin_batch() || !vfs.write_file("batch", const_cast<char*>(data.data()), data.size())) return false;
+    pid_t pid = fork();
+    if(pid < 0) return false;
+    if(pid == 0) {
+        xvfs child_vfs(file_name, 512, xvfs::NO_COMPRESSION, storage_type);
+        if(!child_vfs.set_shared_access(true)) _exit(1);
+        // запись ждет, пока родитель сохранит пакет, поэтому файл пакета уже виден
+        const std::string child_data = make_data("child", 2);
+        if(!child_vfs.write_file("child", const_cast<char*>(child_data.data()), child_data.size())) _exit(1);
+        _exit(check_file(child_vfs, "batch", 1) ? 0 : 1);
+    }
+    usleep(200000);
+    bool is_ok = vfs.get_len_file("child") == xvfs::ERROR_VIRTUAL_FILE_NOT_FOUND;
+    if(!vfs.commit()) is_ok = false;
+    int status = 0;
+    if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) is_ok = false;
+    if(!check_file(vfs, "child", 2) || !check_file(vfs, "batch", 1)) is_ok = false;
+    return is_ok;
+}
+#endif
+
+int main() {
+#   if defined(_WIN32)
+    std::cout << "test needs fork()" << std::endl;
+    return 0;
+#   else
+    const int storage_types[] = {xvfs::USE_FSTREAM_STORAGE, xvfs::USE_MMAP_STORAGE, xvfs::USE_PREAD_STORAGE};
+    bool is_ok = true;
+    for(int storage_type : storage_types) {
+        std::cout << "storage " << storage_type << std::endl;
+        bool is_test = test_two_writers(storage_type);
+        std::cout << "two writers " << (is_test ? "ok" : "error") << std::endl;
+        is_ok = is_ok && is_test;
+        is_test = test_batch(storage_type);
+        std::cout << "batch " << (is_test ? "ok" : "error") << std::endl;
+        is_ok = is_ok && is_test;
+    }
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".shm").c_str());
+    std::cout << (is_ok ? "all tests ok" : "some tests failed") << std::endl;
+    return is_ok ? 0 : 1;
+#   endif
+}
@@ -0,0 +1,175 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include "xvfs.hpp"
+
+// проверка набора VFS (xvfs_sharded): файл лежит ровно в одном шарде, выбранном по хэшу,
+// функции набора работают так же, как у xvfs, после повторного открытия файлы находятся в тех же шардах
+// программа возвращает 0, если все проверки прошли
+
+const int shards_size = 4;
+const int files_size = 1000;
+const int threads_size = 4;
+
+std::vector<std::string> get_shard_names() {
+    std::vector<std::string> shard_names;
+    for(int i = 0; i < shards_size; ++i) {
+        shard_names.push_back("testing_sharded_" + std::to_string(i) + ".dat");
+    }
+    return shard_names;
+}
+
+void remove_shards() {
+    const std::vector<std::string> shard_names = get_shard_names();
+    for(size_t i = 0; i < shard_names.size(); ++i) {
+        std::remove(shard_names[i].c_str());
+    }
+}
+
+std::string get_name(int file) {
+    return "file_" + std::to_string(file);
+}
+
+// содержимое и размер файла зависят от номера файла и версии
+std::string make_data(int file, int version) {
+    std::string data(1 + (file * 131 + version * 977) % 5000, '\0');
+    for(size_t i = 0; i < data.size(); ++i) {
+        data[i] = (char)(file * 7 + version * 3 + i);
+    }
+    return data;
+}
+
+bool check_file(xvfs_sharded& vfs, int file, int version) {
+    const std::string expected = make_data(file, version);
+    char* data = NULL;
+    const long len = vfs.read_file(get_name(file), data);
+    const bool is_ok = len == (long)expected.size() && std::memcmp(data, expected.data(), len) == 0;
+    if(data != NULL) delete[] data;
+    return is_ok;
+}
+
+// файл есть только в своем шарде, файлы распределены по всем шардам
+bool check_shards(xvfs_sharded& vfs, const std::vector<bool>& is_deleted) {
+    std::vector<int> shard_files(vfs.get_shards_size(), 0);
+    for(int file = 0; file < files_size; ++file) {
+        const long long hash = vfs.calculate_crc64(get_name(file));
+        const size_t index = vfs.get_shard_index(hash);
+        for(size_t i = 0; i < vfs.get_shards_size(); ++i) {
+            const bool is_file = vfs.get_shard(i)->get_len_file(hash) >= 0;
+            if(is_file != (i == index && !is_deleted[file])) return false;
+        }
+        if(!is_deleted[file]) ++shard_files[index];
+    }
+    for(size_t i = 0; i < shard_files.size(); ++i) {
+        if(shard_files[i] < files_size / shards_size / 2) return false;
+    }
+    return true;
+}
+
+bool test_sharded() {
+    remove_shards();
+    std::vector<bool> is_deleted(files_size, false);
+    {
+        xvfs_sharded vfs(get_shard_names(), 512, xvfs::NO_COMPRESSION);
+        if(!vfs.is_open() || vfs.get_shards_size() != shards_size) return false;
+        for(int file = 0; file < files_size; ++file) {
+            const std::string data = make_data(file, 0);
+            if(!vfs.write_file(get_name(file), const_cast<char*>(data.data()), data.size())) return false;
+        }
+        for(int file = 0; file < files_size; file += 7) {
+            if(!vfs.delete_file(get_name(file))) return false;
+            is_deleted[file] = true;
+        }
+        if(!check_shards(vfs, is_deleted)) return false;
+        // части файлов и файлы из разных шардов одним вызовом
+        for(int file = 1; file < files_size; file += 50) {
+            if(is_deleted[file]) continue;
+            const std::string expected = make_data(file, 0);
+            const unsigned long offset = expected.size() / 3;
+            std::vector<char> part(expected.size());
+            const long len = vfs.read_range(get_name(file), offset, expected.size(), &part[0]);
+            if(len != (long)(expected.size() - offset) || std::memcmp(&part[0], expected.data() + offset, len) != 0) return false;
+        }
+        std::vector<std::string> names;
+        for(int file = files_size - 1; file >= 0; file -= 3) {
+            names.push_back(get_name(file));
+        }
+        std::vector<char*> data;
+        std::vector<long> lens;
+        long count = vfs.read_files(names, data, lens);
+        long expected_count = 0;
+        bool is_ok = true;
+        for(size_t i = 0; i < names.size(); ++i) {
+            const int file = files_size - 1 - 3 * (int)i;
+            if(is_deleted[file]) {
+                if(lens[i] != xvfs::ERROR_VIRTUAL_FILE_NOT_FOUND) is_ok = false;
+            } else {
+                const std::string expected = make_data(file, 0);
+                if(lens[i] != (long)expected.size() || std::memcmp(data[i], expected.data(), lens[i]) != 0) is_ok = false;
+                ++expected_count;
+            }
+            if(data[i] != NULL) delete[] data[i];
+        }
+        if(!is_ok || count != expected_count) return false;
+    }
+    // после повторного открытия файлы находятся в тех же шардах
+    xvfs_sharded vfs(get_shard_names(), 512, xvfs::NO_COMPRESSION);
+    if(!check_shards(vfs, is_deleted)) return false;
+    for(int file = 0; file < files_size; ++file) {
+        if(is_deleted[file]) {
+            if(vfs.get_len_file(get_name(file)) != xvfs::ERROR_VIRTUAL_FILE_NOT_FOUND) return false;
+        } else
+        if(!check_file(vfs, file, 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// потоки одновременно перезаписывают свои файлы, которые лежат во всех шардах
+bool test_threads() {
+    remove_shards();
+    bool is_ok = true;
+    {
+        xvfs_sharded vfs(get_shard_names(), 512, xvfs::NO_COMPRESSION);
+        std::vector<std::thread> threads;
+        std::vector<char> is_thread_ok(threads_size, 1);
+        for(int t = 0; t < threads_size; ++t) {
+            threads.push_back(std::thread([&vfs, &is_thread_ok, t]() {
+                for(int version = 1; version <= 3; ++version) {
+                    for(int file = t; file < files_size; file += threads_size) {
+                        const std::string data = make_data(file, version);
+                        if(!vfs.write_file(get_name(file), const_cast<char*>(data.data()), data.size())) is_thread_ok[t] = 0;
+                        if(!check_file(vfs, file, version)) is_thread_ok[t] = 0;
+                    }
+                }
+            }));
+        }
+        for(size_t t = 0; t < threads.size(); ++t) {
+            threads[t].join();
+            if(!is_thread_ok[t]) is_ok = false;
+        }
+    }
+    xvfs_sharded vfs(get_shard_names(), 512, xvfs::NO_COMPRESSION);
+    if(!check_shards(vfs, std::vector<bool>(files_size, false))) return false;
+    for(int file = 0; file < files_size; ++file) {
+        if(!check_file(vfs, file, 3)) is_ok = false;
+    }
+    return is_ok;
+}
+
+int main() {
+    bool is_ok = true;
+    bool is_test = test_sharded();
+    std::cout << "sharded " << (is_test ? "ok" : "error") << std::endl;
+    is_ok = is_ok && is_test;
+    is_test = test_threads();
+    std::cout << "threads " << (is_test ? "ok" : "error") << std::endl;
+    is_ok = is_ok && is_test;
+    remove_shards();
+    std::cout << (is_ok ? "all tests ok" : "some tests failed") << std::endl;
+    return is_ok ? 0 : 1;
+}
@@ -0,0 +1,170 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "xvfs.hpp"
+
+// проверка работы одной VFS из нескольких потоков: читатели не должны мешать писателю закончить запись,
+// читатели снимков индекса должны видеть только целые версии файлов, пока писатель их перезаписывает и удаляет
+// нужна библиотека zlib (макрос XFVS_USE_ZLIB), программа возвращает 0, если все проверки прошли
+
+const std::string file_name = "testing_threads.dat";
+const int files_size = 100;
+
+// содержимое и размер файла зависят от номера файла и версии, версия записана в начале файла
+std::string make_data(int file, int version) {
+    std::string data(2000 + file * 50 + (version % 64) * 1000, '\0');
+    std::memcpy(&data[0], &version, sizeof(version));
+    for(size_t i = sizeof(version); i < data.size(); ++i) {
+        data[i] = (char)('a' + (file + version + i / 16) % 26);
+    }
+    return data;
+}
+
+// прочитанный файл должен совпадать с одной из записанных версий
+bool check_data(int file, const char* data, long len) {
+    int version = 0;
+    if(len < (long)sizeof(version)) return false;
+    std::memcpy(&version, data, sizeof(version));
+    const std::string expected = make_data(file, version);
+    return len == (long)expected.size() && std::memcmp(data, expected.data(), len) == 0;
+}
+
+// читатели непрерывно читают файлы, пока писатель не закончит запись
+bool test_writer_progress() {
+    std::remove(file_name.c_str());
+    xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_1);
+    for(int file = 0; file < files_size; ++file) {
+        const std::string data = make_data(file, 0);
+        if(!vfs.write_file(file, const_cast<char*>(data.data()), data.size())) return false;
+    }
+    const int readers_size = 3;
+    const int writes_size = 20;
+    const double max_seconds = 10;
+    std::atomic<bool> is_stop(false);
+    std::atomic<long> reads(0);
+    std::atomic<int> errors(0);
+    std::vector<std::thread> readers;
+    for(int i = 0; i < readers_size; ++i) {
+        readers.push_back(std::thread([&vfs, &is_stop, &reads, &errors, i]() {
+            for(int step = i; !is_stop; ++step) {
+                const int file = step % files_size;
+                char* data = NULL;
+                const long len = vfs.read_file(file, data);
+                if(!check_data(file, data, len)) ++errors;
+                if(data != NULL) delete[] data;
+                ++reads;
+            }
+        }));
+    }
+    // писатель начинает, когда читатели уже работают
+    while(reads < 1000) std::this_thread::yield();
+    // если писатель не успел за отведенное время, читатели останавливаются, чтобы запись завершилась
+    std::atomic<bool> is_written(false);
+    std::thread watchdog([&is_stop, &is_written, max_seconds]() {
+        const auto start_time = std::chrono::steady_clock::now();
+        while(!is_written && std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count() < max_seconds) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        is_stop = true;
+    });
+    const auto start_time = std::chrono::steady_clock::now();
+    for(int version = 1; version <= writes_size; ++version) {
+        const int file = version % files_size;
+        const std::string data = make_data(file, version);
+        if(!vfs.write_file(file, const_cast<char*>(data.data()), data.size())) ++errors;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    const long writer_reads = reads;
+    const bool is_in_time = !is_stop && seconds < max_seconds;
+    is_written = true;
+    watchdog.join();
+    for(size_t i = 0; i < readers.size(); ++i) {
+        readers[i].join();
+    }
+    std::cout << "writes " << writes_size << " in " << seconds << " s, reads " << writer_reads << std::endl;
+    return errors == 0 && is_in_time;
+}
+
+// читатели снимков индекса работают без блокировок, пока писатель перезаписывает, удаляет и увеличивает файлы
+bool test_snapshot_readers(int storage_type) {
+    std::remove(file_name.c_str());
+    bool is_ok = true;
+    {
+        xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_1, storage_type);
+        if(!vfs.set_index_snapshots(true)) return false;
+        for(int file = 0; file < files_size; ++file) {
+            const std::string data = make_data(file, 0);
+            if(!vfs.write_file(file, const_cast<char*>(data.data()), data.size())) return false;
+        }
+        const int readers_size = 3;
+        const int writes_size = 2000;
+        std::atomic<bool> is_stop(false);
+        std::atomic<long> reads(0);
+        std::atomic<long> deleted_reads(0);
+        std::atomic<int> errors(0);
+        std::vector<std::thread> readers;
+        for(int i = 0; i < readers_size; ++i) {
+            readers.push_back(std::thread([&vfs, &is_stop, &reads, &deleted_reads, &errors, i]() {
+                for(int step = i; !is_stop; ++step) {
+                    // файлы с номерами от files_size писатель создает и удаляет
+                    const int file = step % (2 * files_size);
+                    char* data = NULL;
+                    const long len = vfs.read_file(file, data);
+                    if(file >= files_size && len == xvfs::ERROR_VIRTUAL_FILE_NOT_FOUND) {
+                        ++deleted_reads;
+                    } else
+                    if(!check_data(file, data, len)) {
+                        ++errors;
+                    }
+                    if(data != NULL) delete[] data;
+                    ++reads;
+                }
+            }));
+        }
+        while(reads < 1000) std::this_thread::yield();
+        for(int version = 1; version <= writes_size; ++version) {
+            const int file = (version * 7) % (2 * files_size);
+            if(file >= files_size && version % 3 == 0) {
+                if(!vfs.delete_file(file) && vfs.get_len_file(file) >= 0) ++errors;
+                continue;
+            }
+            // размер файла меняется с версией, поэтому файлы переезжают в новые сектора, а файл VFS растет
+            const std::string data = make_data(file, version);
+            if(!vfs.write_file(file, const_cast<char*>(data.data()), data.size())) ++errors;
+        }
+        is_stop = true;
+        for(size_t i = 0; i < readers.size(); ++i) {
+            readers[i].join();
+        }
+        std::cout << "storage " << storage_type << ": reads " << reads << ", deleted " << deleted_reads << ", errors " << errors << std::endl;
+        is_ok = errors == 0;
+    }
+    // после повторного открытия файлы читаются без снимков
+    xvfs vfs(file_name, 512, xvfs::USE_ZLIB_LEVEL_1, storage_type);
+    for(int file = 0; file < files_size; ++file) {
+        char* data = NULL;
+        const long len = vfs.read_file(file, data);
+        if(!check_data(file, data, len)) is_ok = false;
+        if(data != NULL) delete[] data;
+    }
+    return is_ok;
+}
+
+int main() {
+    bool is_ok = test_writer_progress();
+    std::cout << "writer progress " << (is_ok ? "ok" : "error") << std::endl;
+    const int storage_types[] = {xvfs::USE_FSTREAM_STORAGE, xvfs::USE_MMAP_STORAGE, xvfs::USE_PREAD_STORAGE};
+    for(int storage_type : storage_types) {
+        const bool is_snapshot_ok = test_snapshot_readers(storage_type);
+        std::cout << "snapshot readers " << (is_snapshot_ok ? "ok" : "error") << std::endl;
+        is_ok = is_ok && is_snapshot_ok;
+    }
+    std::remove(file_name.c_str());
+    std::cout << (is_ok ? "all tests ok" : "some tests failed") << std::endl;
+    return is_ok ? 0 : 1;
+}
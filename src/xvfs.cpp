@@ -3,18 +3,174 @@
 #include <algorithm>
 #include <cstring>
 #include <cmath>
+#include <chrono>
+#include <thread>
+#include <atomic>
+
+#if defined(_WIN32)
+#include <windows.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
 
-#ifdef XFVS_USE_MINLIZO
+/** \brief Получить номер младшего установленного бита
+ * \param value слово, не равное нулю
+ * \return номер бита
+ */
+static inline unsigned long get_lowest_bit(unsigned long long value) {
+#   if defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanForward64(&index, value);
+    return index;
+#   else
+    return __builtin_ctzll(value);
+#   endif
+}
 
-#define HEAP_ALLOC(var,size) \
-    lzo_align_t __LZO_MMODEL var [ ((size) + (sizeof(lzo_align_t) - 1)) / sizeof(lzo_align_t) ]
+/** \brief Получить номер старшего установленного бита
+ * \param value слово, не равное нулю
+ * \return номер бита
+ */
+static inline unsigned long get_highest_bit(unsigned long long value) {
+#   if defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanReverse64(&index, value);
+    return index;
+#   else
+    return 63 - __builtin_clzll(value);
+#   endif
+}
 
-static HEAP_ALLOC(wrkmem, LZO1X_1_MEM_COMPRESS);
+static long long xvfs_crc64_table[256];
+static std::once_flag xvfs_crc64_table_flag;
+
+thread_local xvfs::_xvfs_lock* xvfs::_xvfs_lock::last_lock = NULL;
+
+xvfs::_xvfs_lock::_xvfs_lock(xvfs* _vfs, bool _is_unique) {
+    vfs = _vfs;
+    is_unique = _is_unique;
+    is_locked = true;
+    slot = NULL;
+    snapshot = NULL;
+    is_process_reader = false;
+    is_process_error = false;
+    for(_xvfs_lock* lock = last_lock; lock != NULL; lock = lock->prev_lock) {
+        if(lock->vfs == vfs) {
+            is_locked = false;
+            break;
+        }
+    }
+    if(is_locked && !is_unique && vfs->index_snapshot.load() != NULL) {
+        // читатель снимков не блокирует VFS, а отмечает в своей ячейке эпоху, в которой взял снимок
+        static thread_local size_t slot_hint = std::hash<std::thread::id>()(std::this_thread::get_id());
+        const unsigned long long epoch = vfs->snapshot_epoch.load();
+        for(size_t i = 0; i < reader_slots_size && slot == NULL; ++i) {
+            _xvfs_reader_slot& reader_slot = vfs->reader_slots[(slot_hint + i) % reader_slots_size];
+            unsigned long long free_epoch = 0;
+            if(reader_slot.epoch.load(std::memory_order_relaxed) == 0 &&
+                reader_slot.epoch.compare_exchange_strong(free_epoch, epoch)) slot = &reader_slot;
+        }
+        if(slot != NULL) {
+            snapshot = vfs->index_snapshot.load();
+            if(snapshot == NULL) {
+                slot->epoch.store(0);
+                slot = NULL;
+            }
+        }
+    }
+    // свободных ячеек нет или снимки выключены - берем блокировку
+    if(is_locked && slot == NULL) {
+        if(is_unique) {
+            // изменение встает в очередь, чтобы постоянный поток чтений не откладывал его бесконечно
+            ++vfs->vfs_waiting_writers;
+            vfs->vfs_writer_mutex.lock();
+            vfs->vfs_mutex.lock();
+            vfs->vfs_writer_mutex.unlock();
+            --vfs->vfs_waiting_writers;
+            // пакет изменений держит блокировку файла до commit() или rollback()
+            if(vfs->shared_state != NULL && !vfs->is_process_locked) {
+                if(!vfs->lock_process(true)) {
+                    is_process_error = true;
+                } else
+                if(!vfs->sync_shared_state()) {
+                    // без изменений других процессов менять VFS нельзя
+                    vfs->unlock_process();
+                    is_process_error = true;
+                }
+            }
+        } else {
+            // новое чтение ждет, пока ожидающие изменения получат блокировку
+            if(vfs->vfs_waiting_writers != 0) {
+                vfs->vfs_writer_mutex.lock();
+                vfs->vfs_writer_mutex.unlock();
+            }
+            vfs->vfs_mutex.lock_shared();
+            while(vfs->shared_state != NULL && !vfs->is_process_locked) {
+                if(!vfs->lock_process(false)) {
+                    is_process_error = true;
+                    break;
+                }
+                if(!vfs->is_shared_changed()) {
+                    is_process_reader = true;
+                    break;
+                }
+                // VFS изменил другой процесс, состояние процесса обновляем под исключительной блокировкой
+                vfs->unlock_process();
+                vfs->vfs_mutex.unlock_shared();
+                vfs->vfs_mutex.lock();
+                bool is_synced = true;
+                if(vfs->shared_state != NULL && !vfs->is_process_locked) {
+                    is_synced = vfs->lock_process(false);
+                    if(is_synced) {
+                        is_synced = vfs->sync_shared_state();
+                        vfs->unlock_process();
+                    }
+                }
+                vfs->vfs_mutex.unlock();
+                vfs->vfs_mutex.lock_shared();
+                if(!is_synced) {
+                    is_process_error = true;
+                    break;
+                }
+            }
+        }
+    }
+    prev_lock = last_lock;
+    last_lock = this;
+}
 
-#endif
+xvfs::_xvfs_lock::~_xvfs_lock() {
+    last_lock = prev_lock;
+    if(slot != NULL) {
+        slot->epoch.store(0);
+    } else
+    if(is_locked) {
+        if(is_unique) {
+            if(vfs->shared_state != NULL && vfs->is_process_locked) {
+                vfs->publish_shared_state();
+                if(!vfs->is_batch) vfs->unlock_process();
+            }
+            vfs->vfs_mutex.unlock();
+        } else {
+            if(is_process_reader) vfs->unlock_process();
+            vfs->vfs_mutex.unlock_shared();
+        }
+    }
+}
 
-static long long xvfs_crc64_table[256];
-static bool is_svfs_crc64_table = false;
+const xvfs::_xvfs_snapshot* xvfs::_xvfs_lock::get_snapshot(const xvfs* vfs) {
+    for(_xvfs_lock* lock = last_lock; lock != NULL; lock = lock->prev_lock) {
+        if(lock->vfs == vfs && lock->is_locked) return lock->snapshot;
+    }
+    return NULL;
+}
 
 bool xvfs::check_file(std::string file_name) {
    std::ifstream file;
@@ -32,95 +188,68 @@ bool xvfs::create_file(std::string file_name) {
 }
 
 xvfs::~xvfs() {
-    fvs_file.close();
+    // поставленные асинхронные вызовы выполняются до закрытия
+    stop_async_workers();
+    // несохраненный пакет изменений отменяется
+    if(is_batch) rollback();
+    // дожидаемся читателей снимков, отложенные сектора освобождаем до контрольной точки
+    publish_snapshot(NULL);
+    reclaim_retired(true);
+    // при закрытии делаем контрольную точку, чтобы файл VFS читался и без журнала
+    // в режиме нескольких процессов журнал сохраняется при записи, когда он заполнится
+    if(is_open_file && log_tail > 0 && shared_state == NULL) save_header();
+    close_storage();
+    close_shared_state();
+    free_index_page(index_root);
+    stop_compression_workers();
+#   if defined(XFVS_USE_ZSTD)
+    free_zstd_cdicts();
+    for(auto it = zstd_ddicts.begin(); it != zstd_ddicts.end(); ++it) {
+        ZSTD_freeDDict(it->second);
+    }
+#   endif
 }
 
 xvfs::xvfs(std::string file_name) {
-    xvfs::file_name = file_name; // запоминаем имя файла виртуальноц файловой системы
-    generate_table(); // инициализируем crc таблицу
-    if(!check_file(file_name)) {
-        is_open_file = create_file(file_name);
-        if(is_open_file) {
-            fvs_file = std::fstream(file_name, std::ios_base::binary | std::ios::in | std::ios::out | std::ios::ate);
-            if (!fvs_file.is_open()) {
-                is_open_file = false;
-                return; // не смогли октрыть файл
-            }
-            init_xvfs_header(512, NO_COMPRESSION);
-            save_header();
-        }
-    } else {
-        fvs_file = std::fstream(file_name, std::ios_base::binary | std::ios::in | std::ios::out | std::ios::ate);
-        if (!fvs_file.is_open()) {
-            is_open_file = false;
-            return; // не смогли октрыть файл
-        }
-        is_open_file = read_header();
-#       ifdef XFVS_USE_MINLIZO
-        if(is_open_file && xvfs_header.compression_type == USE_MINLIZO && lzo_init() != LZO_E_OK) {
-            //std::cout << "lzo_init() != LZO_E_OK" << std::endl;
-            is_open_file = false;
-        }
-#       endif
-    }
+    init_vfs(file_name, 512, NO_COMPRESSION, USE_PREAD_STORAGE);
 }
 
 xvfs::xvfs(std::string file_name, int sector_size) {
-    const long min_sector_size = 32;
-    xvfs::file_name = file_name; // запоминаем имя файла виртуальноц файловой системы
-    generate_table(); // инициализируем crc таблицу
-    if(!check_file(file_name)) {
-        //std::cout << "!check_file" << std::endl;
-        if(sector_size < min_sector_size) {
-            is_open_file = false;
-            return;
-        }
-        is_open_file = create_file(file_name);
-        if(is_open_file) {
-            fvs_file = std::fstream(file_name, std::ios_base::binary | std::ios::in | std::ios::out | std::ios::ate);
-            if (!fvs_file.is_open()) {
-                is_open_file = false;
-                return; // не смогли октрыть файл
-            }
-            init_xvfs_header(sector_size, NO_COMPRESSION);
-            save_header();
-        }
-    } else {
-        //std::cout << "check_file" << std::endl;
-        fvs_file = std::fstream(file_name, std::ios_base::binary | std::ios::in | std::ios::out | std::ios::ate);
-        if (!fvs_file.is_open()) {
-            is_open_file = false;
-            return; // не смогли октрыть файл
-        }
-        is_open_file = read_header();
-#       ifdef XFVS_USE_MINLIZO
-        if(is_open_file && xvfs_header.compression_type == USE_MINLIZO && lzo_init() != LZO_E_OK) {
-            //std::cout << "lzo_init() != LZO_E_OK" << std::endl;
-            is_open_file = false;
-        }
-#       endif
-    }
+    init_vfs(file_name, sector_size, NO_COMPRESSION, USE_PREAD_STORAGE);
 }
 
 xvfs::xvfs(std::string file_name, int sector_size, int compression_type) {
+    init_vfs(file_name, sector_size, compression_type, USE_PREAD_STORAGE);
+}
+
+xvfs::xvfs(std::string file_name, int sector_size, int compression_type, int storage_type) {
+    init_vfs(file_name, sector_size, compression_type, storage_type);
+}
+
+void xvfs::init_vfs(std::string file_name, int sector_size, int compression_type, int storage_type) {
     const long min_sector_size = 32;
     xvfs::file_name = file_name; // запоминаем имя файла виртуальноц файловой системы
+    xvfs::storage_type = storage_type;
     generate_table(); // инициализируем crc таблицу
+    if(storage_type != USE_FSTREAM_STORAGE && storage_type != USE_MMAP_STORAGE && storage_type != USE_PREAD_STORAGE) {
+        is_open_file = false;
+        return;
+    }
     if(!check_file(file_name)) {
         //std::cout << "!check_file" << std::endl;
-        if(sector_size < min_sector_size || compression_type < 0 || (compression_type > USE_ZLIB_LEVEL_9 && compression_type != USE_MINLIZO && compression_type != USE_LZ4)) {
+        if(sector_size < min_sector_size || !is_compression_type(compression_type)) {
             is_open_file = false;
             return;
         }
         is_open_file = create_file(file_name);
         if(is_open_file) {
-            fvs_file = std::fstream(file_name, std::ios_base::binary | std::ios::in | std::ios::out | std::ios::ate);
-            if (!fvs_file.is_open()) {
+            if (!open_storage()) {
                 is_open_file = false;
                 return; // не смогли октрыть файл
             }
 #           ifdef XFVS_USE_MINLIZO
-            if(compression_type == USE_MINLIZO && lzo_init() != LZO_E_OK) {
+            // тип компрессии задается и для отдельных файлов, поэтому minilzo инициализируется всегда
+            if(lzo_init() != LZO_E_OK) {
                 //std::cout << "lzo_init() != LZO_E_OK" << std::endl;
                 is_open_file = false;
                 return;
@@ -131,14 +260,13 @@ xvfs::xvfs(std::string file_name, int sector_size, int compression_type) {
         }
     } else {
         //std::cout << "check_file" << std::endl;
-        fvs_file = std::fstream(file_name, std::ios_base::binary | std::ios::in | std::ios::out | std::ios::ate);
-        if (!fvs_file.is_open()) {
+        if (!open_storage()) {
             is_open_file = false;
             return; // не смогли октрыть файл
         }
         is_open_file = read_header();
 #       ifdef XFVS_USE_MINLIZO
-        if(is_open_file && xvfs_header.compression_type == USE_MINLIZO && lzo_init() != LZO_E_OK) {
+        if(is_open_file && lzo_init() != LZO_E_OK) {
             //std::cout << "lzo_init() != LZO_E_OK" << std::endl;
             is_open_file = false;
         }
@@ -146,30 +274,510 @@ xvfs::xvfs(std::string file_name, int sector_size, int compression_type) {
     }
 }
 
-bool xvfs::read_header() {
-    if (!fvs_file.is_open()) {
-        return false; // не смогли октрыть файл
+bool xvfs::open_storage() {
+    if(storage_type == USE_FSTREAM_STORAGE) {
+        fvs_file = std::fstream(file_name, std::ios_base::binary | std::ios::in | std::ios::out | std::ios::ate);
+        if (!fvs_file.is_open()) return false;
+        storage_size = fvs_file.tellg();
+        return true;
+    }
+#   if defined(_WIN32)
+    HANDLE handle = CreateFileA(file_name.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(handle == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER file_size;
+    if(!GetFileSizeEx(handle, &file_size)) {
+        CloseHandle(handle);
+        return false;
+    }
+    storage_handle = handle;
+    storage_size = file_size.QuadPart;
+#   else
+    storage_fd = ::open(file_name.c_str(), O_RDWR);
+    if(storage_fd < 0) return false;
+    struct stat file_stat;
+    if(fstat(storage_fd, &file_stat) != 0) {
+        ::close(storage_fd);
+        storage_fd = -1;
+        return false;
+    }
+    storage_size = file_stat.st_size;
+#   endif
+    if(storage_type == USE_MMAP_STORAGE && !map_storage(storage_size)) {
+        close_storage();
+        return false;
+    }
+    return true;
+}
+
+void xvfs::close_storage() {
+    if(storage_type == USE_FSTREAM_STORAGE) {
+        fvs_file.close();
+        return;
+    }
+#   if defined(XFVS_USE_IO_URING)
+    if(storage_ring_state == 1) io_uring_queue_exit(&storage_ring);
+    storage_ring_state = 0;
+#   endif
+    // в режиме нескольких процессов файл отображают и другие процессы, поэтому он не обрезается
+    bool is_mapped = storage_map != NULL && shared_state == NULL;
+    unmap_storage();
+    // отображение растет блоками, поэтому возвращаем файлу его настоящий размер
+#   if defined(_WIN32)
+    if(storage_handle != NULL) {
+        if(is_mapped) {
+            LARGE_INTEGER file_size;
+            file_size.QuadPart = storage_size;
+            if(SetFilePointerEx((HANDLE)storage_handle, file_size, NULL, FILE_BEGIN)) SetEndOfFile((HANDLE)storage_handle);
+        }
+        CloseHandle((HANDLE)storage_handle);
+        storage_handle = NULL;
+    }
+#   else
+    if(storage_fd >= 0) {
+        if(is_mapped && ftruncate(storage_fd, storage_size) != 0) {
+            //std::cout << "ftruncate error" << std::endl;
+        }
+        ::close(storage_fd);
+        storage_fd = -1;
+    }
+#   endif
+}
+
+bool xvfs::map_storage(unsigned long long size) {
+    const unsigned long long min_map_size = 1024 * 1024;
+    const unsigned long long max_map_step = 64 * 1024 * 1024;
+    if(storage_map != NULL && size <= storage_map_size) return true;
+    unsigned long long map_size = storage_map_size < min_map_size ? min_map_size : storage_map_size;
+    while(map_size < size) {
+        map_size += std::min(map_size, max_map_step);
+    }
+    // прежнее отображение закрываем после создания нового, его еще могут читать читатели снимков
+    char* old_map = storage_map;
+    const unsigned long long old_map_size = storage_map_size;
+    void* old_map_handle = NULL;
+#   if defined(_WIN32)
+    old_map_handle = storage_map_handle;
+    // CreateFileMapping сам увеличивает файл до размера отображения
+    HANDLE map_handle = CreateFileMappingA((HANDLE)storage_handle, NULL, PAGE_READWRITE, (DWORD)(map_size >> 32), (DWORD)(map_size & 0xFFFFFFFF), NULL);
+    if(map_handle == NULL) return false;
+    void* map = MapViewOfFile(map_handle, FILE_MAP_ALL_ACCESS, 0, 0, map_size);
+    if(map == NULL) {
+        CloseHandle(map_handle);
+        return false;
+    }
+    storage_map_handle = map_handle;
+#   else
+    struct stat file_stat;
+    if(fstat(storage_fd, &file_stat) != 0) return false;
+    if((unsigned long long)file_stat.st_size < map_size && ftruncate(storage_fd, map_size) != 0) return false;
+    void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, storage_fd, 0);
+    if(map == MAP_FAILED) return false;
+#   endif
+    storage_map = (char*)map;
+    storage_map_size = map_size;
+    if(old_map != NULL) {
+        if(index_snapshot.load() != NULL) {
+            _xvfs_retired retired;
+            retired.snapshot = NULL;
+            retired.map = old_map;
+            retired.map_size = old_map_size;
+            retired.map_handle = old_map_handle;
+            retire_object(retired);
+        } else {
+            unmap_view(old_map, old_map_size, old_map_handle);
+        }
+    }
+    return true;
+}
+
+void xvfs::unmap_storage() {
+    if(storage_map == NULL) return;
+#   if defined(_WIN32)
+    unmap_view(storage_map, storage_map_size, storage_map_handle);
+    storage_map_handle = NULL;
+#   else
+    unmap_view(storage_map, storage_map_size, NULL);
+#   endif
+    storage_map = NULL;
+}
+
+void xvfs::unmap_view(char* map, unsigned long long map_size, void* map_handle) {
+#   if defined(_WIN32)
+    // размер отображения Windows не нужен
+    (void)map_size;
+    UnmapViewOfFile(map);
+    CloseHandle((HANDLE)map_handle);
+#   else
+    // описатель отображения есть только в Windows
+    (void)map_handle;
+    munmap(map, map_size);
+#   endif
+}
+
+bool xvfs::open_shared_state() {
+    const std::string shared_file_name = file_name + ".shm";
+#   if defined(_WIN32)
+    HANDLE handle = CreateFileA(shared_file_name.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(handle == INVALID_HANDLE_VALUE) return false;
+    // CreateFileMapping сам увеличивает файл до размера отображения
+    HANDLE map_handle = CreateFileMappingA(handle, NULL, PAGE_READWRITE, 0, sizeof(_xvfs_shared_state), NULL);
+    void* map = map_handle != NULL ? MapViewOfFile(map_handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(_xvfs_shared_state)) : NULL;
+    if(map == NULL) {
+        if(map_handle != NULL) CloseHandle(map_handle);
+        CloseHandle(handle);
+        return false;
+    }
+    shared_handle = handle;
+    shared_map_handle = map_handle;
+#   else
+    int fd = ::open(shared_file_name.c_str(), O_RDWR | O_CREAT, 0644);
+    if(fd < 0) return false;
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) != 0 ||
+        ((unsigned long long)file_stat.st_size < sizeof(_xvfs_shared_state) && ftruncate(fd, sizeof(_xvfs_shared_state)) != 0)) {
+        ::close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, sizeof(_xvfs_shared_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        ::close(fd);
+        return false;
+    }
+    shared_fd = fd;
+#   endif
+    shared_state = (_xvfs_shared_state*)map;
+    return true;
+}
+
+void xvfs::close_shared_state() {
+    if(shared_state == NULL) return;
+#   if defined(_WIN32)
+    UnmapViewOfFile(shared_state);
+    CloseHandle((HANDLE)shared_map_handle);
+    CloseHandle((HANDLE)shared_handle);
+    shared_map_handle = NULL;
+    shared_handle = NULL;
+#   else
+    munmap(shared_state, sizeof(_xvfs_shared_state));
+    // блокировки файла снимаются вместе с дескриптором
+    ::close(shared_fd);
+    shared_fd = -1;
+#   endif
+    shared_state = NULL;
+    process_readers = 0;
+    is_process_locked = false;
+}
+
+bool xvfs::lock_process(bool is_unique) {
+    std::lock_guard<std::mutex> process_lock(process_mutex);
+    // общую блокировку файла берет первый читатель процесса
+    if(!is_unique && process_readers++ > 0) return true;
+    // блокируется байт за концом общего состояния, чтобы не мешать чтению самого состояния
+#   if defined(_WIN32)
+    OVERLAPPED overlapped;
+    std::memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = sizeof(_xvfs_shared_state);
+    const bool is_ok = LockFileEx((HANDLE)shared_handle, is_unique ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, 1, 0, &overlapped) != 0;
+#   else
+    struct flock lock;
+    std::memset(&lock, 0, sizeof(lock));
+    lock.l_type = is_unique ? F_WRLCK : F_RDLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = sizeof(_xvfs_shared_state);
+    lock.l_len = 1;
+    int err = 0;
+    // блокировки открытого описания файла не пересекаются между разными VFS одного процесса
+#   if defined(F_OFD_SETLKW)
+    while((err = fcntl(shared_fd, F_OFD_SETLKW, &lock)) != 0 && errno == EINTR) {}
+#   else
+    while((err = fcntl(shared_fd, F_SETLKW, &lock)) != 0 && errno == EINTR) {}
+#   endif
+    const bool is_ok = err == 0;
+#   endif
+    if(!is_ok) {
+        if(!is_unique) --process_readers;
+        return false;
+    }
+    if(is_unique) is_process_locked = true;
+    return true;
+}
+
+void xvfs::unlock_process() {
+    std::lock_guard<std::mutex> process_lock(process_mutex);
+    if(is_process_locked) {
+        is_process_locked = false;
+    } else
+    if(process_readers == 0 || --process_readers > 0) {
+        return;
+    }
+#   if defined(_WIN32)
+    OVERLAPPED overlapped;
+    std::memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = sizeof(_xvfs_shared_state);
+    UnlockFileEx((HANDLE)shared_handle, 0, 1, 0, &overlapped);
+#   else
+    struct flock lock;
+    std::memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_UNLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = sizeof(_xvfs_shared_state);
+    lock.l_len = 1;
+#   if defined(F_OFD_SETLK)
+    fcntl(shared_fd, F_OFD_SETLK, &lock);
+#   else
+    fcntl(shared_fd, F_SETLK, &lock);
+#   endif
+#   endif
+}
+
+bool xvfs::is_shared_changed() {
+    return shared_state->generation != shared_generation;
+}
+
+bool xvfs::sync_shared_state() {
+    if(!is_shared_changed()) return true;
+    const _xvfs_shared_state state = *shared_state;
+    shared_generation = state.generation;
+    // файл мог вырасти, сектора за прежним концом теперь занимают другие процессы
+    storage_size = state.storage_size;
+    if(storage_type == USE_MMAP_STORAGE && !map_storage(storage_size)) {
+        is_open_file = false;
+        return false;
     }
-    fvs_file.seekg(0, std::ios::end);
-    unsigned long file_size = fvs_file.tellg();
-    fvs_file.seekg(0, std::ios::beg);
+    if(state.log_generation != xvfs_header.log_generation || state.log_tail < log_tail) {
+        // была контрольная точка: страницы индекса и журнал переехали, заголовок читаем заново
+        is_open_file = read_header();
+    } else
+    if(state.log_tail > log_tail) {
+        // применяем только новые записи журнала
+        is_open_file = read_log(log_tail);
+#       if defined(XFVS_USE_ZSTD)
+        // другой процесс мог обучить новый словарь
+        is_zstd_dictionary_loaded = false;
+#       endif
+    }
+    return is_open_file;
+}
+
+void xvfs::publish_shared_state() {
+    if(storage_type == USE_FSTREAM_STORAGE) {
+        // другие процессы читают файл, а не буфер std::fstream
+        std::lock_guard<std::mutex> storage_lock(storage_mutex);
+        fvs_file.flush();
+    }
+    if(shared_state->log_generation == xvfs_header.log_generation && shared_state->log_tail == log_tail &&
+        shared_state->storage_size == storage_size) return;
+    shared_state->log_generation = xvfs_header.log_generation;
+    shared_state->log_tail = log_tail;
+    shared_state->storage_size = storage_size;
+    shared_generation = ++shared_state->generation;
+}
+
+bool xvfs::read_storage(unsigned long long offset, char* data, unsigned long size) {
+    if(offset + size > storage_size) return false;
+    if(storage_type == USE_MMAP_STORAGE) {
+        std::memcpy(data, storage_map + offset, size);
+        return true;
+    } else
+    if(storage_type == USE_PREAD_STORAGE) {
+        // позиционное чтение не трогает общий указатель файла
+        while(size > 0) {
+#           if defined(_WIN32)
+            OVERLAPPED overlapped;
+            std::memset(&overlapped, 0, sizeof(overlapped));
+            overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+            overlapped.OffsetHigh = (DWORD)(offset >> 32);
+            DWORD read_bytes = 0;
+            if(!ReadFile((HANDLE)storage_handle, data, size, &read_bytes, &overlapped) || read_bytes == 0) return false;
+#           else
+            ssize_t read_bytes = ::pread(storage_fd, data, size, offset);
+            if(read_bytes < 0 && errno == EINTR) continue;
+            if(read_bytes <= 0) return false;
+#           endif
+            data += read_bytes;
+            offset += read_bytes;
+            size -= read_bytes;
+        }
+        return true;
+    }
+    // у std::fstream один указатель файла на все потоки
+    std::lock_guard<std::mutex> storage_lock(storage_mutex);
     fvs_file.clear();
+    fvs_file.seekg(offset, std::ios::beg);
+    fvs_file.read(data, size);
+    if(!fvs_file) return false;
+    return true;
+}
+
+bool xvfs::write_storage(unsigned long long offset, const char* data, unsigned long size) {
+    const unsigned long long end_offset = offset + size;
+    if(storage_type == USE_MMAP_STORAGE) {
+        if(!map_storage(end_offset)) return false;
+        std::memcpy(storage_map + offset, data, size);
+    } else
+    if(storage_type == USE_PREAD_STORAGE) {
+        while(size > 0) {
+#           if defined(_WIN32)
+            OVERLAPPED overlapped;
+            std::memset(&overlapped, 0, sizeof(overlapped));
+            overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+            overlapped.OffsetHigh = (DWORD)(offset >> 32);
+            DWORD written_bytes = 0;
+            if(!WriteFile((HANDLE)storage_handle, data, size, &written_bytes, &overlapped) || written_bytes == 0) return false;
+#           else
+            ssize_t written_bytes = ::pwrite(storage_fd, data, size, offset);
+            if(written_bytes < 0 && errno == EINTR) continue;
+            if(written_bytes <= 0) return false;
+#           endif
+            data += written_bytes;
+            offset += written_bytes;
+            size -= written_bytes;
+        }
+    } else {
+        std::lock_guard<std::mutex> storage_lock(storage_mutex);
+        fvs_file.clear();
+        fvs_file.seekp(offset, std::ios::beg);
+        fvs_file.write(data, size);
+        if(!fvs_file) return false;
+    }
+    if(end_offset > storage_size) storage_size = end_offset;
+    return true;
+}
+
+bool xvfs::read_storage_batch(std::vector<_xvfs_read_request>& requests) {
+    // запросы отправляются по возрастанию смещения, соседние участки читаются подряд
+    std::vector<size_t> order(requests.size());
+    for(size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+        requests[i].is_read = false;
+    }
+    std::sort(order.begin(), order.end(), [&requests](size_t a, size_t b) {
+        return requests[a].offset < requests[b].offset;
+    });
+#   if defined(XFVS_USE_IO_URING)
+    const unsigned ring_depth = 256;
+    // очередь одна на VFS, читатели пользуются ей по очереди
+    std::unique_lock<std::mutex> storage_lock(storage_mutex);
+    if(storage_ring_state == 0) {
+        storage_ring_state = io_uring_queue_init(ring_depth, &storage_ring, 0) == 0 ? 1 : -1;
+    }
+    if(storage_ring_state == 1) {
+        // участки в очереди, недочитанные остатки добавляются в конец
+        std::vector<_xvfs_read_request> parts;
+        std::vector<size_t> parts_request;
+        std::vector<unsigned long> requests_left(requests.size());
+        for(size_t i = 0; i < order.size(); ++i) {
+            const _xvfs_read_request& request = requests[order[i]];
+            requests_left[order[i]] = request.size;
+            if(request.offset + request.size > storage_size) continue;
+            parts.push_back(request);
+            parts_request.push_back(order[i]);
+        }
+        size_t next = 0;
+        unsigned in_flight = 0;
+        while(next < parts.size() || in_flight > 0) {
+            while(next < parts.size() && in_flight < ring_depth) {
+                struct io_uring_sqe* sqe = io_uring_get_sqe(&storage_ring);
+                if(sqe == NULL) break;
+                io_uring_prep_read(sqe, storage_fd, parts[next].data, parts[next].size, parts[next].offset);
+                io_uring_sqe_set_data(sqe, (void*)next);
+                ++next;
+                ++in_flight;
+            }
+            int err_submit = io_uring_submit_and_wait(&storage_ring, 1);
+            if(err_submit < 0 && err_submit != -EINTR) {
+                // очередь в неизвестном состоянии, дальше читаем без нее
+                io_uring_queue_exit(&storage_ring);
+                storage_ring_state = -1;
+                break;
+            }
+            struct io_uring_cqe* cqe = NULL;
+            unsigned head = 0;
+            unsigned completed = 0;
+            io_uring_for_each_cqe(&storage_ring, head, cqe) {
+                ++completed;
+                const size_t index = (size_t)io_uring_cqe_get_data(cqe);
+                const int res = cqe->res;
+                if(res == -EINTR || res == -EAGAIN) {
+                    parts.push_back(parts[index]);
+                    parts_request.push_back(parts_request[index]);
+                } else
+                if(res > 0) {
+                    requests_left[parts_request[index]] -= res;
+                    if((unsigned long)res < parts[index].size) {
+                        // дочитываем остаток участка
+                        parts.push_back(_xvfs_read_request(parts[index].offset + res, parts[index].data + res, parts[index].size - res));
+                        parts_request.push_back(parts_request[index]);
+                    }
+                }
+            }
+            io_uring_cq_advance(&storage_ring, completed);
+            in_flight -= completed;
+        }
+        if(storage_ring_state == 1) {
+            for(size_t i = 0; i < requests.size(); ++i) {
+                requests[i].is_read = requests_left[i] == 0;
+            }
+        }
+    }
+    storage_lock.unlock();
+#   endif
+    // участки, которые не удалось прочитать через очередь, читаем по одному
+    bool is_all_read = true;
+    for(size_t i = 0; i < order.size(); ++i) {
+        _xvfs_read_request& request = requests[order[i]];
+        if(!request.is_read) request.is_read = read_storage(request.offset, request.data, request.size);
+        if(!request.is_read) is_all_read = false;
+    }
+    return is_all_read;
+}
+
+bool xvfs::read_header() {
+    // индекс перечитывается, поэтому дожидаемся читателей снимков, новые читатели будут ждать блокировку
+    publish_snapshot(NULL);
+    reclaim_retired(true);
+    unsigned long long file_size = storage_size;
+
+    free_index_page(index_root);
+    index_root = NULL;
+    index_free_extents.clear();
+    lookup_table.clear();
+    free_bitmap.clear();
+    free_extents.clear();
+    free_extents_size.clear();
+    free_bitmap_dirty.clear();
+    xvfs_header.free_bitmap_extents.clear();
+    xvfs_header.free_bitmap_sectors = 0;
+    xvfs_header.index_root_sector = 0xFFFFFFFF;
+    xvfs_header.index_page_sectors = 0;
+    used_end_sector = 0;
+#   if defined(XFVS_USE_ZSTD)
+    // текущий словарь мог смениться, ищем его заново при следующем сжатии
+    is_zstd_dictionary_loaded = false;
+#   endif
 
     unsigned long header_size = 0;
     // читаем размер
-    fvs_file.read(reinterpret_cast<char *>(&header_size),sizeof (header_size));
+    if(!read_storage(0, reinterpret_cast<char *>(&header_size), sizeof (header_size))) return false;
+    // в заголовке с индексом файлов вместо размера стоит метка, размер идет следующим полем
+    unsigned long fields_offset = 0;
+    const bool is_legacy_index_tree = header_size == legacy_index_format_mark;
+    if(header_size == index_format_mark || header_size == legacy_index_format_mark || header_size == flat_index_format_mark) {
+        fields_offset = sizeof (header_size);
+        if(!read_storage(fields_offset, reinterpret_cast<char *>(&header_size), sizeof (header_size))) return false;
+    }
     //std::cout << "header_size " << header_size << std::endl;
     //std::cout << "file_size " << file_size << std::endl;
     if(header_size > file_size) {
         return false;
     }
     // читаем размер сектора
-    fvs_file.read(reinterpret_cast<char *>(& xvfs_header.sector_size),sizeof ( xvfs_header.sector_size));
+    if(!read_storage(fields_offset + sizeof (header_size), reinterpret_cast<char *>(& xvfs_header.sector_size),sizeof ( xvfs_header.sector_size))) return false;
     // читаем тип компресии
-    fvs_file.read(reinterpret_cast<char *>(& xvfs_header.compression_type),sizeof ( xvfs_header.compression_type));
+    if(!read_storage(fields_offset + sizeof (header_size) + sizeof (xvfs_header.sector_size), reinterpret_cast<char *>(& xvfs_header.compression_type),sizeof ( xvfs_header.compression_type))) return false;
     //std::cout << "sector_size " << xvfs_header.sector_size << std::endl;
 
-#   if !(defined(XFVS_USE_ZLIB) || defined(XFVS_USE_MINLIZO) || defined(XFVS_USE_LZ4))
+#   if !(defined(XFVS_USE_ZLIB) || defined(XFVS_USE_MINLIZO) || defined(XFVS_USE_LZ4) || defined(XFVS_USE_ZSTD))
     if(xvfs_header.compression_type != NO_COMPRESSION) {
         return false;
     }
@@ -180,524 +788,2733 @@ bool xvfs::read_header() {
         return false;
     }
 
-    // далее уже нельзя просто считывать заголовок, читаем по секторам
-    char* buf = new char[xvfs_header.sector_size];
+    end_sector = (file_size + xvfs_header.sector_size - 1) / xvfs_header.sector_size;
+
+    // далее уже нельзя просто считывать заголовок, читаем по цепочке секторов
     char* header_data = new char[header_size];
-    unsigned long len = 0;
     unsigned long next_sector = 0;
-    unsigned long next_pos = 0;
-
-    while(next_sector != 0xFFFFFFFF) {
-        //std::cout << "next_pos " << next_pos << std::endl;
-        fvs_file.seekg(next_pos, std::ios::beg);
-        fvs_file.read(buf, xvfs_header.sector_size);
-        if(!fvs_file) {
-            delete[] buf;
-            delete[] header_data;
-            return false;
-        }
-        unsigned long old_len = len; // запоминаем длину
-        len += xvfs_header.sector_size - sizeof(unsigned long); // находим количество считанных байтов
-        if(len >= header_size) len = header_size;
-        std::memcpy(header_data + old_len, buf, len - old_len);
-        if(len == header_size) break; // выходим, если все считали
-        // получаем следующий сектор для считывания
-        next_sector = ((unsigned long*)(buf + (xvfs_header.sector_size - sizeof(unsigned long))))[0];
-        // получаем следующую позицию для смещения
-        next_pos = next_sector * xvfs_header.sector_size;
-    }
-    if(len != header_size) {
-        delete[] buf;
+    header_extents.clear();
+    if(!read_chain(0, header_data, header_size, header_extents, next_sector)) {
         delete[] header_data;
-        //std::cout << "error len != header_size" << std::endl;
+        //std::cout << "error read_chain" << std::endl;
         return false;
     }
+    unsigned long long next_pos = (unsigned long long)next_sector * xvfs_header.sector_size;
+    // после уменьшения заголовка в конце цепочки могут остаться сектора без данных, они тоже принадлежат заголовку
+    unsigned long tail_sectors = 0;
+    while(next_sector != 0xFFFFFFFF && next_sector < end_sector && tail_sectors < end_sector) {
+        add_extent(header_extents, next_sector, 1);
+        if(!read_storage(next_pos + xvfs_header.sector_size - sizeof(unsigned long), reinterpret_cast<char *>(&next_sector), sizeof(unsigned long))) break;
+        next_pos = (unsigned long long)next_sector * xvfs_header.sector_size;
+        ++tail_sectors;
+    }
     // парсим header_data
+    // файлы в самом заголовке есть только у файлов VFS без индекса файлов
+    std::vector<_xvfs_file_header> files;
+    std::vector<std::vector<_xvfs_extent>> files_extents;
     unsigned long files_size = 0;
-    unsigned long offset = sizeof (header_size) + sizeof (xvfs_header.sector_size) + sizeof (xvfs_header.compression_type);
+    unsigned long offset = fields_offset + sizeof (header_size) + sizeof (xvfs_header.sector_size) + sizeof (xvfs_header.compression_type);
     files_size = ((unsigned long*)(header_data + offset))[0];
     //std::cout << "files_size " << files_size << std::endl;
     offset += sizeof (files_size);
-    xvfs_header.files.resize(files_size);
+    files.resize(files_size);
     for(unsigned long i = 0; i < files_size; ++i) {
-        xvfs_header.files[i] = ((_xvfs_file_header*)(header_data + offset))[0];
-        offset += sizeof (_xvfs_file_header);
-        //std::cout << "xvfs_header.files[" << i << "].hash " << xvfs_header.files[i].hash << std::endl;
+        const _xvfs_legacy_file_header file = ((_xvfs_legacy_file_header*)(header_data + offset))[0];
+        files[i] = _xvfs_file_header(file.hash, file.size, file.start_sector, file.real_size, xvfs_header.compression_type);
+        offset += sizeof (_xvfs_legacy_file_header);
+        //std::cout << "files[" << i << "].hash " << files[i].hash << std::endl;
     }
+    // список пустых секторов есть только у файлов VFS без карты пустых секторов
+    std::vector<unsigned long> empty_sectors;
     unsigned long empty_sectors_size = 0;
     empty_sectors_size = ((unsigned long*)(header_data + offset))[0];
     //std::cout << "empty_sectors_size " << empty_sectors_size << std::endl;
     offset += sizeof (empty_sectors_size);
-    xvfs_header.empty_sectors.resize(empty_sectors_size);
+    empty_sectors.resize(empty_sectors_size);
     for(unsigned long i = 0; i < empty_sectors_size; ++i) {
-        xvfs_header.empty_sectors[i] = ((unsigned long*)(header_data + offset))[0];
+        empty_sectors[i] = ((unsigned long*)(header_data + offset))[0];
         offset += sizeof (unsigned long);
-        //std::cout << "xvfs_header.empty_sectors[" << i << "] " << xvfs_header.empty_sectors[i] << std::endl;
+        //std::cout << "empty_sectors[" << i << "] " << empty_sectors[i] << std::endl;
+    }
+    // читаем секции заголовка
+    files_extents.resize(files_size);
+    xvfs_header.log_extents.clear();
+    xvfs_header.log_generation = 0;
+    // индекс в виде отсортированного массива (предыдущая версия формата)
+    unsigned long flat_index_size = 0;
+    std::vector<_xvfs_extent> flat_index_extents;
+    while(offset + 2 * sizeof(unsigned long) <= header_size) {
+        unsigned long section_id = ((unsigned long*)(header_data + offset))[0];
+        unsigned long section_size = ((unsigned long*)(header_data + offset))[1];
+        offset += 2 * sizeof(unsigned long);
+        if(section_size > header_size - offset) break;
+        if(section_id == SECTION_FILES_EXTENTS) {
+            if(!parse_files_extents(header_data + offset, section_size, files_extents)) {
+                files_extents.clear();
+                files_extents.resize(files_size);
+            }
+        } else
+        if(section_id == SECTION_LOG) {
+            parse_log(header_data + offset, section_size);
+        } else
+        if(section_id == SECTION_FREE_BITMAP && section_size >= 2 * sizeof(unsigned long)) {
+            const unsigned long* section = (const unsigned long*)(header_data + offset);
+            unsigned long extents_size = section[1];
+            if(extents_size <= (section_size - 2 * sizeof(unsigned long)) / sizeof(_xvfs_extent)) {
+                xvfs_header.free_bitmap_sectors = section[0];
+                xvfs_header.free_bitmap_extents.resize(extents_size);
+                if(extents_size > 0) std::memcpy(&xvfs_header.free_bitmap_extents[0], header_data + offset + 2 * sizeof(unsigned long), extents_size * sizeof(_xvfs_extent));
+            }
+        } else
+        if(section_id == SECTION_INDEX_TREE && section_size >= 3 * sizeof(unsigned long)) {
+            const unsigned long* section = (const unsigned long*)(header_data + offset);
+            xvfs_header.index_root_sector = section[0];
+            xvfs_header.index_page_sectors = section[1];
+            used_end_sector = section[2];
+        } else
+        if(section_id == SECTION_INDEX && section_size >= 3 * sizeof(unsigned long)) {
+            const unsigned long* section = (const unsigned long*)(header_data + offset);
+            unsigned long extents_size = section[2];
+            if(extents_size <= (section_size - 3 * sizeof(unsigned long)) / sizeof(_xvfs_extent)) {
+                flat_index_size = section[0];
+                used_end_sector = section[1];
+                flat_index_extents.resize(extents_size);
+                if(extents_size > 0) std::memcpy(&flat_index_extents[0], header_data + offset + 3 * sizeof(unsigned long), extents_size * sizeof(_xvfs_extent));
+            }
+        }
+        offset += section_size;
+    }
+    delete[] header_data;
+    // если секции экстентов нет (файл создан старой версией), экстенты восстанавливаем по ссылкам в секторах
+    bool is_links = false;
+    for(unsigned long i = 0; i < files_size; ++i) {
+        if(files[i].start_sector != 0xFFFFFFFF && files_extents[i].size() == 0) {
+            is_links = true;
+            break;
+        }
+    }
+    if(is_links) {
+        std::vector<_xvfs_link> links;
+        if(!load_sectors_links(links)) return false;
+        for(unsigned long i = 0; i < files_size; ++i) {
+            if(files[i].start_sector == 0xFFFFFFFF || files_extents[i].size() > 0) continue;
+            // у файла с разорванной цепочкой экстентов не будет, такой файл не прочитать
+            if(!get_chain_extents(links, files[i].start_sector, get_sectors(files[i].size), files_extents[i])) {
+                files_extents[i].clear();
+            }
+        }
+        // старая версия могла оставить в списке пустых секторов сектор, занятый заголовком,
+        // такие сектора убираем из списка, иначе они будут выделены повторно
+        std::vector<_xvfs_extent> used_extents(header_extents);
+        for(unsigned long i = 0; i < files_size; ++i) {
+            used_extents.insert(used_extents.end(), files_extents[i].begin(), files_extents[i].end());
+        }
+        std::sort(used_extents.begin(), used_extents.end(), [](const _xvfs_extent& a, const _xvfs_extent& b) {
+            return a.start_sector < b.start_sector;
+        });
+        auto it_end = std::remove_if(empty_sectors.begin(), empty_sectors.end(), [&used_extents](unsigned long sector) {
+            auto it = std::upper_bound(used_extents.begin(), used_extents.end(), sector, [](unsigned long value, const _xvfs_extent& extent) {
+                return value < extent.start_sector;
+            });
+            if(it == used_extents.begin()) return false;
+            --it;
+            return sector < it->start_sector + it->sectors;
+        });
+        empty_sectors.erase(it_end, empty_sectors.end());
+    }
+    if(xvfs_header.free_bitmap_extents.size() > 0) {
+        if(!read_free_bitmap()) return false;
+    } else {
+        // список пустых секторов переводится в карту, на диск карта попадет в следующей контрольной точке
+        for(size_t i = 0; i < empty_sectors.size(); ++i) {
+            set_free_sectors(empty_sectors[i], 1, true);
+        }
+    }
+    if(xvfs_header.index_page_sectors == 0) {
+        xvfs_header.index_page_sectors = (index_page_size + xvfs_header.sector_size - 1) / xvfs_header.sector_size;
+    }
+    if(xvfs_header.index_root_sector != 0xFFFFFFFF) {
+        // с диска читается только корень, остальные страницы - по мере обращения
+        index_root = load_index_page(xvfs_header.index_root_sector);
+        if(index_root == NULL) return false;
+        if(is_legacy_index_tree) {
+            // в листьях старого формата нет типа компрессии и записей в страницу помещается больше,
+            // поэтому дерево перестраивается целиком, старые страницы освободятся в следующей контрольной точке
+            std::vector<_xvfs_index_entry> entries;
+            if(!get_index_entries(index_root, entries, &index_free_extents)) return false;
+            free_index_page(index_root);
+            index_root = NULL;
+            build_index(entries);
+        }
+    } else
+    if(flat_index_extents.size() > 0 || files_size > 0) {
+        // индекс старого формата перестраивается в дерево, на диск дерево попадет в следующей контрольной точке
+        std::vector<_xvfs_legacy_index_entry> flat_entries(flat_index_size);
+        if(flat_index_size > 0 && !read_region(flat_index_extents, 0, reinterpret_cast<char *>(&flat_entries[0]), flat_index_size * sizeof(_xvfs_legacy_index_entry))) return false;
+        std::vector<_xvfs_index_entry> entries(flat_index_size);
+        for(unsigned long i = 0; i < flat_index_size; ++i) {
+            entries[i] = get_index_entry(flat_entries[i]);
+        }
+        for(unsigned long i = 0; i < files_size; ++i) {
+            _xvfs_index_entry entry;
+            entry.hash = files[i].hash;
+            entry.size = files[i].size;
+            entry.real_size = files[i].real_size;
+            entry.start_sector = files[i].start_sector;
+            entry.sectors = 0;
+            entry.compression_type = files[i].compression_type;
+            if(files_extents[i].size() == 0) entries.push_back(entry);
+            for(size_t j = 0; j < files_extents[i].size(); ++j) {
+                entry.start_sector = files_extents[i][j].start_sector;
+                entry.sectors = files_extents[i][j].sectors;
+                entries.push_back(entry);
+                used_end_sector = std::max(used_end_sector, files_extents[i][j].start_sector + files_extents[i][j].sectors);
+            }
+        }
+        build_index(entries);
+        index_free_extents.swap(flat_index_extents);
+    }
+    // применяем изменения после контрольной точки
+    if(!read_log()) return false;
+    // после аварийного завершения в режиме USE_MMAP_STORAGE файл остается размером с отображение,
+    // поэтому конец файла находим по занятым и пустым секторам
+    unsigned long last_sector = get_extents_end(header_extents);
+    last_sector = std::max(last_sector, get_extents_end(xvfs_header.log_extents));
+    last_sector = std::max(last_sector, get_extents_end(index_free_extents));
+    last_sector = std::max(last_sector, get_extents_end(xvfs_header.free_bitmap_extents));
+    last_sector = std::max(last_sector, used_end_sector);
+    last_sector = std::max(last_sector, get_free_sectors_end());
+    if(last_sector < end_sector) {
+        end_sector = last_sector;
+        storage_size = std::min(storage_size.load(), (unsigned long long)end_sector * xvfs_header.sector_size);
+    }
+    // после отката пакета снимок строится заново
+    if(is_index_snapshots && !build_snapshot()) return false;
+    return true;
+}
+
+bool xvfs::parse_files_extents(const char* data, unsigned long size, std::vector<std::vector<_xvfs_extent>>& files_extents) {
+    unsigned long offset = 0;
+    if(size < sizeof(unsigned long)) return false;
+    unsigned long files_size = ((const unsigned long*)data)[0];
+    offset += sizeof(unsigned long);
+    if(files_size != files_extents.size()) return false;
+    for(unsigned long i = 0; i < files_size; ++i) {
+        if(offset + sizeof(unsigned long) > size) return false;
+        unsigned long extents_size = ((const unsigned long*)(data + offset))[0];
+        offset += sizeof(unsigned long);
+        if(extents_size > (size - offset) / sizeof(_xvfs_extent)) return false;
+        files_extents[i].resize(extents_size);
+        if(extents_size > 0) std::memcpy(&files_extents[i][0], data + offset, extents_size * sizeof(_xvfs_extent));
+        offset += extents_size * sizeof(_xvfs_extent);
+    }
+    return true;
+}
+
+bool xvfs::read_chain(unsigned long start_sector, char* data, unsigned long size, std::vector<_xvfs_extent>& extents, unsigned long& next_sector) {
+    const unsigned long sector_size = xvfs_header.sector_size;
+    const unsigned long sector_data_size = sector_size - sizeof(unsigned long);
+    const unsigned long min_read_sectors = 8;
+    const unsigned long max_read_sectors = std::max(1024UL * 1024UL / sector_size, min_read_sectors);
+    unsigned long read_sectors = min_read_sectors;
+    unsigned long sectors = get_sectors(size);
+    unsigned long len = 0;
+    std::vector<char> buf;
+    next_sector = start_sector;
+    while(sectors > 0) {
+        if(next_sector >= end_sector) return false;
+        unsigned long block = std::min(std::min(read_sectors, sectors), end_sector - next_sector);
+        buf.resize(block * sector_size);
+        if(!read_storage((unsigned long long)next_sector * sector_size, &buf[0], block * sector_size)) return false;
+        const unsigned long first_sector = next_sector;
+        unsigned long used = 0;
+        while(used < block) {
+            const char* sector_data = &buf[used * sector_size];
+            unsigned long part = std::min(sector_data_size, size - len);
+            std::memcpy(data + len, sector_data, part);
+            len += part;
+            next_sector = ((const unsigned long*)(sector_data + sector_data_size))[0];
+            ++used;
+            if(next_sector != first_sector + used) break;
+        }
+        add_extent(extents, first_sector, used);
+        sectors -= used;
+        // цепочка не прервалась - следующий блок читаем больше, иначе начинаем снова с малого блока
+        read_sectors = used == block ? std::min(read_sectors * 2, max_read_sectors) : min_read_sectors;
+    }
+    return true;
+}
+
+bool xvfs::load_sectors_links(std::vector<_xvfs_link>& links) {
+    const unsigned long sector_size = xvfs_header.sector_size;
+    const unsigned long max_read_sectors = std::max(1024UL * 1024UL / sector_size, 1UL);
+    // последний сектор может быть неполным, его ссылка не нужна
+    const unsigned long sectors = storage_size / sector_size;
+    std::vector<char> buf(std::min(max_read_sectors, std::max(sectors, 1UL)) * sector_size);
+    links.clear();
+    for(unsigned long sector = 0; sector < sectors;) {
+        unsigned long block = std::min(max_read_sectors, sectors - sector);
+        if(!read_storage((unsigned long long)sector * sector_size, &buf[0], block * sector_size)) return false;
+        for(unsigned long i = 0; i < block; ++i, ++sector) {
+            unsigned long next_sector = ((const unsigned long*)(&buf[0] + (i + 1) * sector_size - sizeof(unsigned long)))[0];
+            if(next_sector != sector + 1) links.push_back(_xvfs_link(sector, next_sector));
+        }
+    }
+    return true;
+}
+
+bool xvfs::get_chain_extents(const std::vector<_xvfs_link>& links, unsigned long start_sector, unsigned long sectors, std::vector<_xvfs_extent>& extents) {
+    unsigned long sector = start_sector;
+    while(sectors > 0) {
+        if(sector >= end_sector) return false;
+        // цепочка идет подряд до ближайшего разрыва
+        auto it = std::lower_bound(links.begin(), links.end(), _xvfs_link(sector, 0));
+        unsigned long last_sector = it == links.end() ? end_sector - 1 : it->sector;
+        unsigned long run = std::min(last_sector - sector + 1, sectors);
+        add_extent(extents, sector, run);
+        sectors -= run;
+        if(sectors == 0) break;
+        if(it == links.end()) return false;
+        sector = it->next_sector;
+    }
+    return true;
+}
+
+bool xvfs::read_region(const std::vector<_xvfs_extent>& extents, unsigned long offset, char* data, unsigned long size) {
+    const unsigned long sector_size = xvfs_header.sector_size;
+    unsigned long extent_offset = 0;
+    for(size_t i = 0; i < extents.size() && size > 0; ++i) {
+        const unsigned long extent_size = extents[i].sectors * sector_size;
+        if(offset < extent_offset + extent_size) {
+            unsigned long part_offset = offset - extent_offset;
+            unsigned long part = std::min(size, extent_size - part_offset);
+            if(!read_storage((unsigned long long)extents[i].start_sector * sector_size + part_offset, data, part)) return false;
+            data += part;
+            offset += part;
+            size -= part;
+        }
+        extent_offset += extent_size;
+    }
+    return size == 0;
+}
+
+bool xvfs::write_region(const std::vector<_xvfs_extent>& extents, unsigned long offset, const char* data, unsigned long size) {
+    const unsigned long sector_size = xvfs_header.sector_size;
+    unsigned long extent_offset = 0;
+    for(size_t i = 0; i < extents.size() && size > 0; ++i) {
+        const unsigned long extent_size = extents[i].sectors * sector_size;
+        if(offset < extent_offset + extent_size) {
+            unsigned long part_offset = offset - extent_offset;
+            unsigned long part = std::min(size, extent_size - part_offset);
+            if(!write_storage((unsigned long long)extents[i].start_sector * sector_size + part_offset, data, part)) return false;
+            data += part;
+            offset += part;
+            size -= part;
+        }
+        extent_offset += extent_size;
+    }
+    return size == 0;
+}
+
+long long xvfs::get_log_crc(const _xvfs_log_record& record, const char* data) {
+    long long crc = 0;
+    crc = calculate_crc64(crc, (const unsigned char*)&record.size, sizeof(record.size));
+    crc = calculate_crc64(crc, (const unsigned char*)&record.type, sizeof(record.type));
+    crc = calculate_crc64(crc, (const unsigned char*)&record.generation, sizeof(record.generation));
+    crc = calculate_crc64(crc, (const unsigned char*)data, record.size);
+    return crc;
+}
+
+bool xvfs::save_log_record(unsigned long type, const char* data, unsigned long size) {
+    if(is_batch) {
+        // записи пакета накапливаются до commit()
+        const size_t offset = batch_records.size();
+        batch_records.resize(offset + 2 * sizeof(unsigned long) + size);
+        std::memcpy(&batch_records[offset], &type, sizeof(unsigned long));
+        std::memcpy(&batch_records[offset + sizeof(unsigned long)], &size, sizeof(unsigned long));
+        if(size > 0) std::memcpy(&batch_records[offset + 2 * sizeof(unsigned long)], data, size);
+        return true;
+    }
+    const unsigned long log_size = get_extents_sectors(xvfs_header.log_extents) * xvfs_header.sector_size;
+    // примерно 8 МБ страниц по 4 КБ
+    const unsigned long max_index_dirty_pages = 2048;
+    if(log_tail + sizeof(_xvfs_log_record) + size > log_size || index_dirty_pages > max_index_dirty_pages) {
+        // в журнале нет места или накопилось много измененных страниц индекса, сохраняем заголовок целиком
+        return save_header();
+    }
+    _xvfs_log_record record;
+    std::memset(&record, 0, sizeof(record));
+    record.size = size;
+    record.type = type;
+    record.generation = xvfs_header.log_generation;
+    record.crc = get_log_crc(record, data);
+    std::vector<char> buf(sizeof(_xvfs_log_record) + size);
+    std::memcpy(&buf[0], &record, sizeof(_xvfs_log_record));
+    if(size > 0) std::memcpy(&buf[sizeof(_xvfs_log_record)], data, size);
+    if(!write_region(xvfs_header.log_extents, log_tail, &buf[0], buf.size())) return false;
+    log_tail += buf.size();
+    return true;
+}
+
+bool xvfs::save_file_header(const _xvfs_file_header& file_header, const std::vector<_xvfs_extent>& extents) {
+    unsigned long extents_size = extents.size();
+    std::vector<char> buf(sizeof(_xvfs_file_header) + sizeof(unsigned long) + extents_size * sizeof(_xvfs_extent));
+    std::memcpy(&buf[0], &file_header, sizeof(_xvfs_file_header));
+    std::memcpy(&buf[sizeof(_xvfs_file_header)], &extents_size, sizeof(unsigned long));
+    if(extents_size > 0) std::memcpy(&buf[sizeof(_xvfs_file_header) + sizeof(unsigned long)], &extents[0], extents_size * sizeof(_xvfs_extent));
+    return save_log_record(LOG_WRITE_CODEC_FILE, &buf[0], buf.size());
+}
+
+bool xvfs::save_file_deletion(long long hash_vfs_file) {
+    return save_log_record(LOG_DELETE_FILE, reinterpret_cast<const char *>(&hash_vfs_file), sizeof(hash_vfs_file));
+}
+
+bool xvfs::parse_log(const char* data, unsigned long size) {
+    if(size < 2 * sizeof(unsigned long)) return false;
+    unsigned long log_generation = ((const unsigned long*)data)[0];
+    unsigned long extents_size = ((const unsigned long*)data)[1];
+    if(extents_size > (size - 2 * sizeof(unsigned long)) / sizeof(_xvfs_extent)) return false;
+    xvfs_header.log_generation = log_generation;
+    xvfs_header.log_extents.resize(extents_size);
+    if(extents_size > 0) std::memcpy(&xvfs_header.log_extents[0], data + 2 * sizeof(unsigned long), extents_size * sizeof(_xvfs_extent));
+    return true;
+}
+
+xvfs::_xvfs_index_page* xvfs::load_index_page(unsigned long sector) {
+    const unsigned long page_size = xvfs_header.index_page_sectors * xvfs_header.sector_size;
+    std::vector<char> buf(page_size);
+    if(!read_storage((unsigned long long)sector * xvfs_header.sector_size, &buf[0], page_size)) return NULL;
+    unsigned long type = ((const unsigned long*)&buf[0])[0];
+    unsigned long count = ((const unsigned long*)&buf[0])[1];
+    const char* data = &buf[0] + 2 * sizeof(unsigned long);
+    const unsigned long data_size = page_size - 2 * sizeof(unsigned long);
+    _xvfs_index_page* page = NULL;
+    if(type == INDEX_CODEC_LEAF_PAGE && count <= data_size / sizeof(_xvfs_index_entry)) {
+        page = new _xvfs_index_page();
+        page->is_leaf = true;
+        page->entries.resize(count);
+        if(count > 0) std::memcpy(&page->entries[0], data, count * sizeof(_xvfs_index_entry));
+    } else
+    if(type == INDEX_LEAF_PAGE && count <= data_size / sizeof(_xvfs_legacy_index_entry)) {
+        page = new _xvfs_index_page();
+        page->is_leaf = true;
+        page->entries.resize(count);
+        for(unsigned long i = 0; i < count; ++i) {
+            page->entries[i] = get_index_entry(((const _xvfs_legacy_index_entry*)data)[i]);
+        }
+    } else
+    if(type == INDEX_INNER_PAGE && count > 0 && count <= data_size / sizeof(_xvfs_index_key)) {
+        page = new _xvfs_index_page();
+        page->is_leaf = false;
+        page->keys.resize(count);
+        std::memcpy(&page->keys[0], data, count * sizeof(_xvfs_index_key));
+        page->children.assign(count, NULL);
+    } else {
+        return NULL;
+    }
+    page->sector = sector;
+    page->is_dirty = false;
+    ++index_pages;
+    return page;
+}
+
+xvfs::_xvfs_index_page* xvfs::get_index_child(_xvfs_index_page* page, size_t pos) {
+    if(page->children[pos] == NULL) page->children[pos] = load_index_page(page->keys[pos].sector);
+    return page->children[pos];
+}
+
+void xvfs::free_index_page(_xvfs_index_page* page) {
+    if(page == NULL) return;
+    for(size_t i = 0; i < page->children.size(); ++i) {
+        free_index_page(page->children[i]);
+    }
+    --index_pages;
+    if(page->is_dirty) --index_dirty_pages;
+    delete page;
+}
+
+void xvfs::evict_index_pages() {
+    // примерно 16 МБ страниц по 4 КБ
+    const unsigned long max_index_pages = 4096;
+    // измененные страницы выгружать нельзя, их число ограничивают контрольные точки
+    if(index_pages - index_dirty_pages > max_index_pages && index_root != NULL) evict_index_pages(index_root);
+}
+
+void xvfs::evict_index_pages(_xvfs_index_page* page) {
+    // вместе с измененной страницей изменены и все страницы на пути к корню,
+    // поэтому у неизмененной страницы нет измененных дочерних страниц
+    for(size_t i = 0; i < page->children.size(); ++i) {
+        _xvfs_index_page* child = page->children[i];
+        if(child == NULL) continue;
+        if(child->is_dirty) {
+            evict_index_pages(child);
+        } else {
+            free_index_page(child);
+            page->children[i] = NULL;
+        }
+    }
+}
+
+void xvfs::set_index_page_dirty(_xvfs_index_page* page) {
+    if(page->is_dirty) return;
+    page->is_dirty = true;
+    ++index_dirty_pages;
+}
+
+void xvfs::split_index_page(_xvfs_index_page* page, std::vector<_xvfs_index_page*>& new_pages) {
+    const unsigned long data_size = xvfs_header.index_page_sectors * xvfs_header.sector_size - 2 * sizeof(unsigned long);
+    const size_t capacity = page->is_leaf ? data_size / sizeof(_xvfs_index_entry) : data_size / sizeof(_xvfs_index_key);
+    const size_t count = page->is_leaf ? page->entries.size() : page->keys.size();
+    if(count <= capacity) return;
+    // записи делим между страницами поровну
+    const size_t pages = (count + capacity - 1) / capacity;
+    const size_t page_count = (count + pages - 1) / pages;
+    for(size_t first = page_count; first < count; first += page_count) {
+        const size_t last = std::min(first + page_count, count);
+        _xvfs_index_page* new_page = new _xvfs_index_page();
+        new_page->sector = 0xFFFFFFFF;
+        new_page->is_leaf = page->is_leaf;
+        new_page->is_dirty = false;
+        if(page->is_leaf) {
+            new_page->entries.assign(page->entries.begin() + first, page->entries.begin() + last);
+        } else {
+            new_page->keys.assign(page->keys.begin() + first, page->keys.begin() + last);
+            new_page->children.assign(page->children.begin() + first, page->children.begin() + last);
+        }
+        ++index_pages;
+        set_index_page_dirty(new_page);
+        new_pages.push_back(new_page);
+    }
+    if(page->is_leaf) {
+        page->entries.resize(page_count);
+    } else {
+        page->keys.resize(page_count);
+        page->children.resize(page_count);
+    }
+}
+
+size_t xvfs::get_index_child_pos(const std::vector<_xvfs_index_key>& keys, long long hash_vfs_file) {
+    auto it = std::lower_bound(keys.begin(), keys.end(), hash_vfs_file, [](const _xvfs_index_key& key, long long value) {
+        return key.hash < value;
+    });
+    size_t pos = it - keys.begin();
+    return pos > 0 ? pos - 1 : 0;
+}
+
+size_t xvfs::get_index_entry_pos(const std::vector<_xvfs_index_entry>& entries, long long hash_vfs_file) {
+    auto it = std::lower_bound(entries.begin(), entries.end(), hash_vfs_file, [](const _xvfs_index_entry& entry, long long value) {
+        return entry.hash < value;
+    });
+    return it - entries.begin();
+}
+
+bool xvfs::insert_index_entries(_xvfs_index_page* page, const std::vector<_xvfs_index_entry>& entries, std::vector<_xvfs_index_page*>& new_pages) {
+    const long long hash = entries[0].hash;
+    if(page->is_leaf) {
+        set_index_page_dirty(page);
+        page->entries.insert(page->entries.begin() + get_index_entry_pos(page->entries, hash), entries.begin(), entries.end());
+        split_index_page(page, new_pages);
+        return true;
+    }
+    const size_t pos = get_index_child_pos(page->keys, hash);
+    _xvfs_index_page* child = get_index_child(page, pos);
+    if(child == NULL) return false;
+    std::vector<_xvfs_index_page*> child_pages;
+    if(!insert_index_entries(child, entries, child_pages)) return false;
+    set_index_page_dirty(page);
+    if(page->keys[pos].hash > hash) page->keys[pos].hash = hash;
+    for(size_t i = 0; i < child_pages.size(); ++i) {
+        _xvfs_index_key key;
+        key.hash = child_pages[i]->is_leaf ? child_pages[i]->entries[0].hash : child_pages[i]->keys[0].hash;
+        key.sector = 0xFFFFFFFF;
+        page->keys.insert(page->keys.begin() + pos + 1 + i, key);
+        page->children.insert(page->children.begin() + pos + 1 + i, child_pages[i]);
+    }
+    split_index_page(page, new_pages);
+    return true;
+}
+
+bool xvfs::erase_index_entries(_xvfs_index_page* page, long long hash_vfs_file, bool& is_changed) {
+    if(page->is_leaf) {
+        const size_t first = get_index_entry_pos(page->entries, hash_vfs_file);
+        size_t last = first;
+        while(last < page->entries.size() && page->entries[last].hash == hash_vfs_file) ++last;
+        if(last == first) return true;
+        set_index_page_dirty(page);
+        page->entries.erase(page->entries.begin() + first, page->entries.begin() + last);
+        is_changed = true;
+        return true;
+    }
+    // записи файла могут продолжаться в следующих дочерних страницах
+    size_t pos = get_index_child_pos(page->keys, hash_vfs_file);
+    const size_t first_pos = pos;
+    while(pos < page->keys.size() && (pos == first_pos || page->keys[pos].hash <= hash_vfs_file)) {
+        _xvfs_index_page* child = get_index_child(page, pos);
+        if(child == NULL) return false;
+        bool is_child_changed = false;
+        if(!erase_index_entries(child, hash_vfs_file, is_child_changed)) return false;
+        if(!is_child_changed) {
+            ++pos;
+            continue;
+        }
+        set_index_page_dirty(page);
+        is_changed = true;
+        if(child->entries.size() > 0 || child->keys.size() > 0) {
+            // ключ должен оставаться равным первому хэшу страницы, иначе поиск пропустит записи предыдущей страницы
+            page->keys[pos].hash = child->is_leaf ? child->entries[0].hash : child->keys[0].hash;
+            ++pos;
+            continue;
+        }
+        // опустевшую страницу убираем из дерева
+        if(child->sector != 0xFFFFFFFF) index_free_extents.push_back(_xvfs_extent(child->sector, xvfs_header.index_page_sectors));
+        free_index_page(child);
+        page->keys.erase(page->keys.begin() + pos);
+        page->children.erase(page->children.begin() + pos);
+    }
+    return true;
+}
+
+void xvfs::build_index(const std::vector<_xvfs_index_entry>& entries) {
+    free_index_page(index_root);
+    index_root = NULL;
+    if(entries.size() == 0) return;
+    const unsigned long data_size = xvfs_header.index_page_sectors * xvfs_header.sector_size - 2 * sizeof(unsigned long);
+    const size_t leaf_capacity = data_size / sizeof(_xvfs_index_entry);
+    const size_t inner_capacity = data_size / sizeof(_xvfs_index_key);
+    // листья заполняем целиком, затем строим уровни внутренних страниц до корня
+    std::vector<_xvfs_index_page*> pages;
+    for(size_t first = 0; first < entries.size(); first += leaf_capacity) {
+        _xvfs_index_page* page = new _xvfs_index_page();
+        page->sector = 0xFFFFFFFF;
+        page->is_leaf = true;
+        page->is_dirty = false;
+        page->entries.assign(entries.begin() + first, entries.begin() + std::min(first + leaf_capacity, entries.size()));
+        ++index_pages;
+        set_index_page_dirty(page);
+        pages.push_back(page);
+    }
+    while(pages.size() > 1) {
+        std::vector<_xvfs_index_page*> parents;
+        for(size_t first = 0; first < pages.size(); first += inner_capacity) {
+            _xvfs_index_page* page = new _xvfs_index_page();
+            page->sector = 0xFFFFFFFF;
+            page->is_leaf = false;
+            page->is_dirty = false;
+            for(size_t i = first; i < std::min(first + inner_capacity, pages.size()); ++i) {
+                _xvfs_index_key key;
+                key.hash = pages[i]->is_leaf ? pages[i]->entries[0].hash : pages[i]->keys[0].hash;
+                key.sector = 0xFFFFFFFF;
+                page->keys.push_back(key);
+                page->children.push_back(pages[i]);
+            }
+            ++index_pages;
+            set_index_page_dirty(page);
+            parents.push_back(page);
+        }
+        pages.swap(parents);
+    }
+    index_root = pages[0];
+}
+
+void xvfs::allocate_index_pages(unsigned long count, std::vector<unsigned long>& sectors) {
+    const unsigned long page_sectors = xvfs_header.index_page_sectors;
+    sectors.clear();
+    std::vector<_xvfs_extent> extents;
+    std::vector<_xvfs_extent> released_extents;
+    allocate_sectors(count * page_sectors, 0xFFFFFFFF, extents);
+    // страница должна лежать в одном непрерывном участке, остатки участков освобождаем
+    for(size_t i = 0; i < extents.size(); ++i) {
+        unsigned long pages = extents[i].sectors / page_sectors;
+        for(unsigned long j = 0; j < pages; ++j) {
+            sectors.push_back(extents[i].start_sector + j * page_sectors);
+        }
+        if(extents[i].sectors > pages * page_sectors) {
+            released_extents.push_back(_xvfs_extent(extents[i].start_sector + pages * page_sectors, extents[i].sectors - pages * page_sectors));
+        }
+    }
+    if(sectors.size() < count) {
+        // недостающие страницы берем в конце файла
+        const unsigned long pages = count - sectors.size();
+        const unsigned long start_sector = end_sector;
+        extents.clear();
+        allocate_sectors(pages * page_sectors, end_sector, extents);
+        for(unsigned long j = 0; j < pages; ++j) {
+            sectors.push_back(start_sector + j * page_sectors);
+        }
+    }
+    clear_data(released_extents);
+    std::sort(sectors.begin(), sectors.end());
+}
+
+xvfs::_xvfs_index_entry xvfs::get_index_entry(const _xvfs_legacy_index_entry& entry) {
+    _xvfs_index_entry index_entry;
+    index_entry.hash = entry.hash;
+    index_entry.size = entry.size;
+    index_entry.real_size = entry.real_size;
+    index_entry.start_sector = entry.start_sector;
+    index_entry.sectors = entry.sectors;
+    index_entry.compression_type = xvfs_header.compression_type;
+    return index_entry;
+}
+
+bool xvfs::get_index_entries(_xvfs_index_page* page, std::vector<_xvfs_index_entry>& entries, std::vector<_xvfs_extent>* pages_extents) {
+    if(pages_extents != NULL && page->sector != 0xFFFFFFFF) {
+        add_extent(*pages_extents, page->sector, xvfs_header.index_page_sectors);
+    }
+    if(page->is_leaf) {
+        entries.insert(entries.end(), page->entries.begin(), page->entries.end());
+        return true;
+    }
+    for(size_t i = 0; i < page->keys.size(); ++i) {
+        const bool is_loaded = page->children[i] != NULL;
+        _xvfs_index_page* child = get_index_child(page, i);
+        if(child == NULL) return false;
+        bool is_read = get_index_entries(child, entries, pages_extents);
+        if(!is_loaded) {
+            free_index_page(child);
+            page->children[i] = NULL;
+        }
+        if(!is_read) return false;
+    }
+    return true;
+}
+
+xvfs::_xvfs_lookup_slot* xvfs::find_lookup_slot(long long hash_vfs_file) {
+    if(lookup_table.size() == 0) return NULL;
+    // хэши файлов могут идти с постоянным шагом, поэтому перемешиваем биты
+    size_t pos = (size_t)(((unsigned long long)hash_vfs_file * 0x9E3779B97F4A7C15ULL) >> 32) % lookup_table.size();
+    for(size_t i = 0; i < lookup_window_size; ++i) {
+        _xvfs_lookup_slot& slot = lookup_table[(pos + i) % lookup_table.size()];
+        if(slot.is_used && slot.hash == hash_vfs_file) return &slot;
+    }
+    return NULL;
+}
+
+void xvfs::set_lookup_slot(long long hash_vfs_file, bool is_file, const _xvfs_file_header& file_header, const std::vector<_xvfs_extent>* extents) {
+    if(lookup_table.size() == 0) {
+        lookup_table.resize(lookup_table_size);
+        for(size_t i = 0; i < lookup_table.size(); ++i) {
+            lookup_table[i].is_used = false;
+        }
+    }
+    _xvfs_lookup_slot* slot = find_lookup_slot(hash_vfs_file);
+    if(slot == NULL) {
+        size_t pos = (size_t)(((unsigned long long)hash_vfs_file * 0x9E3779B97F4A7C15ULL) >> 32) % lookup_table.size();
+        for(size_t i = 0; i < lookup_window_size && slot == NULL; ++i) {
+            _xvfs_lookup_slot& empty_slot = lookup_table[(pos + i) % lookup_table.size()];
+            if(!empty_slot.is_used) slot = &empty_slot;
+        }
+        // свободных ячеек в окне нет, вытесняем одну из занятых
+        if(slot == NULL) slot = &lookup_table[(pos + lookup_victim++ % lookup_window_size) % lookup_table.size()];
+    }
+    slot->hash = hash_vfs_file;
+    slot->is_used = true;
+    slot->is_file = is_file;
+    slot->header = file_header;
+    slot->is_extents = is_file && extents != NULL && extents->size() <= sizeof(slot->extents) / sizeof(slot->extents[0]);
+    slot->extents_size = slot->is_extents ? extents->size() : 0;
+    for(unsigned long i = 0; i < slot->extents_size; ++i) {
+        slot->extents[i] = (*extents)[i];
+    }
+}
+
+bool xvfs::find_file(long long hash_vfs_file, _xvfs_file_header& file_header, std::vector<_xvfs_extent>* extents) {
+    // читатель снимка ищет файл в неизменяемом снимке без блокировок
+    const _xvfs_snapshot* snapshot = _xvfs_lock::get_snapshot(this);
+    if(snapshot != NULL) return find_snapshot_file(snapshot, hash_vfs_file, file_header, extents);
+    // при общей блокировке поиск одновременно меняет таблицу поиска и загружает страницы индекса
+    std::lock_guard<std::mutex> index_lock(index_mutex);
+    _xvfs_lookup_slot* slot = find_lookup_slot(hash_vfs_file);
+    if(slot != NULL && (!slot->is_file || extents == NULL || slot->is_extents)) {
+        if(!slot->is_file) return false;
+        file_header = slot->header;
+        if(extents != NULL) extents->assign(slot->extents, slot->extents + slot->extents_size);
+        return true;
+    }
+    const bool is_file = find_index_file(hash_vfs_file, file_header, extents);
+    set_lookup_slot(hash_vfs_file, is_file, file_header, extents);
+    return is_file;
+}
+
+bool xvfs::find_index_file(long long hash_vfs_file, _xvfs_file_header& file_header, std::vector<_xvfs_extent>* extents) {
+    evict_index_pages();
+    if(index_root == NULL) return false;
+    // путь от корня до листа нужен, чтобы перейти к следующему листу
+    std::vector<std::pair<_xvfs_index_page*, size_t>> path;
+    _xvfs_index_page* page = index_root;
+    while(!page->is_leaf) {
+        const size_t pos = get_index_child_pos(page->keys, hash_vfs_file);
+        path.push_back(std::make_pair(page, pos));
+        page = get_index_child(page, pos);
+        if(page == NULL) return false;
+    }
+    size_t pos = get_index_entry_pos(page->entries, hash_vfs_file);
+    bool is_found = false;
+    while(page != NULL) {
+        if(pos >= page->entries.size()) {
+            // переходим к следующему листу
+            page = NULL;
+            pos = 0;
+            while(path.size() > 0 && page == NULL) {
+                std::pair<_xvfs_index_page*, size_t>& top = path.back();
+                if(top.second + 1 < top.first->keys.size()) {
+                    ++top.second;
+                    page = get_index_child(top.first, top.second);
+                    if(page == NULL) return false;
+                    while(!page->is_leaf) {
+                        path.push_back(std::make_pair(page, 0));
+                        page = get_index_child(page, 0);
+                        if(page == NULL) return false;
+                    }
+                } else {
+                    path.pop_back();
+                }
+            }
+            continue;
+        }
+        const _xvfs_index_entry& entry = page->entries[pos];
+        if(entry.hash != hash_vfs_file) break;
+        if(!is_found) {
+            // первая запись файла начинается с первого сектора файла
+            file_header = _xvfs_file_header(entry.hash, entry.size, entry.start_sector, entry.real_size, entry.compression_type);
+            is_found = true;
+            if(extents == NULL) break;
+            extents->clear();
+        }
+        add_extent(*extents, entry.start_sector, entry.sectors);
+        ++pos;
+    }
+    return is_found;
+}
+
+bool xvfs::set_file(const _xvfs_file_header& file_header, const std::vector<_xvfs_extent>& extents) {
+    if(!erase_file(file_header.hash)) return false;
+    std::vector<_xvfs_index_entry> entries(std::max(extents.size(), (size_t)1));
+    for(size_t i = 0; i < entries.size(); ++i) {
+        entries[i].hash = file_header.hash;
+        entries[i].size = file_header.size;
+        entries[i].real_size = file_header.real_size;
+        entries[i].start_sector = i < extents.size() ? extents[i].start_sector : file_header.start_sector;
+        entries[i].sectors = i < extents.size() ? extents[i].sectors : 0;
+        entries[i].compression_type = file_header.compression_type;
+    }
+    if(index_root == NULL) {
+        index_root = new _xvfs_index_page();
+        index_root->sector = 0xFFFFFFFF;
+        index_root->is_leaf = true;
+        index_root->is_dirty = false;
+        ++index_pages;
+    }
+    std::vector<_xvfs_index_page*> new_pages;
+    if(!insert_index_entries(index_root, entries, new_pages)) return false;
+    // корень разделился, над ним появляется новый корень
+    while(new_pages.size() > 0) {
+        _xvfs_index_page* root = new _xvfs_index_page();
+        root->sector = 0xFFFFFFFF;
+        root->is_leaf = false;
+        root->is_dirty = false;
+        new_pages.insert(new_pages.begin(), index_root);
+        for(size_t i = 0; i < new_pages.size(); ++i) {
+            _xvfs_index_key key;
+            key.hash = new_pages[i]->is_leaf ? new_pages[i]->entries[0].hash : new_pages[i]->keys[0].hash;
+            key.sector = new_pages[i]->sector;
+            root->keys.push_back(key);
+            root->children.push_back(new_pages[i]);
+        }
+        ++index_pages;
+        set_index_page_dirty(root);
+        index_root = root;
+        new_pages.clear();
+        split_index_page(root, new_pages);
+    }
+    set_lookup_slot(file_header.hash, true, file_header, &extents);
+    update_snapshot(file_header.hash, entries);
+    return true;
+}
+
+bool xvfs::erase_file(long long hash_vfs_file) {
+    _xvfs_lookup_slot* slot = find_lookup_slot(hash_vfs_file);
+    if(slot != NULL) slot->is_used = false;
+    evict_index_pages();
+    if(index_root == NULL) return true;
+    bool is_changed = false;
+    if(!erase_index_entries(index_root, hash_vfs_file, is_changed)) return false;
+    // убираем опустевший корень и корень с единственной дочерней страницей
+    while(index_root != NULL) {
+        if(index_root->entries.size() == 0 && index_root->keys.size() == 0) {
+            if(index_root->sector != 0xFFFFFFFF) index_free_extents.push_back(_xvfs_extent(index_root->sector, xvfs_header.index_page_sectors));
+            free_index_page(index_root);
+            index_root = NULL;
+        } else
+        if(!index_root->is_leaf && index_root->keys.size() == 1) {
+            _xvfs_index_page* child = get_index_child(index_root, 0);
+            if(child == NULL) return false;
+            if(index_root->sector != 0xFFFFFFFF) index_free_extents.push_back(_xvfs_extent(index_root->sector, xvfs_header.index_page_sectors));
+            index_root->children[0] = NULL;
+            free_index_page(index_root);
+            index_root = child;
+        } else {
+            break;
+        }
+    }
+    return true;
+}
+
+bool xvfs::find_snapshot_file(const _xvfs_snapshot* snapshot, long long hash_vfs_file, _xvfs_file_header& file_header, std::vector<_xvfs_extent>* extents) {
+    // записи файла идут подряд, изменения новее общего массива и проверяются первыми
+    auto change = std::lower_bound(snapshot->changes.begin(), snapshot->changes.end(), hash_vfs_file, [](const _xvfs_snapshot_entry& entry, long long value) {
+        return entry.entry.hash < value;
+    });
+    if(change != snapshot->changes.end() && change->entry.hash == hash_vfs_file) {
+        if(change->is_deleted) return false;
+        const _xvfs_index_entry& entry = change->entry;
+        file_header = _xvfs_file_header(entry.hash, entry.size, entry.start_sector, entry.real_size, entry.compression_type);
+        if(extents == NULL) return true;
+        extents->clear();
+        for(; change != snapshot->changes.end() && change->entry.hash == hash_vfs_file; ++change) {
+            add_extent(*extents, change->entry.start_sector, change->entry.sectors);
+        }
+        return true;
+    }
+    const std::vector<_xvfs_index_entry>& entries = *snapshot->entries;
+    size_t pos = get_index_entry_pos(entries, hash_vfs_file);
+    if(pos >= entries.size() || entries[pos].hash != hash_vfs_file) return false;
+    const _xvfs_index_entry& entry = entries[pos];
+    file_header = _xvfs_file_header(entry.hash, entry.size, entry.start_sector, entry.real_size, entry.compression_type);
+    if(extents == NULL) return true;
+    extents->clear();
+    for(; pos < entries.size() && entries[pos].hash == hash_vfs_file; ++pos) {
+        add_extent(*extents, entries[pos].start_sector, entries[pos].sectors);
+    }
+    return true;
+}
+
+bool xvfs::build_snapshot() {
+    std::vector<_xvfs_index_entry>* entries = new std::vector<_xvfs_index_entry>();
+    if(index_root != NULL && !get_index_entries(index_root, *entries, NULL)) {
+        delete entries;
+        return false;
+    }
+    _xvfs_snapshot* snapshot = new _xvfs_snapshot();
+    snapshot->entries.reset(entries);
+    publish_snapshot(snapshot);
+    return true;
+}
+
+void xvfs::update_snapshot(long long hash_vfs_file, const std::vector<_xvfs_index_entry>& entries) {
+    const _xvfs_snapshot* current = index_snapshot.load();
+    if(current == NULL) return;
+    // изменения копируются целиком, прежние записи файла заменяются новыми
+    auto compare = [](const _xvfs_snapshot_entry& entry, long long value) {
+        return entry.entry.hash < value;
+    };
+    auto first = std::lower_bound(current->changes.begin(), current->changes.end(), hash_vfs_file, compare);
+    auto last = first;
+    while(last != current->changes.end() && last->entry.hash == hash_vfs_file) ++last;
+    _xvfs_snapshot* snapshot = new _xvfs_snapshot();
+    snapshot->entries = current->entries;
+    snapshot->changes.reserve(current->changes.size() + std::max(entries.size(), (size_t)1));
+    snapshot->changes.insert(snapshot->changes.end(), current->changes.begin(), first);
+    _xvfs_snapshot_entry change;
+    change.is_deleted = entries.size() == 0;
+    if(change.is_deleted) {
+        change.entry = _xvfs_index_entry();
+        change.entry.hash = hash_vfs_file;
+        snapshot->changes.push_back(change);
+    }
+    for(size_t i = 0; i < entries.size(); ++i) {
+        change.entry = entries[i];
+        snapshot->changes.push_back(change);
+    }
+    snapshot->changes.insert(snapshot->changes.end(), last, current->changes.end());
+    // изменений накопилось много - сливаем их с общим массивом, чтобы копирование при записи оставалось коротким
+    const size_t max_changes = std::max((size_t)1024, (size_t)(4 * std::sqrt((double)snapshot->entries->size())));
+    if(snapshot->changes.size() > max_changes) {
+        const std::vector<_xvfs_index_entry>& base = *snapshot->entries;
+        const std::vector<_xvfs_snapshot_entry>& changes = snapshot->changes;
+        std::vector<_xvfs_index_entry>* merged = new std::vector<_xvfs_index_entry>();
+        merged->reserve(base.size() + changes.size());
+        size_t i = 0;
+        size_t j = 0;
+        while(i < base.size() || j < changes.size()) {
+            if(j >= changes.size() || (i < base.size() && base[i].hash < changes[j].entry.hash)) {
+                merged->push_back(base[i++]);
+                continue;
+            }
+            const long long hash = changes[j].entry.hash;
+            while(i < base.size() && base[i].hash == hash) ++i;
+            for(; j < changes.size() && changes[j].entry.hash == hash; ++j) {
+                if(!changes[j].is_deleted) merged->push_back(changes[j].entry);
+            }
+        }
+        snapshot->entries.reset(merged);
+        snapshot->changes.clear();
+    }
+    publish_snapshot(snapshot);
+}
+
+void xvfs::publish_snapshot(_xvfs_snapshot* snapshot) {
+    _xvfs_snapshot* old_snapshot = index_snapshot.exchange(snapshot);
+    if(old_snapshot == NULL) return;
+    _xvfs_retired retired;
+    retired.snapshot = old_snapshot;
+    retired.map = NULL;
+    retired.map_size = 0;
+    retired.map_handle = NULL;
+    retire_object(retired);
+}
+
+void xvfs::retire_object(_xvfs_retired& retired) {
+    // читатели, которые отметят эту эпоху или более позднюю, объект уже не увидят
+    retired.epoch = ++snapshot_epoch;
+    retired_objects.push_back(std::move(retired));
+    reclaim_retired(false);
+}
+
+void xvfs::reclaim_retired(bool is_wait) {
+    while(retired_objects.size() > 0) {
+        // самая ранняя эпоха, в которой еще читают снимок
+        unsigned long long min_epoch = 0xFFFFFFFFFFFFFFFFULL;
+        for(size_t i = 0; i < reader_slots_size; ++i) {
+            const unsigned long long epoch = reader_slots[i].epoch.load();
+            if(epoch != 0) min_epoch = std::min(min_epoch, epoch);
+        }
+        while(retired_objects.size() > 0 && retired_objects.front().epoch <= min_epoch) {
+            _xvfs_retired& retired = retired_objects.front();
+            delete retired.snapshot;
+            clear_data(retired.extents);
+            if(retired.map != NULL) unmap_view(retired.map, retired.map_size, retired.map_handle);
+            retired_objects.pop_front();
+        }
+        if(!is_wait) return;
+        if(retired_objects.size() > 0) std::this_thread::yield();
+    }
+}
+
+bool xvfs::save_index(std::vector<_xvfs_extent>& old_extents) {
+    old_extents.swap(index_free_extents);
+    index_free_extents.clear();
+    if(index_root == NULL || !index_root->is_dirty) {
+        xvfs_header.index_root_sector = index_root == NULL ? 0xFFFFFFFF : index_root->sector;
+        return true;
+    }
+    // измененные страницы собираем так, чтобы дочерние страницы шли раньше родительских:
+    // родительская страница пишется уже с новыми секторами дочерних
+    std::vector<_xvfs_index_page*> pages;
+    std::vector<std::pair<_xvfs_index_page*, size_t>> stack;
+    stack.push_back(std::make_pair(index_root, 0));
+    while(stack.size() > 0) {
+        std::pair<_xvfs_index_page*, size_t>& top = stack.back();
+        _xvfs_index_page* page = top.first;
+        if(top.second < page->children.size()) {
+            _xvfs_index_page* child = page->children[top.second++];
+            if(child != NULL && child->is_dirty) stack.push_back(std::make_pair(child, 0));
+            continue;
+        }
+        pages.push_back(page);
+        stack.pop_back();
+    }
+    std::vector<unsigned long> sectors;
+    allocate_index_pages(pages.size(), sectors);
+    const unsigned long sector_size = xvfs_header.sector_size;
+    const unsigned long page_size = xvfs_header.index_page_sectors * sector_size;
+    // соседние страницы пишутся одним обращением к хранилищу
+    const unsigned long max_write_size = 1024 * 1024;
+    std::vector<char> buf;
+    unsigned long buf_sector = 0;
+    for(size_t i = 0; i < pages.size(); ++i) {
+        _xvfs_index_page* page = pages[i];
+        if(page->sector != 0xFFFFFFFF) old_extents.push_back(_xvfs_extent(page->sector, xvfs_header.index_page_sectors));
+        page->sector = sectors[i];
+        if(buf.size() > 0 && (buf_sector + buf.size() / sector_size != page->sector || buf.size() + page_size > max_write_size)) {
+            if(!write_storage((unsigned long long)buf_sector * sector_size, &buf[0], buf.size())) return false;
+            buf.clear();
+        }
+        if(buf.size() == 0) buf_sector = page->sector;
+        const size_t offset = buf.size();
+        buf.resize(offset + page_size, 0);
+        unsigned long header[2];
+        header[0] = page->is_leaf ? INDEX_CODEC_LEAF_PAGE : INDEX_INNER_PAGE;
+        header[1] = page->is_leaf ? page->entries.size() : page->keys.size();
+        std::memcpy(&buf[offset], header, sizeof(header));
+        if(page->is_leaf) {
+            if(header[1] > 0) std::memcpy(&buf[offset + sizeof(header)], &page->entries[0], header[1] * sizeof(_xvfs_index_entry));
+        } else {
+            for(size_t j = 0; j < page->keys.size(); ++j) {
+                if(page->children[j] != NULL) page->keys[j].sector = page->children[j]->sector;
+            }
+            std::memcpy(&buf[offset + sizeof(header)], &page->keys[0], header[1] * sizeof(_xvfs_index_key));
+        }
+        page->is_dirty = false;
+    }
+    if(buf.size() > 0 && !write_storage((unsigned long long)buf_sector * sector_size, &buf[0], buf.size())) return false;
+    index_dirty_pages = 0;
+    xvfs_header.index_root_sector = index_root->sector;
+    return true;
+}
+
+void xvfs::get_files(std::vector<_xvfs_file_header>& files) {
+    std::vector<_xvfs_index_entry> entries;
+    if(index_root != NULL) get_index_entries(index_root, entries);
+    files.clear();
+    for(size_t i = 0; i < entries.size(); ++i) {
+        // первая запись файла начинается с первого сектора файла
+        if(i > 0 && entries[i].hash == entries[i - 1].hash) continue;
+        // словари zstd - служебные файлы
+        if(is_dictionary_hash(entries[i].hash)) continue;
+        files.push_back(_xvfs_file_header(entries[i].hash, entries[i].size, entries[i].start_sector, entries[i].real_size, entries[i].compression_type));
+    }
+}
+
+bool xvfs::apply_log_record(unsigned long type, const char* data, unsigned long size) {
+    if(type == LOG_WRITE_FILE || type == LOG_WRITE_CODEC_FILE) {
+        // в записях старого формата нет типа компрессии, такие файлы сжаты типом компрессии VFS
+        const unsigned long header_size = type == LOG_WRITE_FILE ? sizeof(_xvfs_legacy_file_header) : sizeof(_xvfs_file_header);
+        const unsigned long offset = header_size + sizeof(unsigned long);
+        if(size < offset) return false;
+        _xvfs_file_header file_header;
+        unsigned long extents_size = 0;
+        if(type == LOG_WRITE_FILE) {
+            _xvfs_legacy_file_header file;
+            std::memcpy(&file, data, sizeof(_xvfs_legacy_file_header));
+            file_header = _xvfs_file_header(file.hash, file.size, file.start_sector, file.real_size, xvfs_header.compression_type);
+        } else {
+            std::memcpy(&file_header, data, sizeof(_xvfs_file_header));
+        }
+        std::memcpy(&extents_size, data + header_size, sizeof(unsigned long));
+        if(extents_size != (size - offset) / sizeof(_xvfs_extent)) return false;
+        std::vector<_xvfs_extent> extents(extents_size);
+        if(extents_size > 0) std::memcpy(&extents[0], data + offset, extents_size * sizeof(_xvfs_extent));
+        _xvfs_file_header old_file_header;
+        std::vector<_xvfs_extent> old_extents;
+        // новые сектора файла могут совпадать со старыми, поэтому сначала освобождаем старые
+        if(find_file(file_header.hash, old_file_header, &old_extents)) clear_data(old_extents);
+        take_sectors(extents);
+        used_end_sector = std::max(used_end_sector, get_extents_end(extents));
+        return set_file(file_header, extents);
+    } else
+    if(type == LOG_DELETE_FILE) {
+        if(size != sizeof(long long)) return false;
+        long long hash_vfs_file = 0;
+        std::memcpy(&hash_vfs_file, data, sizeof(long long));
+        _xvfs_file_header file_header;
+        std::vector<_xvfs_extent> extents;
+        if(!find_file(hash_vfs_file, file_header, &extents)) return true;
+        clear_data(extents);
+        return erase_file(hash_vfs_file);
+    } else
+    if(type == LOG_BATCH) {
+        unsigned long offset = 0;
+        while(offset < size) {
+            if(size - offset < 2 * sizeof(unsigned long)) return false;
+            unsigned long record_type = 0;
+            unsigned long record_size = 0;
+            std::memcpy(&record_type, data + offset, sizeof(unsigned long));
+            std::memcpy(&record_size, data + offset + sizeof(unsigned long), sizeof(unsigned long));
+            offset += 2 * sizeof(unsigned long);
+            if(record_type == LOG_BATCH || record_size > size - offset) return false;
+            if(!apply_log_record(record_type, data + offset, record_size)) return false;
+            offset += record_size;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool xvfs::begin_batch() {
+    _xvfs_lock lock(this, true);
+    if(!is_open_file || is_batch || lock.is_error()) return false;
+    is_batch = true;
+    batch_records.clear();
+    batch_free_extents.clear();
+    return true;
+}
+
+bool xvfs::commit() {
+    _xvfs_lock lock(this, true);
+    if(!is_open_file || !is_batch || lock.is_error()) return false;
+    is_batch = false;
+    // теперь старые сектора файлов можно использовать повторно
+    retire_extents(batch_free_extents);
+    bool is_saved = batch_records.size() == 0 || save_log_record(LOG_BATCH, &batch_records[0], batch_records.size());
+    batch_records.clear();
+    batch_free_extents.clear();
+    if(!is_saved) {
+        // пакет не сохранен, возвращаемся к состоянию файла VFS
+        is_open_file = read_header();
+        return false;
+    }
+    return true;
+}
+
+bool xvfs::rollback() {
+    _xvfs_lock lock(this, true);
+    if(!is_open_file || !is_batch || lock.is_error()) return false;
+    is_batch = false;
+    batch_records.clear();
+    batch_free_extents.clear();
+    // сектора, выделенные в пакете, снова станут пустыми или окажутся за концом файла
+    is_open_file = read_header();
+    return is_open_file;
+}
+
+bool xvfs::read_log(unsigned long offset) {
+    log_tail = offset;
+    const unsigned long log_size = get_extents_sectors(xvfs_header.log_extents) * xvfs_header.sector_size;
+    if(log_size <= offset) return true;
+    // после контрольной точки журнал почти пустой, поэтому читаем его блоками только до последней записи
+    const unsigned long min_read_size = 64 * 1024;
+    // в буфере данные журнала начиная с offset
+    std::vector<char> buf;
+    unsigned long read_size = 0;
+    auto read_log_data = [&](unsigned long size) -> bool {
+        if(size <= offset + read_size) return true;
+        const unsigned long new_read_size = std::min(log_size - offset, std::max(size - offset, std::max(2 * read_size, min_read_size)));
+        buf.resize(new_read_size);
+        if(!read_region(xvfs_header.log_extents, offset + read_size, &buf[read_size], new_read_size - read_size)) return false;
+        read_size = new_read_size;
+        return true;
+    };
+    while(log_tail + sizeof(_xvfs_log_record) <= log_size) {
+        if(!read_log_data(log_tail + sizeof(_xvfs_log_record))) return false;
+        _xvfs_log_record record;
+        std::memcpy(&record, &buf[log_tail - offset], sizeof(_xvfs_log_record));
+        if(record.generation != xvfs_header.log_generation) break;
+        if(record.size > log_size - log_tail - sizeof(_xvfs_log_record)) break;
+        if(!read_log_data(log_tail + sizeof(_xvfs_log_record) + record.size)) return false;
+        const char* data = &buf[log_tail - offset + sizeof(_xvfs_log_record)];
+        if(record.crc != get_log_crc(record, data)) break;
+        if(!apply_log_record(record.type, data, record.size)) break;
+        log_tail += sizeof(_xvfs_log_record) + record.size;
+    }
+    return true;
+}
+
+long xvfs::read_data(const std::vector<_xvfs_extent>& extents, char* file_data, unsigned long file_size, unsigned long offset) {
+    if(!is_open_file) return ERROR_VFS_FILE_NOT_OPEN;
+
+    const unsigned long sector_data_size = xvfs_header.sector_size - sizeof(unsigned long);
+    // непрерывный участок читается блоками не больше max_read_size
+    const unsigned long max_read_size = 1024 * 1024;
+    unsigned long max_read_sectors = std::max(max_read_size / xvfs_header.sector_size, 1UL);
+    unsigned long len = 0;
+    char* buf = NULL;
+    if(storage_type != USE_MMAP_STORAGE) {
+        unsigned long max_extent_sectors = 0;
+        for(size_t i = 0; i < extents.size(); ++i) {
+            max_extent_sectors = std::max(max_extent_sectors, extents[i].sectors);
+        }
+        max_read_sectors = std::min(max_read_sectors, std::max(max_extent_sectors, 1UL));
+        buf = new char[max_read_sectors * xvfs_header.sector_size];
+    }
+    // сектора до смещения пропускаем, в первом секторе пропускаем skip байт
+    unsigned long skip_sectors = offset / sector_data_size;
+    unsigned long skip = offset % sector_data_size;
+    for(size_t i = 0; i < extents.size() && len < file_size; ++i) {
+        unsigned long sector = extents[i].start_sector;
+        unsigned long sectors = extents[i].sectors;
+        if(skip_sectors >= sectors) {
+            skip_sectors -= sectors;
+            continue;
+        }
+        sector += skip_sectors;
+        sectors -= skip_sectors;
+        skip_sectors = 0;
+        while(sectors > 0 && len < file_size) {
+            // читаем только те сектора, в которых еще остались данные
+            unsigned long read_sectors = std::min(std::min(sectors, max_read_sectors), get_sectors(file_size - len + skip));
+            unsigned long long pos = (unsigned long long)sector * xvfs_header.sector_size;
+            unsigned long read_size = read_sectors * xvfs_header.sector_size;
+            const char* data = NULL;
+            if(storage_type == USE_MMAP_STORAGE) {
+                // сектора копируем прямо из отображения
+                if(pos + read_size > storage_size) return ERROR_VFS_READING_FILE;
+                data = storage_map + pos;
+            } else {
+                if(!read_storage(pos, buf, read_size)) {
+                    delete[] buf;
+                    return ERROR_VFS_READING_FILE;
+                }
+                data = buf;
+            }
+            for(unsigned long j = 0; j < read_sectors; ++j) {
+                unsigned long part = std::min(sector_data_size - skip, file_size - len);
+                std::memcpy(file_data + len, data + j * xvfs_header.sector_size + skip, part);
+                len += part;
+                skip = 0;
+            }
+            sector += read_sectors;
+            sectors -= read_sectors;
+        }
+    }
+    if(buf != NULL) delete[] buf;
+    if(len != file_size) return ERROR_VFS_READING_FILE;
+    return len;
+}
+
+long xvfs::write_data(const std::vector<_xvfs_extent>& extents, char* file_data, unsigned long file_size) {
+    if(!is_open_file) return ERROR_VFS_FILE_NOT_OPEN;
+
+    const unsigned long sector_data_size = xvfs_header.sector_size - sizeof(unsigned long);
+    // непрерывный участок собирается в буфер вместе со ссылками и пишется блоками не больше max_write_size
+    const unsigned long max_write_size = 1024 * 1024;
+    unsigned long max_write_sectors = std::max(max_write_size / xvfs_header.sector_size, 1UL);
+    unsigned long len = 0;
+    char* buf = NULL;
+    if(storage_type != USE_MMAP_STORAGE) {
+        unsigned long max_extent_sectors = 0;
+        for(size_t i = 0; i < extents.size(); ++i) {
+            max_extent_sectors = std::max(max_extent_sectors, extents[i].sectors);
+        }
+        max_write_sectors = std::min(max_write_sectors, std::max(max_extent_sectors, 1UL));
+        buf = new char[max_write_sectors * xvfs_header.sector_size];
+    }
+
+    for(size_t i = 0; i < extents.size(); ++i) {
+        // ссылка из последнего сектора участка
+        const unsigned long extent_next_sector = i + 1 < extents.size() ? extents[i + 1].start_sector : 0xFFFFFFFF;
+        unsigned long sector = extents[i].start_sector;
+        unsigned long sectors = extents[i].sectors;
+        while(sectors > 0) {
+            unsigned long write_sectors = std::min(sectors, max_write_sectors);
+            unsigned long long pos = (unsigned long long)sector * xvfs_header.sector_size;
+            unsigned long write_size = write_sectors * xvfs_header.sector_size;
+            char* data = buf;
+            if(storage_type == USE_MMAP_STORAGE) {
+                // сектора собираем прямо в отображении
+                if(!map_storage(pos + write_size)) return ERROR_VFS_WRITING_FILE;
+                data = storage_map + pos;
+            }
+            for(unsigned long j = 0; j < write_sectors; ++j) {
+                char* sector_data = data + j * xvfs_header.sector_size;
+                unsigned long next_sector = j + 1 < sectors ? sector + j + 1 : extent_next_sector;
+                unsigned long part = std::min(sector_data_size, file_size - len);
+                std::memcpy(sector_data, file_data + len, part);
+                std::memset(sector_data + part, 0, sector_data_size - part);
+                std::memcpy(sector_data + sector_data_size, &next_sector, sizeof(unsigned long));
+                len += part;
+            }
+            if(storage_type == USE_MMAP_STORAGE) {
+                if(pos + write_size > storage_size) storage_size = pos + write_size;
+            } else
+            if(!write_storage(pos, buf, write_size)) {
+                delete[] buf;
+                //std::cout << "ERROR_VFS_WRITING_FILE" << std::endl;
+                return ERROR_VFS_WRITING_FILE;
+            }
+            sector += write_sectors;
+            sectors -= write_sectors;
+        }
+    }
+
+    if(buf != NULL) delete[] buf;
+    if(len != file_size) return ERROR_VFS_WRITING_FILE;
+    return len;
+}
+
+void xvfs::clear_data(const std::vector<_xvfs_extent>& extents) {
+    for(size_t i = 0; i < extents.size(); ++i) {
+        set_free_sectors(extents[i].start_sector, extents[i].sectors, true);
+    }
+}
+
+void xvfs::release_extents(const std::vector<_xvfs_extent>& extents) {
+    if(is_batch) {
+        batch_free_extents.insert(batch_free_extents.end(), extents.begin(), extents.end());
+        return;
+    }
+    retire_extents(extents);
+}
+
+void xvfs::retire_extents(const std::vector<_xvfs_extent>& extents) {
+    if(extents.size() == 0) return;
+    if(index_snapshot.load() == NULL) {
+        clear_data(extents);
+        return;
+    }
+    // сектора еще могут читать по старым снимкам
+    _xvfs_retired retired;
+    retired.snapshot = NULL;
+    retired.extents = extents;
+    retired.map = NULL;
+    retired.map_size = 0;
+    retired.map_handle = NULL;
+    retire_object(retired);
+}
+
+void xvfs::take_sectors(const std::vector<_xvfs_extent>& extents) {
+    for(size_t i = 0; i < extents.size(); ++i) {
+        const unsigned long stop_sector = extents[i].start_sector + extents[i].sectors;
+        set_free_sectors(extents[i].start_sector, extents[i].sectors, false);
+        if(stop_sector > end_sector) end_sector = stop_sector;
+    }
+}
+
+void xvfs::set_free_sectors(unsigned long start_sector, unsigned long sectors, bool is_free) {
+    unsigned long stop_sector = start_sector + sectors;
+    if(is_free) {
+        const size_t words = (stop_sector + 63) / 64;
+        if(free_bitmap.size() < words) free_bitmap.resize(words, 0);
+    } else {
+        stop_sector = std::min(stop_sector, (unsigned long)free_bitmap.size() * 64);
+    }
+    const unsigned long sector_size = xvfs_header.sector_size;
+    for(unsigned long sector = start_sector; sector < stop_sector;) {
+        const size_t word = sector / 64;
+        const unsigned long first_bit = sector % 64;
+        const unsigned long bits = std::min(64 - first_bit, stop_sector - sector);
+        const unsigned long long mask = (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << first_bit;
+        if(is_free) free_bitmap[word] |= mask;
+        else free_bitmap[word] &= ~mask;
+        // слово карты может лежать на границе двух секторов карты
+        const size_t first_dirty = word * sizeof(unsigned long long) / sector_size;
+        const size_t last_dirty = (word * sizeof(unsigned long long) + sizeof(unsigned long long) - 1) / sector_size;
+        if(first_dirty < free_bitmap_dirty.size()) free_bitmap_dirty[first_dirty] = 1;
+        if(last_dirty < free_bitmap_dirty.size()) free_bitmap_dirty[last_dirty] = 1;
+        sector += bits;
+    }
+    if(stop_sector > start_sector) set_free_extent(start_sector, stop_sector - start_sector, is_free);
+}
+
+void xvfs::set_free_extent(unsigned long start_sector, unsigned long sectors, bool is_free) {
+    if(sectors == 0) return;
+    unsigned long stop_sector = start_sector + sectors;
+    auto add_free_extent = [&](unsigned long first, unsigned long count) {
+        free_extents[first] = count;
+        free_extents_size.insert(std::make_pair(count, first));
+    };
+    // участки, которые пересекаются с сектором (а при освобождении и примыкают к ним)
+    auto it = free_extents.upper_bound(start_sector);
+    if(it != free_extents.begin()) {
+        auto prev = std::prev(it);
+        if(prev->first + prev->second > start_sector || (is_free && prev->first + prev->second == start_sector)) it = prev;
+    }
+    while(it != free_extents.end() && (it->first < stop_sector || (is_free && it->first == stop_sector))) {
+        const unsigned long first = it->first;
+        const unsigned long last = it->first + it->second;
+        free_extents_size.erase(std::make_pair(it->second, it->first));
+        it = free_extents.erase(it);
+        if(is_free) {
+            // соседние участки сливаются в один
+            start_sector = std::min(start_sector, first);
+            stop_sector = std::max(stop_sector, last);
+        } else {
+            // части участка за краями занятых секторов остаются пустыми
+            if(first < start_sector) add_free_extent(first, start_sector - first);
+            if(last > stop_sector) add_free_extent(stop_sector, last - stop_sector);
+        }
+    }
+    if(is_free) add_free_extent(start_sector, stop_sector - start_sector);
+}
+
+unsigned long xvfs::find_free_sector(unsigned long start_sector) {
+    auto it = free_extents.upper_bound(start_sector);
+    if(it != free_extents.begin()) {
+        auto prev = std::prev(it);
+        if(prev->first + prev->second > start_sector) return start_sector;
+    }
+    return it == free_extents.end() ? 0xFFFFFFFF : it->first;
+}
+
+unsigned long xvfs::get_free_run(unsigned long start_sector, unsigned long max_sectors) {
+    auto it = free_extents.upper_bound(start_sector);
+    if(it == free_extents.begin()) return 0;
+    --it;
+    if(it->first + it->second <= start_sector) return 0;
+    return std::min(it->first + it->second - start_sector, max_sectors);
+}
+
+unsigned long xvfs::get_free_sectors_end() {
+    if(free_extents.size() == 0) return 0;
+    auto it = std::prev(free_extents.end());
+    return it->first + it->second;
+}
+
+bool xvfs::read_free_bitmap() {
+    const size_t words = (xvfs_header.free_bitmap_sectors + 63) / 64;
+    const unsigned long region_size = get_extents_sectors(xvfs_header.free_bitmap_extents) * xvfs_header.sector_size;
+    if(words * sizeof(unsigned long long) > region_size) return false;
+    free_bitmap.assign(words, 0);
+    if(words > 0 && !read_region(xvfs_header.free_bitmap_extents, 0, reinterpret_cast<char *>(&free_bitmap[0]), words * sizeof(unsigned long long))) return false;
+    if(xvfs_header.free_bitmap_sectors % 64 != 0) free_bitmap.back() &= (1ULL << (xvfs_header.free_bitmap_sectors % 64)) - 1;
+    // собираем участки пустых секторов за один проход по карте
+    unsigned long run_start = 0;
+    unsigned long run_sectors = 0;
+    for(size_t word = 0; word < words; ++word) {
+        unsigned long long value = free_bitmap[word];
+        if(value == ~0ULL && run_start + run_sectors == word * 64) {
+            run_sectors += 64;
+            continue;
+        }
+        while(value != 0) {
+            const unsigned long sector = word * 64 + get_lowest_bit(value);
+            value &= value - 1;
+            if(run_sectors > 0 && run_start + run_sectors == sector) {
+                ++run_sectors;
+                continue;
+            }
+            if(run_sectors > 0) set_free_extent(run_start, run_sectors, true);
+            run_start = sector;
+            run_sectors = 1;
+        }
+    }
+    if(run_sectors > 0) set_free_extent(run_start, run_sectors, true);
+    free_bitmap_dirty.assign(get_extents_sectors(xvfs_header.free_bitmap_extents), 0);
+    return true;
+}
+
+void xvfs::resize_free_bitmap() {
+    if(xvfs_header.free_bitmap_sectors >= end_sector) return;
+    const unsigned long sector_size = xvfs_header.sector_size;
+    // сектора самой карты тоже увеличивают файл VFS, поэтому карта берется с запасом
+    unsigned long bitmap_sectors = xvfs_header.free_bitmap_sectors;
+    while(bitmap_sectors < end_sector) {
+        bitmap_sectors = (end_sector + end_sector / 4 + 64 * 64 + 63) / 64 * 64;
+        const unsigned long region_sectors = (bitmap_sectors / 8 + sector_size - 1) / sector_size;
+        resize_extents(xvfs_header.free_bitmap_extents, region_sectors);
+    }
+    xvfs_header.free_bitmap_sectors = bitmap_sectors;
+    free_bitmap_dirty.assign(get_extents_sectors(xvfs_header.free_bitmap_extents), 1);
+}
+
+bool xvfs::save_free_bitmap() {
+    const unsigned long sector_size = xvfs_header.sector_size;
+    const unsigned long bitmap_size = free_bitmap.size() * sizeof(unsigned long long);
+    const char* bitmap_data = bitmap_size > 0 ? reinterpret_cast<const char *>(&free_bitmap[0]) : NULL;
+    std::vector<char> buf;
+    // соседние измененные сектора карты пишутся одним обращением к хранилищу
+    for(size_t i = 0; i < free_bitmap_dirty.size();) {
+        if(!free_bitmap_dirty[i]) {
+            ++i;
+            continue;
+        }
+        size_t j = i;
+        while(j < free_bitmap_dirty.size() && free_bitmap_dirty[j]) {
+            free_bitmap_dirty[j] = 0;
+            ++j;
+        }
+        const unsigned long offset = i * sector_size;
+        buf.assign((j - i) * sector_size, 0);
+        if(offset < bitmap_size) std::memcpy(&buf[0], bitmap_data + offset, std::min((unsigned long)buf.size(), bitmap_size - offset));
+        if(!write_region(xvfs_header.free_bitmap_extents, offset, &buf[0], buf.size())) return false;
+        i = j;
+    }
+    return true;
+}
+
+unsigned long xvfs::get_last_new_sector() {
+    return end_sector;
+}
+
+void xvfs::add_extent(std::vector<_xvfs_extent>& extents, unsigned long start_sector, unsigned long sectors) {
+    if(sectors == 0) return;
+    if(extents.size() > 0 && extents.back().start_sector + extents.back().sectors == start_sector) {
+        extents.back().sectors += sectors;
+        return;
+    }
+    extents.push_back(_xvfs_extent(start_sector, sectors));
+}
+
+void xvfs::allocate_sectors(unsigned long sectors, unsigned long hint_sector, std::vector<_xvfs_extent>& extents) {
+    // не больше max_extents участков из пустых секторов, остальное берем в конце файла
+    const size_t max_extents = 8;
+    // пробуем продолжить участок с желаемого сектора
+    if(sectors > 0 && hint_sector != 0xFFFFFFFF) {
+        if(hint_sector == end_sector) {
+            add_extent(extents, end_sector, sectors);
+            end_sector += sectors;
+            return;
+        }
+        unsigned long n = get_free_run(hint_sector, sectors);
+        if(n > 0) {
+            set_free_sectors(hint_sector, n, false);
+            add_extent(extents, hint_sector, n);
+            sectors -= n;
+            if(sectors > 0 && hint_sector + n == end_sector) {
+                add_extent(extents, end_sector, sectors);
+                end_sector += sectors;
+                return;
+            }
+        }
+    }
+    if(sectors == 0) return;
+    auto take_run = [&](const _xvfs_extent& run, unsigned long n) {
+        set_free_sectors(run.start_sector, std::min(n, run.sectors), false);
+        add_extent(extents, run.start_sector, n);
+        if(n > run.sectors) end_sector += n - run.sectors;
+    };
+    if(allocation_type == FIRST_FIT_ALLOCATION) {
+        // первый подходящий участок по порядку секторов,
+        // участок, который доходит до конца файла, можно продолжить в конец файла
+        for(auto it = free_extents.begin(); it != free_extents.end(); ++it) {
+            if(it->second >= sectors || it->first + it->second == end_sector) {
+                take_run(_xvfs_extent(it->first, it->second), sectors);
+                return;
+            }
+        }
+    } else {
+        // наименьший подходящий участок
+        auto it = free_extents_size.lower_bound(std::make_pair(sectors, 0UL));
+        if(it != free_extents_size.end()) {
+            take_run(_xvfs_extent(it->second, it->first), sectors);
+            return;
+        }
+        // участок, который доходит до конца файла, продолжаем в конец файла
+        if(get_free_sectors_end() == end_sector && free_extents.size() > 0) {
+            auto last = std::prev(free_extents.end());
+            take_run(_xvfs_extent(last->first, last->second), sectors);
+            return;
+        }
+    }
+    // подходящего участка нет, собираем файл из самых больших участков
+    for(size_t i = 0; i < max_extents - 1 && sectors > 0 && free_extents_size.size() > 0; ++i) {
+        auto it = std::prev(free_extents_size.end());
+        const _xvfs_extent run(it->second, it->first);
+        unsigned long n = std::min(run.sectors, sectors);
+        take_run(run, n);
+        sectors -= n;
+    }
+    if(sectors > 0) {
+        add_extent(extents, end_sector, sectors);
+        end_sector += sectors;
+    }
+}
+
+void xvfs::resize_extents(std::vector<_xvfs_extent>& extents, unsigned long sectors) {
+    unsigned long current_sectors = 0;
+    for(size_t i = 0; i < extents.size(); ++i) {
+        current_sectors += extents[i].sectors;
+    }
+    if(current_sectors > sectors) {
+        // освобождаем лишние сектора с конца
+        std::vector<_xvfs_extent> released_extents;
+        unsigned long n = current_sectors - sectors;
+        while(n > 0) {
+            _xvfs_extent& last = extents.back();
+            unsigned long m = std::min(n, last.sectors);
+            released_extents.push_back(_xvfs_extent(last.start_sector + last.sectors - m, m));
+            last.sectors -= m;
+            n -= m;
+            if(last.sectors == 0) extents.pop_back();
+        }
+        clear_data(released_extents);
+    } else
+    if(current_sectors < sectors) {
+        unsigned long hint_sector = 0xFFFFFFFF;
+        if(extents.size() > 0) hint_sector = extents.back().start_sector + extents.back().sectors;
+        allocate_sectors(sectors - current_sectors, hint_sector, extents);
+    }
+}
+
+bool xvfs::compress_data(const char* raw_data, unsigned long raw_size, char*& data, unsigned long& size, long compression_type, _xvfs_codec_context* context, int dictionary_level) {
+    if(context == NULL) context = get_codec_context();
+#   if !defined(XFVS_USE_ZSTD)
+    // уровень сжатия со словарем нужен только zstd
+    (void)dictionary_level;
+#   endif
+#   if defined(XFVS_USE_ZLIB)
+    if(compression_type <= USE_ZLIB_LEVEL_9) {
+        // поток сжатия создается один раз, затем только сбрасывается (данные те же, что у compress2)
+        z_stream& stream = context->zlib_deflate;
+        if(context->zlib_deflate_level < 0) {
+            std::memset(&stream, 0, sizeof(stream));
+            if(deflateInit(&stream, compression_type) != Z_OK) return false;
+            context->zlib_deflate_level = compression_type;
+        } else {
+            if(deflateReset(&stream) != Z_OK) return false;
+            if(context->zlib_deflate_level != compression_type) {
+                if(deflateParams(&stream, compression_type, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+                context->zlib_deflate_level = compression_type;
+            }
+        }
+        size = deflateBound(&stream, raw_size);
+        if(size > 0xFFFFFFFFUL) return false;
+        data = new char[size];
+        stream.next_in = (Bytef*)raw_data;
+        stream.avail_in = raw_size;
+        stream.next_out = (Bytef*)data;
+        stream.avail_out = size;
+        if(deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+            delete[] data;
+            data = NULL;
+            return false;
+        }
+        size = stream.total_out;
+        //std::cout << "compress2 " << size << " old size " << raw_size << " type " << compression_type << std::endl;
+    } else
+#   endif
+#   if defined(XFVS_USE_MINLIZO)
+    if(compression_type == USE_MINLIZO) {
+        size = raw_size + raw_size / 16 + 64 + 3;
+        data = new char[size];
+        if(context->lzo_wrkmem.empty()) {
+            context->lzo_wrkmem.resize((LZO1X_1_MEM_COMPRESS + sizeof(lzo_align_t) - 1) / sizeof(lzo_align_t));
+        }
+        lzo_uint lzo_len = size;
+        int r = lzo1x_1_compress((const unsigned char*)raw_data, raw_size, (unsigned char*)data, &lzo_len, &context->lzo_wrkmem[0]);
+        size = lzo_len;
+        if(r != LZO_E_OK) {
+            delete[] data;
+            data = NULL;
+            return false;
+        }
+    } else
+#   endif
+#   if defined(XFVS_USE_LZ4)
+    if(compression_type == USE_LZ4) {
+        size = LZ4_compressBound(raw_size);
+        //std::cout << "lz4 len " << size << std::endl;
+        data = new char[size];
+        if(context->lz4_state.empty()) {
+            context->lz4_state.resize((LZ4_sizeofState() + sizeof(long long) - 1) / sizeof(long long));
+        }
+        int compressed_data_size = LZ4_compress_fast_extState(&context->lz4_state[0], raw_data, data, raw_size, size, 1);
+        if(compressed_data_size <= 0) {
+            //std::cout << "compressed_data_size " << compressed_data_size << std::endl;
+            delete[] data;
+            data = NULL;
+            return false;
+        }
+        size = compressed_data_size;
+    } else
+#   endif
+#   if defined(XFVS_USE_ZSTD)
+    if(is_zstd_compression(compression_type)) {
+        size = ZSTD_compressBound(raw_size);
+        data = new char[size];
+        // контекст сжатия переиспользуется между файлами
+        if(context->zstd_cctx == NULL) context->zstd_cctx = ZSTD_createCCtx();
+        const size_t compressed_data_size = context->zstd_cctx == NULL ? 0 :
+            ZSTD_compressCCtx(context->zstd_cctx, data, size, raw_data, raw_size, compression_type - 300);
+        if(context->zstd_cctx == NULL || ZSTD_isError(compressed_data_size)) {
+            delete[] data;
+            data = NULL;
+            return false;
+        }
+        size = compressed_data_size;
+    } else
+    if(compression_type == USE_ZSTD_DICTIONARY) {
+        if(!load_zstd_dictionary()) return false;
+        ZSTD_CDict* cdict = get_zstd_cdict(dictionary_level);
+        if(context->zstd_cctx == NULL) context->zstd_cctx = ZSTD_createCCtx();
+        if(cdict == NULL || context->zstd_cctx == NULL) return false;
+        size = ZSTD_compressBound(raw_size);
+        data = new char[size];
+        const size_t compressed_data_size = ZSTD_compress_usingCDict(context->zstd_cctx, data, size, raw_data, raw_size, cdict);
+        if(ZSTD_isError(compressed_data_size)) {
+            delete[] data;
+            data = NULL;
+            return false;
+        }
+        size = compressed_data_size;
+    } else
+#   endif
+    {
+#       if !(defined(XFVS_USE_ZLIB) || defined(XFVS_USE_MINLIZO) || defined(XFVS_USE_LZ4) || defined(XFVS_USE_ZSTD))
+        // без библиотек сжатия данные не сжимаются
+        (void)raw_data;
+        (void)raw_size;
+        (void)data;
+        (void)size;
+        (void)compression_type;
+#       endif
+        return false;
+    }
+    return true;
+}
+
+bool xvfs::compress_chunks(const char* raw_data, unsigned long raw_size, char*& data, unsigned long& size, long compression_type) {
+    const unsigned long chunks = (raw_size + compression_chunk_size - 1) / compression_chunk_size;
+    const unsigned long header_size = (2 + chunks) * sizeof(unsigned long);
+    // каждая часть занимает не больше исходного размера, поэтому часть i сначала пишется на место исходной части,
+    // а после сжатия всех частей части сдвигаются друг к другу
+    data = new char[header_size + raw_size];
+    unsigned long* header = (unsigned long*)data;
+    header[0] = compression_chunk_size;
+    header[1] = chunks;
+    std::vector<unsigned long> chunks_sizes(chunks, 0);
+    run_compression_tasks(chunks, [&](unsigned long i, _xvfs_codec_context* context) {
+        const char* chunk = raw_data + i * compression_chunk_size;
+        const unsigned long chunk_size = std::min(compression_chunk_size, raw_size - i * compression_chunk_size);
+        char* chunk_place = data + header_size + i * compression_chunk_size;
+        char* chunk_data = NULL;
+        unsigned long chunk_data_size = 0;
+        if(!compress_data(chunk, chunk_size, chunk_data, chunk_data_size, compression_type, context)) return;
+        if(chunk_data_size < chunk_size) {
+            std::memcpy(chunk_place, chunk_data, chunk_data_size);
+            chunks_sizes[i] = chunk_data_size;
+        } else {
+            std::memcpy(chunk_place, chunk, chunk_size);
+            chunks_sizes[i] = chunk_size;
+        }
+        delete[] chunk_data;
+    });
+    unsigned long offset = 0;
+    for(unsigned long i = 0; i < chunks; ++i) {
+        if(chunks_sizes[i] == 0) {
+            delete[] data;
+            data = NULL;
+            return false;
+        }
+        std::memmove(data + header_size + offset, data + header_size + i * compression_chunk_size, chunks_sizes[i]);
+        offset += chunks_sizes[i];
+        header[2 + i] = offset;
+    }
+    size = header_size + offset;
+    return true;
+}
+
+void xvfs::run_compression_tasks(unsigned long tasks, const std::function<void(unsigned long, _xvfs_codec_context*)>& task) {
+    // потоки сжатия заняты другим вызовом - выполняем задачи в вызывающем потоке
+    std::unique_lock<std::mutex> compression_lock(compression_mutex, std::try_to_lock);
+    if(!compression_lock.owns_lock() || compression_workers.size() == 0 || tasks <= 1) {
+        for(unsigned long i = 0; i < tasks; ++i) {
+            task(i, get_codec_context());
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> workers_lock(compression_workers_mutex);
+        compression_task = &task;
+        compression_tasks = tasks;
+        compression_next_task = 0;
+        ++compression_job;
+    }
+    compression_condition.notify_all();
+    for(unsigned long i = compression_next_task++; i < tasks; i = compression_next_task++) {
+        task(i, get_codec_context());
+    }
+    // задачи разобраны, дожидаемся потоков, которые еще выполняют свои
+    std::unique_lock<std::mutex> workers_lock(compression_workers_mutex);
+    compression_done_condition.wait(workers_lock, [&]() {return compression_busy_workers == 0;});
+    // опоздавший поток не должен взять задачи, которых уже нет
+    compression_task = NULL;
+    compression_tasks = 0;
+}
+
+void xvfs::run_compression_worker() {
+    std::unique_lock<std::mutex> workers_lock(compression_workers_mutex);
+    unsigned long job = compression_job;
+    while(true) {
+        compression_condition.wait(workers_lock, [&]() {return is_compression_stop || compression_job != job;});
+        if(is_compression_stop) return;
+        job = compression_job;
+        if(compression_task == NULL) continue;
+        ++compression_busy_workers;
+        const std::function<void(unsigned long, _xvfs_codec_context*)>& task = *compression_task;
+        const unsigned long tasks = compression_tasks;
+        workers_lock.unlock();
+        // у постоянного потока свой контекст компрессии, он переживает вызовы
+        for(unsigned long i = compression_next_task++; i < tasks; i = compression_next_task++) {
+            task(i, get_codec_context());
+        }
+        workers_lock.lock();
+        if(--compression_busy_workers == 0) compression_done_condition.notify_all();
+    }
+}
+
+void xvfs::stop_compression_workers() {
+    {
+        std::lock_guard<std::mutex> workers_lock(compression_workers_mutex);
+        is_compression_stop = true;
+    }
+    compression_condition.notify_all();
+    for(size_t i = 0; i < compression_workers.size(); ++i) {
+        compression_workers[i].join();
+    }
+    compression_workers.clear();
+    std::lock_guard<std::mutex> workers_lock(compression_workers_mutex);
+    is_compression_stop = false;
+}
+
+xvfs::_xvfs_codec_context::~_xvfs_codec_context() {
+#   if defined(XFVS_USE_ZLIB)
+    if(zlib_deflate_level >= 0) deflateEnd(&zlib_deflate);
+    if(is_zlib_inflate) inflateEnd(&zlib_inflate);
+#   endif
+#   if defined(XFVS_USE_ZSTD)
+    ZSTD_freeCCtx(zstd_cctx);
+    ZSTD_freeDCtx(zstd_dctx);
+#   endif
+}
+
+xvfs::_xvfs_codec_context* xvfs::get_codec_context() {
+    static thread_local _xvfs_codec_context context;
+    return &context;
+}
+
+bool xvfs::set_index_snapshots(bool is_snapshots) {
+    _xvfs_lock lock(this, true);
+    if(!is_open_file || shared_state != NULL || lock.is_error()) return false;
+    is_index_snapshots = is_snapshots;
+    if(is_snapshots) {
+        if(build_snapshot()) return true;
+        is_index_snapshots = false;
+        return false;
+    }
+    // читатели снова берут блокировку, дожидаемся тех, кто читает по снимку
+    publish_snapshot(NULL);
+    reclaim_retired(true);
+    return true;
+}
+
+bool xvfs::set_shared_access(bool is_shared) {
+    _xvfs_lock lock(this, true);
+    if(!is_open_file || is_batch || is_index_snapshots || lock.is_error()) return false;
+    if(!is_shared) {
+        if(shared_state == NULL) return true;
+        publish_shared_state();
+        unlock_process();
+        close_shared_state();
+        return true;
+    }
+    if(shared_state != NULL) return true;
+    if(!open_shared_state()) return false;
+    if(!lock_process(true)) {
+        close_shared_state();
+        return false;
+    }
+    if(shared_state->mark != shared_state_mark) {
+        std::memset(shared_state, 0, sizeof(_xvfs_shared_state));
+        shared_state->mark = shared_state_mark;
+    } else {
+        // VFS могли изменить другие процессы после того, как этот процесс ее открыл
+        storage_size = std::max(storage_size.load(), shared_state->storage_size);
+        if(storage_type == USE_MMAP_STORAGE && !map_storage(storage_size)) is_open_file = false;
+        if(is_open_file) is_open_file = read_header();
+    }
+    // новое поколение заставит остальные процессы сверить состояние
+    if(is_open_file) {
+        shared_state->log_generation = xvfs_header.log_generation;
+        shared_state->log_tail = log_tail;
+        shared_state->storage_size = storage_size;
+        shared_generation = ++shared_state->generation;
+    }
+    unlock_process();
+    if(!is_open_file) close_shared_state();
+    return is_open_file;
+}
+
+void xvfs::set_async_threads(unsigned threads, size_t max_tasks) {
+    stop_async_workers();
+    std::lock_guard<std::mutex> async_lock(async_mutex);
+    async_threads = threads;
+    max_async_tasks = std::max(max_tasks, (size_t)1);
+}
+
+bool xvfs::submit_async_task(long long hash_vfs_file, std::function<void()> task) {
+    if(!is_open_file) return false;
+    std::lock_guard<std::mutex> async_lock(async_mutex);
+    if(is_async_stop || async_tasks_size >= max_async_tasks) return false;
+    if(async_workers.size() == 0) {
+        const unsigned threads = std::max(async_threads == 0 ? std::thread::hardware_concurrency() : async_threads, 1U);
+        for(unsigned i = 0; i < threads; ++i) {
+            _xvfs_async_worker* worker = new _xvfs_async_worker();
+            worker->thread = std::thread(&xvfs::run_async_worker, this, worker);
+            async_workers.push_back(worker);
+        }
+    }
+    _xvfs_async_worker* worker = async_workers[(size_t)(((unsigned long long)hash_vfs_file * 0x9E3779B97F4A7C15ULL) >> 32) % async_workers.size()];
+    worker->tasks.push_back(std::move(task));
+    ++async_tasks_size;
+    worker->condition.notify_one();
+    return true;
+}
+
+void xvfs::run_async_worker(_xvfs_async_worker* worker) {
+    std::unique_lock<std::mutex> async_lock(async_mutex);
+    while(true) {
+        worker->condition.wait(async_lock, [&]() {return is_async_stop || worker->tasks.size() > 0;});
+        // при остановке очередь дорабатывается до конца
+        if(worker->tasks.size() == 0) return;
+        std::function<void()> task = std::move(worker->tasks.front());
+        worker->tasks.pop_front();
+        --async_tasks_size;
+        async_lock.unlock();
+        task();
+        async_lock.lock();
+    }
+}
+
+void xvfs::stop_async_workers() {
+    std::vector<_xvfs_async_worker*> workers;
+    {
+        std::lock_guard<std::mutex> async_lock(async_mutex);
+        is_async_stop = true;
+        workers.swap(async_workers);
+        for(size_t i = 0; i < workers.size(); ++i) {
+            workers[i]->condition.notify_one();
+        }
+    }
+    for(size_t i = 0; i < workers.size(); ++i) {
+        workers[i]->thread.join();
+        delete workers[i];
+    }
+    std::lock_guard<std::mutex> async_lock(async_mutex);
+    is_async_stop = false;
+}
+
+std::future<xvfs::_xvfs_read_result> xvfs::async_read_file(long long hash_vfs_file) {
+    std::shared_ptr<std::promise<_xvfs_read_result>> promise = std::make_shared<std::promise<_xvfs_read_result>>();
+    std::future<_xvfs_read_result> future = promise->get_future();
+    const bool is_submitted = async_read_file(hash_vfs_file, [promise](long len, char* data) {
+        _xvfs_read_result result;
+        result.len = len;
+        result.data = data;
+        promise->set_value(result);
+    });
+    if(!is_submitted) {
+        _xvfs_read_result result;
+        result.len = is_open_file ? ERROR_ASYNC_QUEUE_FULL : ERROR_VFS_FILE_NOT_OPEN;
+        result.data = NULL;
+        promise->set_value(result);
+    }
+    return future;
+}
+
+std::future<xvfs::_xvfs_read_result> xvfs::async_read_file(std::string vfs_file_name) {
+    return async_read_file(calculate_crc64(vfs_file_name));
+}
+
+bool xvfs::async_read_file(long long hash_vfs_file, std::function<void(long, char*)> callback) {
+    return submit_async_task(hash_vfs_file, [this, hash_vfs_file, callback]() {
+        char* data = NULL;
+        const long len = read_file(hash_vfs_file, data);
+        if(callback) callback(len, data);
+        else delete[] data;
+    });
+}
+
+std::future<bool> xvfs::async_write_file(long long hash_vfs_file, const char* data, unsigned long len) {
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    const bool is_submitted = async_write_file(hash_vfs_file, data, len, [promise](bool is_written) {
+        promise->set_value(is_written);
+    });
+    if(!is_submitted) promise->set_value(false);
+    return future;
+}
+
+std::future<bool> xvfs::async_write_file(long long hash_vfs_file, const char* data, unsigned long len, long compression_type) {
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    // данные копируются, чтобы вызывающий мог сразу освободить буфер
+    std::shared_ptr<std::vector<char>> buffer = std::make_shared<std::vector<char>>(data, data + len);
+    const bool is_submitted = submit_async_task(hash_vfs_file, [this, hash_vfs_file, buffer, compression_type, promise]() {
+        promise->set_value(write_file(hash_vfs_file, buffer->size() > 0 ? &(*buffer)[0] : NULL, buffer->size(), compression_type));
+    });
+    if(!is_submitted) promise->set_value(false);
+    return future;
+}
+
+std::future<bool> xvfs::async_write_file(std::string vfs_file_name, const char* data, unsigned long len) {
+    return async_write_file(calculate_crc64(vfs_file_name), data, len);
+}
+
+bool xvfs::async_write_file(long long hash_vfs_file, const char* data, unsigned long len, std::function<void(bool)> callback) {
+    // данные копируются, чтобы вызывающий мог сразу освободить буфер
+    std::shared_ptr<std::vector<char>> buffer = std::make_shared<std::vector<char>>(data, data + len);
+    return submit_async_task(hash_vfs_file, [this, hash_vfs_file, buffer, callback]() {
+        const bool is_written = write_file(hash_vfs_file, buffer->size() > 0 ? &(*buffer)[0] : NULL, buffer->size());
+        if(callback) callback(is_written);
+    });
+}
+
+std::future<bool> xvfs::async_delete_file(long long hash_vfs_file) {
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    const bool is_submitted = async_delete_file(hash_vfs_file, [promise](bool is_deleted) {
+        promise->set_value(is_deleted);
+    });
+    if(!is_submitted) promise->set_value(false);
+    return future;
+}
+
+std::future<bool> xvfs::async_delete_file(std::string vfs_file_name) {
+    return async_delete_file(calculate_crc64(vfs_file_name));
+}
+
+bool xvfs::async_delete_file(long long hash_vfs_file, std::function<void(bool)> callback) {
+    return submit_async_task(hash_vfs_file, [this, hash_vfs_file, callback]() {
+        const bool is_deleted = delete_file(hash_vfs_file);
+        if(callback) callback(is_deleted);
+    });
+}
+
+void xvfs::set_compression_threads(unsigned threads) {
+    // дожидаемся вызова, который сейчас занимает потоки сжатия
+    std::lock_guard<std::mutex> compression_lock(compression_mutex);
+    if(threads == 0) threads = std::thread::hardware_concurrency();
+    threads = std::max(threads, 1U);
+    if(threads == compression_threads && compression_workers.size() + 1 == threads) return;
+    stop_compression_workers();
+    compression_threads = threads;
+    // один из потоков сжатия - вызывающий поток
+    for(unsigned i = 1; i < compression_threads; ++i) {
+        compression_workers.push_back(std::thread(&xvfs::run_compression_worker, this));
     }
-    delete[] buf;
-    delete[] header_data;
-    return true;
 }
 
-long xvfs::read_data(unsigned long start_sector, char* file_data, unsigned long file_size) {
-    if(!is_open_file) return ERROR_VFS_FILE_NOT_OPEN;
+bool xvfs::is_compressible(const char* data, unsigned long size, long compression_type, int dictionary_level) {
+    if(size <= 2 * compression_sample_size) return true;
+    char* sample_data = NULL;
+    unsigned long sample_size = 0;
+    if(!compress_data(data + (size - compression_sample_size) / 2, compression_sample_size, sample_data, sample_size, compression_type, NULL, dictionary_level)) return true;
+    delete[] sample_data;
+    return (double)compression_sample_size >= min_compression_ratio * sample_size;
+}
 
-    unsigned long next_sector = start_sector;
-    unsigned long next_pos = start_sector * xvfs_header.sector_size; // получаем начальный сектор
-    unsigned long len = 0;
-    char* buf = new char[xvfs_header.sector_size];
-    while(next_sector != 0xFFFFFFFF) {
-        fvs_file.seekg(next_pos, std::ios::beg);
-        if(!fvs_file) {
-            ///fvs_file.close();
-            delete[] buf;
-            return ERROR_VFS_READING_FILE;
-        }
-        fvs_file.read(buf, xvfs_header.sector_size);
-        if(!fvs_file) {
-            ///fvs_file.close();
-            delete[] buf;
-            return ERROR_VFS_READING_FILE;
-        }
-        unsigned long old_len = len;
-        len += xvfs_header.sector_size - sizeof(unsigned long);
-        if(len > file_size) len = file_size;
-        std::memcpy(file_data + old_len, buf, len - old_len);
-        if(len == file_size) break;
-        next_sector = ((unsigned long*)(buf + (xvfs_header.sector_size - sizeof(unsigned long))))[0];
-        next_pos = next_sector * xvfs_header.sector_size;
-    }
-    ///fvs_file.close();
-    delete[] buf;
-    return len;
+void xvfs::update_compression_speed(unsigned long size, double seconds) {
+    // по маленьким файлам скорость не оценить
+    const unsigned long min_size = 4096;
+    const unsigned long min_samples = 8;
+    if(min_compression_speed <= 0 || size < min_size) return;
+    const double speed = size / std::max(seconds, 1e-9);
+    compression_speed = compression_speed_samples == 0 ? speed : 0.75 * compression_speed + 0.25 * speed;
+    if(++compression_speed_samples < min_samples) return;
+    long compression_type = adaptive_compression_type;
+    if(compression_speed < min_compression_speed) {
+        compression_type = get_compression_level(adaptive_compression_type, -1);
+    } else
+    if(compression_speed > 2 * min_compression_speed && adaptive_compression_type != xvfs_header.compression_type) {
+        // уровень сжатия не поднимается выше типа компрессии VFS
+        compression_type = get_compression_level(adaptive_compression_type, 1);
+    }
+    if(compression_type == adaptive_compression_type) return;
+    adaptive_compression_type = compression_type;
+    compression_speed = 0;
+    compression_speed_samples = 0;
 }
 
-long xvfs::write_data(unsigned long start_sector, char* file_data, unsigned long file_size) {
-    if(!is_open_file) return ERROR_VFS_FILE_NOT_OPEN;
+long xvfs::get_compression_level(long compression_type, int step) {
+    if(compression_type >= USE_ZLIB_LEVEL_1 && compression_type <= USE_ZLIB_LEVEL_9) {
+        return std::min(std::max(compression_type + step, (long)USE_ZLIB_LEVEL_1), (long)USE_ZLIB_LEVEL_9);
+    }
+    if(is_zstd_compression(compression_type)) {
+        // у zstd нет нулевого уровня, за уровнем 1 сразу идет уровень -1
+        long level = compression_type - 300 + step;
+        if(level == 0) level += step;
+        return std::min(std::max(level + 300, (long)USE_ZSTD_LEVEL_NEG_7), (long)USE_ZSTD_LEVEL_22);
+    }
+    return compression_type;
+}
 
-    unsigned long next_sector = start_sector;
-    unsigned long next_pos = start_sector * xvfs_header.sector_size; // получаем начальный сектор
-    unsigned long len = 0;
+void xvfs::set_adaptive_compression(bool is_adaptive, double min_ratio, double min_speed) {
+    _xvfs_lock lock(this, true);
+    if(lock.is_error()) return;
+    is_adaptive_compression = is_adaptive;
+    min_compression_ratio = min_ratio;
+    min_compression_speed = min_speed;
+    adaptive_compression_type = xvfs_header.compression_type;
+    compression_speed = 0;
+    compression_speed_samples = 0;
+}
 
-    fvs_file.seekg (0, std::ios::end);
-    unsigned long real_file_size = fvs_file.tellg();
-    fvs_file.seekg (next_pos, std::ios::beg);
-    fvs_file.clear();
+#if defined(XFVS_USE_ZSTD)
+bool xvfs::load_zstd_dictionary() {
+    if(is_zstd_dictionary_loaded) return zstd_dictionary_id != 0;
+    is_zstd_dictionary_loaded = true;
+    unsigned dictionary_id = 0;
+    char* data = NULL;
+    if(read_vfs_file(zstd_dictionary_hash, data) == sizeof(dictionary_id)) std::memcpy(&dictionary_id, data, sizeof(dictionary_id));
+    delete[] data;
+    // словарь не менялся, подготовленные словари остаются
+    if(dictionary_id == zstd_dictionary_id) return zstd_dictionary_id != 0;
+    free_zstd_cdicts();
+    zstd_dictionary.clear();
+    zstd_dictionary_id = 0;
+    if(dictionary_id == 0) return false;
+    data = NULL;
+    long len = read_vfs_file(zstd_dictionary_hash | dictionary_id, data);
+    if(len > 0) {
+        zstd_dictionary.assign(data, data + len);
+        zstd_dictionary_id = dictionary_id;
+    }
+    delete[] data;
+    return zstd_dictionary_id != 0;
+}
 
-    char* buf = new char[xvfs_header.sector_size];
-    std::memset(buf, 0, xvfs_header.sector_size);
-
-    bool is_end_file = false;
-
-    while(1) {
-        //std::cout << "write sector " << next_sector << std::endl;
-        unsigned long old_len = len;
-        len += xvfs_header.sector_size - sizeof(unsigned long);
-        if(len >= file_size) {
-            len = file_size;
-            next_sector = 0xFFFFFFFF;
-        } else if(!is_end_file) {
-            // узнаем номер следующего сектора
-            unsigned long offset_sector = next_pos + xvfs_header.sector_size - sizeof(unsigned long); // смещение в файле, где лежит сектор
-            if(offset_sector < real_file_size) { // если смещение меньше размера файла
-                fvs_file.seekg(offset_sector, std::ios::beg);
-                fvs_file.clear();
-                fvs_file.read(reinterpret_cast<char *>(&next_sector),sizeof(unsigned long));
-                fvs_file.seekg(next_pos, std::ios::beg);
-                //std::cout << "read next_sector " << next_sector << std::endl;
-                if(next_sector == 0xFFFFFFFF) {
-                    // выбираем один из пустых секторов
-                    // или перемещаемся в конец файла
-                    if(xvfs_header.empty_sectors.size() > 0) {
-                        next_sector = xvfs_header.empty_sectors[0];
-                        xvfs_header.empty_sectors.erase(xvfs_header.empty_sectors.begin());
-                    } else {
-                        fvs_file.seekg(0, std::ios::end);
-                        unsigned long _size = fvs_file.tellg();
-                        next_sector = _size / xvfs_header.sector_size;
-                    }
-                }
-            } else {
-                is_end_file = true;
-                next_sector = (real_file_size / xvfs_header.sector_size) + 1;
-            }
-        } else {
-            next_sector++;
-        }
+ZSTD_CDict* xvfs::get_zstd_cdict(int level) {
+    // словарь готовится один раз для каждого уровня, адаптивное сжатие меняет уровень от файла к файлу
+    auto it = zstd_cdicts.find(level);
+    if(it != zstd_cdicts.end()) return it->second;
+    if(zstd_dictionary.size() == 0) return NULL;
+    ZSTD_CDict* cdict = ZSTD_createCDict(&zstd_dictionary[0], zstd_dictionary.size(), level);
+    if(cdict != NULL) zstd_cdicts[level] = cdict;
+    return cdict;
+}
 
-        std::memcpy(buf, file_data + old_len, len - old_len);
-        std::memcpy(buf + xvfs_header.sector_size - sizeof(unsigned long), &next_sector, sizeof(unsigned long));
+void xvfs::free_zstd_cdicts() {
+    for(auto it = zstd_cdicts.begin(); it != zstd_cdicts.end(); ++it) {
+        ZSTD_freeCDict(it->second);
+    }
+    zstd_cdicts.clear();
+}
 
-        fvs_file.seekg (next_pos, std::ios::beg);
-        fvs_file.write(buf, xvfs_header.sector_size);
+ZSTD_DDict* xvfs::get_zstd_ddict(unsigned dictionary_id) {
+    if(dictionary_id == 0) return NULL;
+    std::lock_guard<std::mutex> dictionary_lock(dictionary_mutex);
+    auto it = zstd_ddicts.find(dictionary_id);
+    if(it != zstd_ddicts.end()) return it->second;
+    char* data = NULL;
+    long len = read_vfs_file(zstd_dictionary_hash | dictionary_id, data);
+    ZSTD_DDict* ddict = len > 0 ? ZSTD_createDDict(data, len) : NULL;
+    delete[] data;
+    if(ddict != NULL) zstd_ddicts[dictionary_id] = ddict;
+    return ddict;
+}
+#endif
 
-        if(!fvs_file) {
-            delete[] buf;
-            //std::cout << "ERROR_VFS_WRITING_FILE" << std::endl;
-            return ERROR_VFS_WRITING_FILE;
+bool xvfs::train_dictionary(unsigned long max_dictionary_size, unsigned long max_samples) {
+    _xvfs_lock lock(this, true);
+#   if defined(XFVS_USE_ZSTD)
+    if(!is_open_file || is_batch || max_dictionary_size == 0 || max_samples == 0 || lock.is_error()) return false;
+    std::vector<_xvfs_file_header> files;
+    get_files(files);
+    std::vector<long long> hashes;
+    for(size_t i = 0; i < files.size(); ++i) {
+        if(files[i].real_size == 0 || files[i].real_size > max_dictionary_file_size) continue;
+        hashes.push_back(files[i].hash);
+    }
+    // файлы для обучения берутся равномерно по всему индексу
+    const size_t step = (hashes.size() + max_samples - 1) / max_samples;
+    std::vector<char> samples;
+    std::vector<size_t> samples_sizes;
+    for(size_t i = 0; i < hashes.size(); i += step) {
+        char* data = NULL;
+        long len = read_file(hashes[i], data);
+        if(len > 0) {
+            samples.insert(samples.end(), data, data + len);
+            samples_sizes.push_back(len);
         }
-        if(len == file_size) break;
-        next_pos = next_sector * xvfs_header.sector_size;
+        delete[] data;
     }
+    if(samples_sizes.size() == 0) return false;
+    std::vector<char> dictionary(max_dictionary_size);
+    const size_t dictionary_size = ZDICT_trainFromBuffer(&dictionary[0], dictionary.size(), &samples[0], &samples_sizes[0], samples_sizes.size());
+    if(ZDICT_isError(dictionary_size)) return false;
+    dictionary.resize(dictionary_size);
+    unsigned dictionary_id = ZDICT_getDictID(&dictionary[0], dictionary_size);
+    if(dictionary_id == 0) return false;
+    // сначала сохраняем словарь, затем id текущего словаря
+    if(!write_vfs_file(zstd_dictionary_hash | dictionary_id, &dictionary[0], dictionary_size, NO_COMPRESSION)) return false;
+    if(!write_vfs_file(zstd_dictionary_hash, reinterpret_cast<char *>(&dictionary_id), sizeof(dictionary_id), NO_COMPRESSION)) return false;
+    zstd_dictionary.swap(dictionary);
+    zstd_dictionary_id = dictionary_id;
+    is_zstd_dictionary_loaded = true;
+    free_zstd_cdicts();
+    return true;
+#   else
+    // без zstd словарь не обучить
+    (void)max_dictionary_size;
+    (void)max_samples;
+    return false;
+#   endif
+}
 
-    delete[] buf;
-    return len;
+bool xvfs::write_file(long long hash_vfs_file, char* _data, unsigned long _len) {
+    _xvfs_lock lock(this, true);
+    if(lock.is_error()) return false;
+    // в адаптивном режиме уровень сжатия может отличаться от типа компрессии VFS
+    return write_file(hash_vfs_file, _data, _len, is_adaptive_compression ? adaptive_compression_type : xvfs_header.compression_type);
+}
+
+bool xvfs::write_file(long long hash_vfs_file, char* data, unsigned long len, long compression_type) {
+    // хэши словарей zstd пишет только train_dictionary()
+    if(is_dictionary_hash(hash_vfs_file)) return false;
+    return write_vfs_file(hash_vfs_file, data, len, compression_type);
 }
 
-bool xvfs::clear_data(unsigned long start_sector, bool is_first_sector) {
-    if(!is_open_file) return false; // файл не был открыт
-    if(start_sector == 0xFFFFFFFF) return true; // если это последний сектор, просто выходим
-    //std::fstream fout(file_name, std::ios_base::binary | std::ios::in | std::ios::out | std::ios::ate);
-    if (!fvs_file.is_open()) {
-        return false; // не смогли октрыть файл
+bool xvfs::write_vfs_file(long long hash_vfs_file, char* _data, unsigned long _len, long compression_type) {
+    _xvfs_lock lock(this, true);
+    if(!is_open_file || !is_compression_type(compression_type) || lock.is_error()) return false;
+    _xvfs_file_header file_header;
+    std::vector<_xvfs_extent> file_extents;
+    const bool is_file = find_file(hash_vfs_file, file_header, &file_extents);
+
+    if(_len == 0) { // если файл пустой, просто сохраним данные в заголовке
+        std::vector<_xvfs_extent> empty_extents;
+        file_header = _xvfs_file_header(hash_vfs_file, 0, 0xFFFFFFFF, 0);
+        if(!set_file(file_header, empty_extents)) return false;
+        // освободим сектора файла, когда в индексе его уже нет
+        if(is_file) release_extents(file_extents);
+        // сохраняем изменение в журнал
+        return save_file_header(file_header, empty_extents);
     }
-    unsigned long next_sector = start_sector;
-    unsigned long next_pos = start_sector * xvfs_header.sector_size; // получаем начальный сектор
-    while(1) {
-        // узнаем номер следующего сектора
-        unsigned long old_next_sector = next_sector;
-        fvs_file.seekg(next_pos + xvfs_header.sector_size - sizeof(unsigned long), std::ios::beg);
-        fvs_file.read(reinterpret_cast<char *>(&next_sector),sizeof(unsigned long));
 
-        if((!is_first_sector && old_next_sector != start_sector) || (is_first_sector)) {
-            // добавляем сектора в массив пустых секторов
-            // если файл перезаписывается, первый сектор не добавляется
-            auto it = std::lower_bound(xvfs_header.empty_sectors.begin(), xvfs_header.empty_sectors.end(), old_next_sector);
-            xvfs_header.empty_sectors.insert(it, old_next_sector);
-            //std::cout << "clear sector " << old_next_sector << std::endl;
+    char* data = _data;
+    unsigned long len = _len;
+    if(compression_type != NO_COMPRESSION) {
+        // уровень сжатия zstd, если файл сжимается со словарем
+        int dictionary_level = 3;
+#       if defined(XFVS_USE_ZSTD)
+        // небольшие файлы сжимаются с общим словарем zstd
+        if(is_zstd_compression(compression_type) && _len <= max_dictionary_file_size &&
+            !is_dictionary_hash(hash_vfs_file) && load_zstd_dictionary()) {
+            dictionary_level = compression_type - 300;
+            compression_type = USE_ZSTD_DICTIONARY;
         }
-
-        //std::cout << "clear sector " << old_next_sector << std::endl;
-        if(next_sector == 0xFFFFFFFF) {
-            break;
+#       endif
+        if(is_adaptive_compression && !is_compressible(_data, _len, compression_type, dictionary_level)) {
+            compression_type = NO_COMPRESSION;
+        } else {
+            const auto start_time = std::chrono::steady_clock::now();
+            // большие файлы сжимаются независимыми частями
+            const bool is_chunked = _len > compression_chunk_size;
+            if(is_chunked) {
+                if(!compress_chunks(_data, _len, data, len, compression_type)) return false;
+            } else {
+                if(!compress_data(_data, _len, data, len, compression_type, NULL, dictionary_level)) return false;
+            }
+            if(is_adaptive_compression && compression_type == adaptive_compression_type) {
+                update_compression_speed(_len, std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count());
+            }
+            // данные, которые сжались плохо или не сжались совсем, пишутся без сжатия
+            const double min_ratio = is_adaptive_compression ? min_compression_ratio : 1.0;
+            if(len >= _len || (double)_len < min_ratio * len) {
+                delete[] data;
+                data = _data;
+                len = _len;
+                compression_type = NO_COMPRESSION;
+            } else
+            if(is_chunked) {
+                compression_type |= CHUNKED_COMPRESSION;
+            }
         }
-        fvs_file.seekg(next_pos + xvfs_header.sector_size - sizeof(unsigned long), std::ios::beg);
-        unsigned long END_SECTOR = 0xFFFFFFFF;
-        fvs_file.clear();
-        fvs_file.write(reinterpret_cast<char *>(&END_SECTOR),sizeof(unsigned long));
-        next_pos = next_sector * xvfs_header.sector_size;
     }
-    return true;
+    // файл всегда пишется в новые сектора, поэтому при ошибке записи прежние данные остаются целыми
+    std::vector<_xvfs_extent> extents;
+    allocate_sectors(get_sectors(len), 0xFFFFFFFF, extents);
+    // пишем файл
+    if(write_data(extents, data, len) < 0) {
+        // освобождаем только что выделенные сектора, индекс по-прежнему указывает на старые
+        clear_data(extents);
+        if(data != _data) delete[] data;
+        return false;
+    }
+    file_header = _xvfs_file_header(hash_vfs_file, len, extents[0].start_sector, _len, compression_type);
+    if(data != _data) delete[] data;
+    if(!set_file(file_header, extents)) {
+        clear_data(extents);
+        return false;
+    }
+    // прежние сектора освобождаем после того, как индекс указывает на новые,
+    // в пакете изменений - только при сохранении пакета
+    if(is_file) release_extents(file_extents);
+    // сохраняем изменение в журнал
+    return save_file_header(file_header, extents);
 }
 
-unsigned long xvfs::get_last_new_sector() {
-    fvs_file.seekg(0, std::ios::end);
-    unsigned long _size = fvs_file.tellg();
-    unsigned long last_sector = _size / xvfs_header.sector_size;
-    return last_sector;
+bool xvfs::write_file(std::string vfs_file_name, char* data, unsigned long len) {
+    if(!is_open_file) return false;
+    long long hash_vfs_file = calculate_crc64(vfs_file_name);
+    return write_file(hash_vfs_file, data, len);
 }
 
-bool xvfs::write_file(long long hash_vfs_file, char* _data, unsigned long _len) {
+bool xvfs::write_file(std::string vfs_file_name, char* data, unsigned long len, long compression_type) {
     if(!is_open_file) return false;
-    long pos = binary_search_first(xvfs_header.files, hash_vfs_file, 0, xvfs_header.files.size() - 1);
+    long long hash_vfs_file = calculate_crc64(vfs_file_name);
+    return write_file(hash_vfs_file, data, len, compression_type);
+}
 
-    if(pos == -1 && _len == 0) { // если файл пустой, просто сохраним данные в заголовке
-        // добавим файл в заголовок
-        _xvfs_file_header i_file_header(hash_vfs_file, 0, 0xFFFFFFFF, 0);
+long xvfs::get_len_file(long long hash_vfs_file) {
+    _xvfs_lock lock(this, false);
+    if(!is_open_file) return ERROR_VFS_FILE_NOT_OPEN;
+    if(lock.is_error()) return ERROR_VFS_READING_FILE;
+    _xvfs_file_header file_header;
+    if(is_dictionary_hash(hash_vfs_file) || !find_file(hash_vfs_file, file_header, NULL)) {
+        return ERROR_VIRTUAL_FILE_NOT_FOUND;
+    }
+    return file_header.size;
+}
 
-        if(xvfs_header.files.size() > 0) {
-            auto it = std::lower_bound(xvfs_header.files.begin(), xvfs_header.files.end(), i_file_header);
-            xvfs_header.files.insert(it, i_file_header);
-        } else {
-            xvfs_header.files.push_back(i_file_header);
-        } // if
-        // сохраняем заголовок
-        return save_header();
+long xvfs::get_len_file(std::string vfs_file_name) {
+    if(!is_open_file) return ERROR_VFS_FILE_NOT_OPEN;
+    long long hash_vfs_file = calculate_crc64(vfs_file_name);
+    return get_len_file(hash_vfs_file);
+}
+
+long xvfs::decompress_chunk(const char* raw_data, unsigned long raw_size, char* data, unsigned long real_size, long compression_type, _xvfs_codec_context* context) {
+    // часть, которая не сжалась, хранится как есть
+    if(raw_size == real_size) {
+        std::memcpy(data, raw_data, real_size);
+        return real_size;
     }
+    long len = decompress_data(raw_data, raw_size, data, real_size, compression_type, context);
+    if(len >= 0 && (unsigned long)len != real_size) return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+    return len;
+}
 
-    unsigned long start_sector;
-#   if defined(XFVS_USE_ZLIB) || defined(XFVS_USE_MINLIZO) || defined(XFVS_USE_LZ4)
-    unsigned long len;
-    char* data = NULL;
-    if(xvfs_header.compression_type == NO_COMPRESSION) {
-        data = _data;
-        len = _len;
-    } else
+long xvfs::decompress_data(const char* raw_data, unsigned long raw_size, char* data, unsigned long real_size, long compression_type, _xvfs_codec_context* context) {
+    if(context == NULL) context = get_codec_context();
+    if(compression_type & CHUNKED_COMPRESSION) {
+        const unsigned long header_size = 2 * sizeof(unsigned long);
+        if(raw_size < header_size) return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+        const unsigned long chunk_size = ((const unsigned long*)raw_data)[0];
+        const unsigned long chunks = ((const unsigned long*)raw_data)[1];
+        if(chunk_size == 0 || chunks != (real_size + chunk_size - 1) / chunk_size ||
+            chunks > (raw_size - header_size) / sizeof(unsigned long)) return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+        // части сжимаются только без словаря, поэтому их можно распаковывать параллельно
+        const long chunk_compression_type = compression_type & ~CHUNKED_COMPRESSION;
+        if(chunk_compression_type == USE_ZSTD_DICTIONARY) return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+        const unsigned long* ends = (const unsigned long*)(raw_data + header_size);
+        const char* chunks_data = raw_data + header_size + chunks * sizeof(unsigned long);
+        const unsigned long chunks_size = raw_size - header_size - chunks * sizeof(unsigned long);
+        for(unsigned long i = 0; i < chunks; ++i) {
+            if(ends[i] < (i > 0 ? ends[i - 1] : 0) || ends[i] > chunks_size) return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+        }
+        std::vector<long> lens(chunks, 0);
+        run_compression_tasks(chunks, [&](unsigned long i, _xvfs_codec_context* task_context) {
+            const unsigned long start = i > 0 ? ends[i - 1] : 0;
+            const unsigned long chunk_real_size = std::min(chunk_size, real_size - i * chunk_size);
+            lens[i] = decompress_chunk(chunks_data + start, ends[i] - start, data + i * chunk_size, chunk_real_size, chunk_compression_type, task_context);
+        });
+        for(unsigned long i = 0; i < chunks; ++i) {
+            if(lens[i] < 0) return lens[i];
+        }
+        return real_size;
+    }
 #   if defined(XFVS_USE_ZLIB)
-    if(xvfs_header.compression_type <= USE_ZLIB_LEVEL_9) {
-        len = _len + 0.01 *_len + 12;
-        data = new char[len];
-        if(compress2((unsigned char*)data, &len, (const unsigned char*)_data, _len, xvfs_header.compression_type) != Z_OK) {
-            delete[] data;
-            return false;
+    if(compression_type >= USE_ZLIB_LEVEL_1 && compression_type <= USE_ZLIB_LEVEL_9) {
+        z_stream& stream = context->zlib_inflate;
+        if(!context->is_zlib_inflate) {
+            std::memset(&stream, 0, sizeof(stream));
+            if(inflateInit(&stream) != Z_OK) return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+            context->is_zlib_inflate = true;
+        } else {
+            if(inflateReset(&stream) != Z_OK) return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+        }
+        if(raw_size > 0xFFFFFFFFUL || real_size > 0xFFFFFFFFUL) return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+        stream.next_in = (Bytef*)raw_data;
+        stream.avail_in = raw_size;
+        stream.next_out = (Bytef*)data;
+        stream.avail_out = real_size;
+        int err_uncompress = inflate(&stream, Z_FINISH);
+        if(err_uncompress != Z_STREAM_END) {
+            //std::cout << "err uncompress " << err_uncompress << std::endl;
+            return ERROR_VIRTUAL_FILE_DECOMPRESSION;
         }
-        //std::cout << "compress2 " << len << " old size " << _len << " type " << xvfs_header.compression_type << std::endl;
+        return stream.total_out;
     } else
 #   endif
 #   if defined(XFVS_USE_MINLIZO)
-    if(xvfs_header.compression_type == USE_MINLIZO) {
-        len = _len + _len / 16 + 64 + 3;
-        data = new char[len];
-        unsigned long long lzo_len = len;
-        int r = lzo1x_1_compress((const unsigned char*)_data, _len, (unsigned char*)data, &lzo_len, wrkmem);
-        len = lzo_len;
-        if(r != LZO_E_OK) {
-            delete[] data;
-            return false;
+    if(compression_type == USE_MINLIZO) {
+        lzo_uint data_size = real_size;
+        int r = lzo1x_decompress((const unsigned char*)raw_data, raw_size, (unsigned char*)data, &data_size, NULL);
+        if(r != LZO_E_OK || data_size != real_size) {
+            //std::cout << "r != LZO_E_OK || data_size != real_size " << std::endl;
+            return ERROR_VIRTUAL_FILE_DECOMPRESSION;
         }
+        return data_size;
     } else
 #   endif
 #   if defined(XFVS_USE_LZ4)
-    if(xvfs_header.compression_type == USE_LZ4) {
-        len = LZ4_compressBound(_len);
-        //std::cout << "lz4 len " << len << std::endl;
-        data = new char[len];
-        int compressed_data_size = LZ4_compress_default(_data, data, _len, len);
-        if(compressed_data_size <= 0) {
-            //std::cout << "compressed_data_size " << compressed_data_size << std::endl;
-            delete[] data;
-            return false;
+    if(compression_type == USE_LZ4) {
+        const int decompressed_size = LZ4_decompress_safe(raw_data, data, raw_size, real_size);
+        if(decompressed_size <= 0) {
+            //std::cout << "decompressed_size " << decompressed_size << std::endl;
+            return ERROR_VIRTUAL_FILE_DECOMPRESSION;
         }
-        len = compressed_data_size;
+        return real_size;
     } else
 #   endif
-    {
-        return false;
-    }
-#   else
-    char* data = _data;
-    unsigned long& len = _len;
-#   endif
-    if(pos == -1) { // если файла нет
-        if(xvfs_header.empty_sectors.size() > 0) { // если есть пустые сектора
-            start_sector = xvfs_header.empty_sectors[0];
-            xvfs_header.empty_sectors.erase(xvfs_header.empty_sectors.begin());
-        } else { // если пустых секторов нет
-            start_sector = get_last_new_sector(); // последний новый сектор
-        }
-        // пишем файл
-        if(write_data(start_sector, data, len) < 0) {
-#           if defined(XFVS_USE_ZLIB) || defined(XFVS_USE_MINLIZO) || defined(XFVS_USE_LZ4)
-            if(xvfs_header.compression_type != NO_COMPRESSION) delete[] data;
-#           endif
-            return false;
+#   if defined(XFVS_USE_ZSTD)
+    if(is_zstd_compression(compression_type)) {
+        if(context->zstd_dctx == NULL) context->zstd_dctx = ZSTD_createDCtx();
+        if(context->zstd_dctx == NULL) return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+        const size_t data_size = ZSTD_decompressDCtx(context->zstd_dctx, data, real_size, raw_data, raw_size);
+        if(ZSTD_isError(data_size) || data_size != real_size) {
+            return ERROR_VIRTUAL_FILE_DECOMPRESSION;
         }
-        // добавим файл в заголовок
-        _xvfs_file_header i_file_header(hash_vfs_file, len, start_sector, _len);
-
-        if(xvfs_header.files.size() > 0) {
-            auto it = std::lower_bound(xvfs_header.files.begin(), xvfs_header.files.end(), i_file_header);
-            xvfs_header.files.insert(it, i_file_header);
-        } else {
-            xvfs_header.files.push_back(i_file_header);
-        } //
-    } else { // если файл уже существует
-        start_sector = xvfs_header.files[pos].start_sector;
-        if(std::ceil((double)len / (double)xvfs_header.sector_size) != std::ceil((double)xvfs_header.files[pos].size / (double)xvfs_header.sector_size)) { // если длина файла не совпадает
-            // очистим данные
-            if(!clear_data(start_sector, false)) {
-#               if defined(XFVS_USE_ZLIB) || defined(XFVS_USE_MINLIZO) || defined(XFVS_USE_LZ4)
-                if(xvfs_header.compression_type != NO_COMPRESSION) delete[] data;
-#               endif
-                return false;
-            }
-            if(write_data(start_sector, data, len) < 0) {
-#               if defined(XFVS_USE_ZLIB) || defined(XFVS_USE_MINLIZO) || defined(XFVS_USE_LZ4)
-                if(xvfs_header.compression_type != NO_COMPRESSION) delete[] data;
-#               endif
-                return false;
-            }
-        } else { // если длина файла совпадает
-            // запишем данные туда же
-            if(write_data(start_sector, data, len) < 0) {
-#               if defined(XFVS_USE_ZLIB) || defined(XFVS_USE_MINLIZO) || defined(XFVS_USE_LZ4)
-                if(xvfs_header.compression_type != NO_COMPRESSION) delete[] data;
-#               endif
-                return false;
-            }
-        } //
-        xvfs_header.files[pos] = _xvfs_file_header(hash_vfs_file, len, start_sector, _len);
-    } //
-#   if defined(XFVS_USE_ZLIB) || defined(XFVS_USE_MINLIZO) || defined(XFVS_USE_LZ4)
-    if(xvfs_header.compression_type != NO_COMPRESSION) delete[] data;
+        return data_size;
+    } else
+    if(compression_type == USE_ZSTD_DICTIONARY) {
+        // id словаря записан в заголовке сжатых данных
+        ZSTD_DDict* ddict = get_zstd_ddict(ZSTD_getDictID_fromFrame(raw_data, raw_size));
+        if(context->zstd_dctx == NULL) context->zstd_dctx = ZSTD_createDCtx();
+        if(ddict == NULL || context->zstd_dctx == NULL) return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+        const size_t data_size = ZSTD_decompress_usingDDict(context->zstd_dctx, data, real_size, raw_data, raw_size, ddict);
+        if(ZSTD_isError(data_size) || data_size != real_size) {
+            return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+        }
+        return data_size;
+    } else
 #   endif
-    // сохраняем заголовок
-    return save_header();
+    {
+#       if !(defined(XFVS_USE_ZLIB) || defined(XFVS_USE_MINLIZO) || defined(XFVS_USE_LZ4) || defined(XFVS_USE_ZSTD))
+        // без библиотек сжатия распаковывать нечем
+        (void)raw_data;
+        (void)raw_size;
+        (void)data;
+        (void)real_size;
+        (void)compression_type;
+#       endif
+        return ERROR_UNKNOWN_DECOMPRESSION_METHOD;
+    }
 }
 
-bool xvfs::write_file(std::string vfs_file_name, char* data, unsigned long len) {
-    if(!is_open_file) return false;
-    long long hash_vfs_file = calculate_crc64(vfs_file_name);
-    return write_file(hash_vfs_file, data, len);
+long xvfs::read_file(long long hash_vfs_file, char*& data) {
+    // словари zstd читаются только при сжатии и декомпрессии
+    if(is_dictionary_hash(hash_vfs_file)) return ERROR_VIRTUAL_FILE_NOT_FOUND;
+    return read_vfs_file(hash_vfs_file, data);
 }
 
-long xvfs::get_len_file(long long hash_vfs_file) {
+long xvfs::read_vfs_file(long long hash_vfs_file, char*& data) {
+    _xvfs_lock lock(this, false);
     if(!is_open_file) return ERROR_VFS_FILE_NOT_OPEN;
-    long pos = binary_search_first(xvfs_header.files, hash_vfs_file, 0, xvfs_header.files.size() - 1);
-    if(pos == -1) {
+    if(lock.is_error()) return ERROR_VFS_READING_FILE;
+    _xvfs_file_header file_header;
+    std::vector<_xvfs_extent> extents;
+    if(!find_file(hash_vfs_file, file_header, &extents)) {
         return ERROR_VIRTUAL_FILE_NOT_FOUND;
     }
-    return xvfs_header.files[pos].size;
+    if(file_header.real_size == 0) {
+        data = NULL;
+        return 0;
+    }
+    const unsigned long size = file_header.size;
+    const unsigned long real_size = file_header.real_size;
+    bool is_biffer_init = false;
+    if(data == NULL) {
+        data = new char[real_size];
+        is_biffer_init = true;
+    }
+    long len = 0;
+    if(file_header.compression_type == NO_COMPRESSION) {
+        len = read_data(extents, data, size);
+    } else {
+        // читаем сырые данные
+        char* raw_data = new char[size];
+        len = read_data(extents, raw_data, size);
+        // декомпрессия сырых данных
+        if(len >= 0) len = decompress_data(raw_data, size, data, real_size, file_header.compression_type);
+        delete[] raw_data;
+    }
+    if(len < 0 && is_biffer_init) {
+        delete[] data;
+        data = NULL;
+    }
+    return len;
 }
 
-long xvfs::get_len_file(std::string vfs_file_name) {
+long xvfs::read_file(std::string vfs_file_name, char*& data) {
     if(!is_open_file) return ERROR_VFS_FILE_NOT_OPEN;
     long long hash_vfs_file = calculate_crc64(vfs_file_name);
-    return get_len_file(hash_vfs_file);
+    return read_file(hash_vfs_file, data);
 }
 
-long xvfs::read_file(long long hash_vfs_file, char*& data) {
+long xvfs::read_range(long long hash_vfs_file, unsigned long offset, unsigned long length, char* data) {
+    _xvfs_lock lock(this, false);
     if(!is_open_file) return ERROR_VFS_FILE_NOT_OPEN;
-    long pos = binary_search_first(xvfs_header.files, hash_vfs_file, 0, xvfs_header.files.size() - 1);
-    if(pos == -1) {
+    if(lock.is_error()) return ERROR_VFS_READING_FILE;
+    _xvfs_file_header file_header;
+    std::vector<_xvfs_extent> extents;
+    if(is_dictionary_hash(hash_vfs_file) || !find_file(hash_vfs_file, file_header, &extents)) {
         return ERROR_VIRTUAL_FILE_NOT_FOUND;
-    } else {
-        if(xvfs_header.files[pos].real_size == 0) {
-            data = NULL;
-            return 0;
+    }
+    if(offset >= file_header.real_size) return 0;
+    length = std::min(length, file_header.real_size - offset);
+    if(length == 0) return 0;
+    if(file_header.compression_type == NO_COMPRESSION) {
+        return read_data(extents, data, length, offset);
+    }
+    if(!(file_header.compression_type & CHUNKED_COMPRESSION)) {
+        // файл сжат целиком, распаковываем его полностью
+        char* file_data = NULL;
+        long len = read_file(hash_vfs_file, file_data);
+        if(len >= 0) {
+            std::memcpy(data, file_data + offset, length);
+            len = length;
         }
-#       if !(defined(XFVS_USE_ZLIB) || defined(XFVS_USE_MINLIZO) || defined(XFVS_USE_LZ4))
-        bool is_biffer_init = false;
-        if(data == NULL) {
-            data = new char[xvfs_header.files[pos].size];
-            is_biffer_init = true;
+        if(file_data != NULL) delete[] file_data;
+        return len;
+    }
+    // читаем заголовок и концы только тех частей, в которые попадает диапазон
+    const unsigned long header_size = 2 * sizeof(unsigned long);
+    unsigned long header[2];
+    if(read_data(extents, reinterpret_cast<char *>(header), header_size) < 0) return ERROR_VFS_READING_FILE;
+    const unsigned long chunk_size = header[0];
+    const unsigned long chunks = header[1];
+    if(chunk_size == 0 || chunks != (file_header.real_size + chunk_size - 1) / chunk_size) return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+    const unsigned long first_chunk = offset / chunk_size;
+    const unsigned long last_chunk = (offset + length - 1) / chunk_size;
+    // ends[0] - начало первой части диапазона
+    std::vector<unsigned long> ends(last_chunk - first_chunk + 2, 0);
+    if(first_chunk > 0) {
+        if(read_data(extents, reinterpret_cast<char *>(&ends[0]), ends.size() * sizeof(unsigned long), header_size + (first_chunk - 1) * sizeof(unsigned long)) < 0) return ERROR_VFS_READING_FILE;
+    } else {
+        if(read_data(extents, reinterpret_cast<char *>(&ends[1]), (ends.size() - 1) * sizeof(unsigned long), header_size) < 0) return ERROR_VFS_READING_FILE;
+    }
+    const unsigned long chunks_offset = header_size + chunks * sizeof(unsigned long);
+    for(size_t i = 1; i < ends.size(); ++i) {
+        if(ends[i] < ends[i - 1] || chunks_offset + ends[i] > file_header.size) return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+    }
+    std::vector<char> raw_data(std::max(ends.back() - ends[0], 1UL));
+    if(read_data(extents, &raw_data[0], ends.back() - ends[0], chunks_offset + ends[0]) < 0) return ERROR_VFS_READING_FILE;
+    std::vector<char> chunk_data(chunk_size);
+    const long compression_type = file_header.compression_type & ~CHUNKED_COMPRESSION;
+    for(unsigned long i = first_chunk; i <= last_chunk; ++i) {
+        const unsigned long chunk_start = i * chunk_size;
+        const unsigned long chunk_real_size = std::min(chunk_size, file_header.real_size - chunk_start);
+        const size_t pos = i - first_chunk;
+        long len = decompress_chunk(&raw_data[ends[pos] - ends[0]], ends[pos + 1] - ends[pos], &chunk_data[0], chunk_real_size, compression_type);
+        if(len < 0) return len;
+        // копируем пересечение части с диапазоном
+        const unsigned long from = std::max(offset, chunk_start);
+        const unsigned long to = std::min(offset + length, chunk_start + chunk_real_size);
+        std::memcpy(data + (from - offset), &chunk_data[from - chunk_start], to - from);
+    }
+    return length;
+}
+
+long xvfs::read_range(std::string vfs_file_name, unsigned long offset, unsigned long length, char* data) {
+    if(!is_open_file) return ERROR_VFS_FILE_NOT_OPEN;
+    long long hash_vfs_file = calculate_crc64(vfs_file_name);
+    return read_range(hash_vfs_file, offset, length, data);
+}
+
+long xvfs::read_files(const std::vector<long long>& hash_vfs_files, std::vector<char*>& data, std::vector<long>& lens) {
+    _xvfs_lock lock(this, false);
+    if(!is_open_file) return ERROR_VFS_FILE_NOT_OPEN;
+    if(lock.is_error()) return ERROR_VFS_READING_FILE;
+    const size_t files_count = hash_vfs_files.size();
+    data.resize(files_count, NULL);
+    lens.assign(files_count, 0);
+    long count = 0;
+    if(storage_type != USE_PREAD_STORAGE) {
+        // из отображения сектора и так копируются напрямую, а fstream не умеет читать несколько участков сразу
+        for(size_t i = 0; i < files_count; ++i) {
+            lens[i] = read_file(hash_vfs_files[i], data[i]);
+            if(lens[i] >= 0) ++count;
         }
-        long errData = (read_data(xvfs_header.files[pos].start_sector, data, xvfs_header.files[pos].size);
-        if(errData < 0) {
-            if(is_biffer_init) {
-                delete[] data;
-                data = NULL;
-            }
-            return errData;
-        }
-#       else
-        if(xvfs_header.compression_type == NO_COMPRESSION) {
-            bool is_biffer_init = false;
-            if(data == NULL) {
-                data = new char[xvfs_header.files[pos].size];
-                is_biffer_init = true;
-            }
-            long errData = read_data(xvfs_header.files[pos].start_sector, data, xvfs_header.files[pos].size);
-            if(errData < 0) {
-                if(is_biffer_init) {
-                    delete[] data;
-                    data = NULL;
-                }
-                return errData;
+        return count;
+    }
+    const unsigned long sector_size = xvfs_header.sector_size;
+    const unsigned long sector_data_size = sector_size - sizeof(unsigned long);
+    // один запрос читает не больше max_read_size, сектора одной пачки занимают не больше max_batch_size
+    const unsigned long max_read_size = 1024 * 1024;
+    const unsigned long long max_batch_size = 64 * 1024 * 1024;
+    const unsigned long max_read_sectors = std::max(max_read_size / sector_size, 1UL);
+
+    std::vector<_xvfs_file_header> files_headers(files_count);
+    std::vector<char*> files_sectors(files_count, NULL);
+    std::vector<_xvfs_extent> extents;
+    std::vector<_xvfs_read_request> requests;
+    std::vector<size_t> files_requests(files_count, 0); // первый запрос файла, запросы файла идут подряд
+    size_t first = 0;
+    while(first < files_count) {
+        // собираем сектора файлов пачки
+        requests.clear();
+        unsigned long long batch_size = 0;
+        size_t last = first;
+        for(; last < files_count && batch_size < max_batch_size; ++last) {
+            _xvfs_file_header& file_header = files_headers[last];
+            if(is_dictionary_hash(hash_vfs_files[last]) || !find_file(hash_vfs_files[last], file_header, &extents)) {
+                lens[last] = ERROR_VIRTUAL_FILE_NOT_FOUND;
+                continue;
             }
-        } else
-#       if defined(XFVS_USE_ZLIB)
-        if(xvfs_header.compression_type <= USE_ZLIB_LEVEL_9) {
-            bool is_biffer_init = false;
-            unsigned long real_size = xvfs_header.files[pos].real_size;
-            char* raw_data = new char[xvfs_header.files[pos].size];
-            if(data == NULL) {
-                data = new char[real_size];
-                is_biffer_init = true;
-            }
-            // читаем сырые данные
-            long errData = read_data(xvfs_header.files[pos].start_sector, raw_data, xvfs_header.files[pos].size);
-            if(errData < 0) {
-                if(is_biffer_init) {
-                    delete[] data;
-                    data = NULL;
+            if(file_header.real_size == 0) {
+                data[last] = NULL;
+                lens[last] = 0;
+                ++count;
+                continue;
+            }
+            const unsigned long sectors = get_sectors(file_header.size);
+            unsigned long extents_sectors = 0;
+            for(size_t i = 0; i < extents.size(); ++i) {
+                extents_sectors += extents[i].sectors;
+            }
+            if(extents_sectors < sectors) {
+                lens[last] = ERROR_VFS_READING_FILE;
+                continue;
+            }
+            char* buf = new char[(size_t)sectors * sector_size];
+            files_requests[last] = requests.size();
+            files_sectors[last] = buf;
+            batch_size += (unsigned long long)sectors * sector_size;
+            // читаем только те сектора, в которых есть данные
+            unsigned long len = 0;
+            for(size_t i = 0; i < extents.size() && len < sectors; ++i) {
+                unsigned long sector = extents[i].start_sector;
+                unsigned long n = std::min(extents[i].sectors, sectors - len);
+                while(n > 0) {
+                    unsigned long read_sectors = std::min(n, max_read_sectors);
+                    requests.push_back(_xvfs_read_request((unsigned long long)sector * sector_size, buf + (size_t)len * sector_size, read_sectors * sector_size));
+                    sector += read_sectors;
+                    len += read_sectors;
+                    n -= read_sectors;
                 }
-                delete[] raw_data;
-                //std::cout << "err read_data" << std::endl;
-                return errData;
             }
-            // декомпрессия сырых данных
-            int err_uncompress = uncompress((unsigned char*)data, &real_size, (unsigned char*)raw_data, xvfs_header.files[pos].size);
+        }
 
-            if(err_uncompress != Z_OK) {
-                if(is_biffer_init) {
-                    delete[] data;
-                    data = NULL;
+        read_storage_batch(requests);
+
+        // собираем данные из секторов и делаем декомпрессию
+        for(size_t j = first; j < last; ++j) {
+            char* buf = files_sectors[j];
+            if(buf == NULL) continue;
+            files_sectors[j] = NULL;
+            // файл прочитан, если прочитаны все его участки
+            bool is_file_read = true;
+            size_t end_request = requests.size();
+            for(size_t k = j + 1; k < last; ++k) {
+                if(files_sectors[k] != NULL) {
+                    end_request = files_requests[k];
+                    break;
                 }
-                delete[] raw_data;
-                std::cout << "err uncompress " << err_uncompress << std::endl;
-                return ERROR_VIRTUAL_FILE_DECOMPRESSION;
             }
-            delete[] raw_data;
-            //std::cout << "real_size " << real_size << " xvfs_header real_size " << xvfs_header.files[pos].real_size << std::endl;
-            return real_size;
-        } else
-#       endif
-#       if defined(XFVS_USE_MINLIZO)
-        if(xvfs_header.compression_type == USE_MINLIZO) {
-            bool is_biffer_init = false;
-            unsigned long long real_size = xvfs_header.files[pos].real_size;
-            char* raw_data = new char[xvfs_header.files[pos].size];
-            if(data == NULL) {
-                data = new char[real_size];
-                is_biffer_init = true;
-            }
-            // читаем сырые данные
-            long errData = read_data(xvfs_header.files[pos].start_sector, raw_data, xvfs_header.files[pos].size);
-            if(errData < 0) {
-                if(is_biffer_init) {
-                    delete[] data;
-                    data = NULL;
-                }
-                delete[] raw_data;
-                //std::cout << "err read_data" << std::endl;
-                return errData;
-            }
-            // декомпрессия сырых данных
-            int r = lzo1x_decompress((unsigned char*)raw_data, xvfs_header.files[pos].size,(unsigned char*)data, &real_size, NULL);
-            if(r != LZO_E_OK || real_size != xvfs_header.files[pos].real_size) {
-                if(is_biffer_init) {
-                    delete[] data;
-                    data = NULL;
-                }
-                delete[] raw_data;
-                //std::cout << "r != LZO_E_OK || real_size != xvfs_header.files[pos].real_size " << std::endl;
-                return ERROR_VIRTUAL_FILE_DECOMPRESSION;
+            for(size_t k = files_requests[j]; k < end_request; ++k) {
+                if(!requests[k].is_read) is_file_read = false;
             }
-            delete[] raw_data;
-            //std::cout << "real_size " << real_size << " xvfs_header real_size " << xvfs_header.files[pos].real_size << std::endl;
-            return real_size;
-        } else
-#       endif
-#       if defined(XFVS_USE_LZ4)
-        if(xvfs_header.compression_type == USE_LZ4) {
-            bool is_biffer_init = false;
-            unsigned long real_size = xvfs_header.files[pos].real_size;
-            char* raw_data = new char[xvfs_header.files[pos].size];
-            if(data == NULL) {
-                data = new char[real_size];
-                is_biffer_init = true;
-            }
-            // читаем сырые данные
-            long errData = read_data(xvfs_header.files[pos].start_sector, raw_data, xvfs_header.files[pos].size);
-            if(errData < 0) {
-                if(is_biffer_init) {
-                    delete[] data;
-                    data = NULL;
-                }
-                delete[] raw_data;
-                return errData;
+            if(!is_file_read) {
+                delete[] buf;
+                lens[j] = ERROR_VFS_READING_FILE;
+                continue;
             }
-            // декомпрессия сырых данных
-            const int decompressed_size = LZ4_decompress_safe(raw_data, data, xvfs_header.files[pos].size, real_size);
-
-            if(decompressed_size <= 0) {
-                if(is_biffer_init) {
-                    delete[] data;
-                    data = NULL;
+            const unsigned long size = files_headers[j].size;
+            const unsigned long real_size = files_headers[j].real_size;
+            // убираем ссылки на сектора, данные сдвигаются только к началу буфера
+            unsigned long len = 0;
+            for(unsigned long k = 0; len < size; ++k) {
+                unsigned long part = std::min(sector_data_size, size - len);
+                std::memmove(buf + len, buf + (size_t)k * sector_size, part);
+                len += part;
+            }
+            if(files_headers[j].compression_type == NO_COMPRESSION) {
+                if(data[j] == NULL) {
+                    data[j] = buf;
+                } else {
+                    std::memcpy(data[j], buf, size);
+                    delete[] buf;
+                }
+                lens[j] = size;
+            } else {
+                bool is_biffer_init = false;
+                if(data[j] == NULL) {
+                    data[j] = new char[real_size];
+                    is_biffer_init = true;
+                }
+                lens[j] = decompress_data(buf, size, data[j], real_size, files_headers[j].compression_type);
+                delete[] buf;
+                if(lens[j] < 0 && is_biffer_init) {
+                    delete[] data[j];
+                    data[j] = NULL;
                 }
-                delete[] raw_data;
-                std::cout << "decompressed_size " << decompressed_size << std::endl;
-                return ERROR_VIRTUAL_FILE_DECOMPRESSION;
             }
-            delete[] raw_data;
-            //std::cout << "real_size " << real_size << " xvfs_header real_size " << xvfs_header.files[pos].real_size << std::endl;
-            return real_size;
-        } else
-#       endif
-        {
-            data = NULL;
-            return ERROR_UNKNOWN_DECOMPRESSION_METHOD;
+            if(lens[j] >= 0) ++count;
         }
-#       endif
+        first = last;
     }
-    return xvfs_header.files[pos].real_size;
+    return count;
 }
 
-long xvfs::read_file(std::string vfs_file_name, char*& data) {
+long xvfs::read_files(const std::vector<std::string>& vfs_file_names, std::vector<char*>& data, std::vector<long>& lens) {
     if(!is_open_file) return ERROR_VFS_FILE_NOT_OPEN;
-    long long hash_vfs_file = calculate_crc64(vfs_file_name);
-    return read_file(hash_vfs_file, data);
+    std::vector<long long> hash_vfs_files(vfs_file_names.size());
+    for(size_t i = 0; i < vfs_file_names.size(); ++i) {
+        hash_vfs_files[i] = calculate_crc64(vfs_file_names[i]);
+    }
+    return read_files(hash_vfs_files, data, lens);
 }
 
 bool xvfs::delete_file(std::string vfs_file_name) {
@@ -707,19 +3524,24 @@ bool xvfs::delete_file(std::string vfs_file_name) {
 }
 
 bool xvfs::delete_file(long long hash_vfs_file) {
-    if(!is_open_file) return false;
-    long pos = binary_search_first(xvfs_header.files, hash_vfs_file, 0, xvfs_header.files.size() - 1);
-    if(pos == -1) {
+    _xvfs_lock lock(this, true);
+    if(!is_open_file || lock.is_error()) return false;
+    _xvfs_file_header file_header;
+    std::vector<_xvfs_extent> extents;
+    // словари zstd нужны для чтения сжатых ими файлов
+    if(is_dictionary_hash(hash_vfs_file) || !find_file(hash_vfs_file, file_header, &extents)) {
         return false;
     }
-    if(!clear_data(xvfs_header.files[pos].start_sector, true)) return false;
-    xvfs_header.files.erase(xvfs_header.files.begin() + pos);
-    // сохраняем заголовок
-    return save_header();
+    if(!erase_file(hash_vfs_file)) return false;
+    update_snapshot(hash_vfs_file, std::vector<_xvfs_index_entry>());
+    release_extents(extents);
+    // сохраняем изменение в журнал
+    return save_file_deletion(hash_vfs_file);
 }
 
 void xvfs::generate_table() {
-    if(!is_svfs_crc64_table) {
+    // таблица общая для всех VFS, которые могут создаваться одновременно в разных потоках
+    std::call_once(xvfs_crc64_table_flag, [this]() {
         for(int i = 0; i < 256; ++i) {
             long long crc = i;
             for(int j=0; j<8; ++j) {
@@ -732,8 +3554,7 @@ void xvfs::generate_table() {
             }
             xvfs_crc64_table[i] = crc;
         }
-        is_svfs_crc64_table = true;
-    }
+    });
 }
 
 long long xvfs::calculate_crc64(long long crc, const unsigned char* stream, int n) {
@@ -750,56 +3571,79 @@ long long xvfs::calculate_crc64(std::string vfs_file_name) {
     return calculate_crc64(0, (const unsigned char*)vfs_file_name.c_str(), vfs_file_name.size());
 }
 
-long xvfs::binary_search_first(std::vector<_xvfs_file_header> arr, long long key, long left, long right) {
-    if(arr.size() == 1) {
-        if(arr[0].hash == key) return 0;
-        return -1;
-    }
-    long midd = 0;
-    while (true) {
-        if(left > right)
-            return -1;
-
-        midd = (left + right) / 2;
-
-        if(arr[midd].hash == key && (midd == 0 || arr[midd - 1].hash != key) ){
-            return midd;
-        } else if(arr[midd].hash == key) {
-            right = midd - 1;
-        } else if(arr[midd].hash > key) {
-            right = midd - 1;
-        } else {
-            left = midd + 1;
-        }
-    }
-    return -1;
-}
-
 
 void xvfs::init_xvfs_header(int sector_size, int compression_type) {
     xvfs_header.sector_size = sector_size;
     xvfs_header.compression_type = compression_type;
-    xvfs_header.files.resize(0);
-    xvfs_header.empty_sectors.resize(0);
+    free_index_page(index_root);
+    index_root = NULL;
+    index_free_extents.clear();
+    lookup_table.clear();
+    free_bitmap.clear();
+    free_extents.clear();
+    free_extents_size.clear();
+    free_bitmap_dirty.clear();
+    xvfs_header.free_bitmap_extents.clear();
+    xvfs_header.free_bitmap_sectors = 0;
+    xvfs_header.index_root_sector = 0xFFFFFFFF;
+    xvfs_header.index_page_sectors = (index_page_size + xvfs_header.sector_size - 1) / xvfs_header.sector_size;
+    used_end_sector = 0;
+    xvfs_header.log_extents.clear();
+    xvfs_header.log_generation = 0;
+    header_extents.clear();
+    log_tail = 0;
+    end_sector = get_sectors(storage_size);
 }
 
 bool xvfs::save_header() {
     //std::cout << "save_header" << std::endl;
+    // сектора, освобождение которых отложено, иначе попадут в карту занятыми
+    reclaim_retired(true);
+    // выделяем сектора под заголовок до того, как запишем карту пустых секторов
     unsigned long header_size = xvfs_header.get_size();
-    unsigned long files_size = xvfs_header.files.size();
-    unsigned long empty_sectors_size = xvfs_header.empty_sectors.size();
+    if(get_sectors(header_size) != get_extents_sectors(header_extents)) {
+        resize_extents(header_extents, get_sectors(header_size));
+    }
+    // индекс файлов пишем после заголовка, заголовок всегда начинается с нулевого сектора
+    std::vector<_xvfs_extent> old_index_extents;
+    if(!save_index(old_index_extents)) return false;
+    // сектора журнала выделяем после заголовка и индекса
+    // журнал растет вместе с заголовком, чтобы контрольные точки были редкими
+    const unsigned long min_log_size = 256 * 1024;
+    const unsigned long log_sectors = (std::max(min_log_size, xvfs_header.get_size() / 2) + xvfs_header.sector_size - 1) / xvfs_header.sector_size;
+    const unsigned long current_log_sectors = get_extents_sectors(xvfs_header.log_extents);
+    if(current_log_sectors < log_sectors || current_log_sectors > 4 * log_sectors) {
+        resize_extents(xvfs_header.log_extents, log_sectors);
+        // заполняем журнал нулями: сектора журнала должны существовать в файле
+        std::vector<char> log_data(log_sectors * xvfs_header.sector_size, 0);
+        if(!write_region(xvfs_header.log_extents, 0, &log_data[0], log_data.size())) return false;
+    }
+    // сектора прежнего индекса освобождаем только после записи журнала, чтобы до записи заголовка в них писался только сам заголовок
+    clear_data(old_index_extents);
+    // карта должна описывать все сектора файла VFS
+    resize_free_bitmap();
+    // экстентов журнала и карты пустых секторов могло стать больше
+    if(get_sectors(xvfs_header.get_size()) > get_extents_sectors(header_extents)) {
+        resize_extents(header_extents, get_sectors(xvfs_header.get_size()));
+    }
+    // после этого сектора больше не выделяются и карту можно записать
+    if(!save_free_bitmap()) return false;
+    header_size = xvfs_header.get_size();
+    unsigned long files_size = 0;
+    unsigned long empty_sectors_size = 0;
 
     //std::cout << "header_size " << header_size << std::endl;
     //std::cout << "sector_size " << xvfs_header.sector_size << std::endl;
-    //std::cout << "files_size " << files_size << std::endl;
     //std::cout << "empty_sectors_size " << empty_sectors_size << std::endl;
 
     char* buf = new char[header_size];
     memset(buf, 0, header_size);
 
     unsigned long offset = 0;
-    // запишем размер заголовка
-    std::memcpy(buf, &header_size, sizeof(header_size));
+    // запишем метку заголовка с индексом файлов и размер заголовка
+    std::memcpy(buf, &index_format_mark, sizeof(index_format_mark));
+    offset += sizeof(index_format_mark);
+    std::memcpy(buf + offset, &header_size, sizeof(header_size));
     offset += sizeof(header_size);
     // запищем размер сектора
     std::memcpy(buf + offset, &xvfs_header.sector_size, sizeof(xvfs_header.sector_size));
@@ -807,28 +3651,63 @@ bool xvfs::save_header() {
     // запищем тип компресии файлов
     std::memcpy(buf + offset, &xvfs_header.compression_type, sizeof(xvfs_header.compression_type));
     offset += sizeof(xvfs_header.compression_type);
-    // запишем количество файлов
+    // файлы хранятся в индексе, в самом заголовке их нет
     std::memcpy(buf + offset, &files_size, sizeof(files_size));
     offset += sizeof(files_size);
-    // запишем сами файлы
-    for(unsigned long i = 0; i < files_size; ++i) {
-        _xvfs_file_header i_file_header = xvfs_header.files[i];
-        std::memcpy(buf + offset, &i_file_header, sizeof(_xvfs_file_header));
-        offset += sizeof(_xvfs_file_header);
-    }
-    // запишем количество пустых секторов
+    // пустые сектора хранятся в карте, в самом заголовке их нет
     std::memcpy(buf + offset, &empty_sectors_size, sizeof(empty_sectors_size));
     offset += sizeof(empty_sectors_size);
-    // запишем сами пустые сектора
-    for(unsigned long i = 0; i < empty_sectors_size; ++i) {
-        std::memcpy(buf + offset, &xvfs_header.empty_sectors[i], sizeof(unsigned long));
-        offset += sizeof(unsigned long);
-    }
-    if(write_data(0, buf, header_size) < 0) {
+    // запишем секцию индекса файлов: корневая страница, размер страницы и конец занятых секторов
+    unsigned long section_id = SECTION_INDEX_TREE;
+    unsigned long section_size = 3 * sizeof(unsigned long);
+    std::memcpy(buf + offset, &section_id, sizeof(section_id));
+    offset += sizeof(section_id);
+    std::memcpy(buf + offset, &section_size, sizeof(section_size));
+    offset += sizeof(section_size);
+    std::memcpy(buf + offset, &xvfs_header.index_root_sector, sizeof(xvfs_header.index_root_sector));
+    offset += sizeof(xvfs_header.index_root_sector);
+    std::memcpy(buf + offset, &xvfs_header.index_page_sectors, sizeof(xvfs_header.index_page_sectors));
+    offset += sizeof(xvfs_header.index_page_sectors);
+    std::memcpy(buf + offset, &end_sector, sizeof(end_sector));
+    offset += sizeof(end_sector);
+    // запишем секцию журнала с номером новой контрольной точки
+    unsigned long log_generation = xvfs_header.log_generation + 1;
+    unsigned long log_extents_size = xvfs_header.log_extents.size();
+    section_id = SECTION_LOG;
+    section_size = 2 * sizeof(unsigned long) + log_extents_size * sizeof(_xvfs_extent);
+    std::memcpy(buf + offset, &section_id, sizeof(section_id));
+    offset += sizeof(section_id);
+    std::memcpy(buf + offset, &section_size, sizeof(section_size));
+    offset += sizeof(section_size);
+    std::memcpy(buf + offset, &log_generation, sizeof(log_generation));
+    offset += sizeof(log_generation);
+    std::memcpy(buf + offset, &log_extents_size, sizeof(log_extents_size));
+    offset += sizeof(log_extents_size);
+    if(log_extents_size > 0) std::memcpy(buf + offset, &xvfs_header.log_extents[0], log_extents_size * sizeof(_xvfs_extent));
+    offset += log_extents_size * sizeof(_xvfs_extent);
+    // запишем секцию карты пустых секторов
+    unsigned long free_bitmap_extents_size = xvfs_header.free_bitmap_extents.size();
+    section_id = SECTION_FREE_BITMAP;
+    section_size = 2 * sizeof(unsigned long) + free_bitmap_extents_size * sizeof(_xvfs_extent);
+    std::memcpy(buf + offset, &section_id, sizeof(section_id));
+    offset += sizeof(section_id);
+    std::memcpy(buf + offset, &section_size, sizeof(section_size));
+    offset += sizeof(section_size);
+    std::memcpy(buf + offset, &xvfs_header.free_bitmap_sectors, sizeof(xvfs_header.free_bitmap_sectors));
+    offset += sizeof(xvfs_header.free_bitmap_sectors);
+    std::memcpy(buf + offset, &free_bitmap_extents_size, sizeof(free_bitmap_extents_size));
+    offset += sizeof(free_bitmap_extents_size);
+    if(free_bitmap_extents_size > 0) std::memcpy(buf + offset, &xvfs_header.free_bitmap_extents[0], free_bitmap_extents_size * sizeof(_xvfs_extent));
+    offset += free_bitmap_extents_size * sizeof(_xvfs_extent);
+    if(write_data(header_extents, buf, header_size) < 0) {
         delete[] buf;
         return false;
     }
     delete[] buf;
+    // старые записи журнала относятся к прошлой контрольной точке
+    xvfs_header.log_generation = log_generation;
+    used_end_sector = end_sector;
+    log_tail = 0;
     return true;
 }
 
@@ -934,3 +3813,156 @@ bool xvfs::close() {
     open_mode = -1;
     return false;
 }
+
+xvfs_sharded::xvfs_sharded(const std::vector<std::string>& file_names) {
+    init_shards(file_names, 512, xvfs::NO_COMPRESSION, xvfs::USE_PREAD_STORAGE);
+}
+
+xvfs_sharded::xvfs_sharded(const std::vector<std::string>& file_names, int sector_size) {
+    init_shards(file_names, sector_size, xvfs::NO_COMPRESSION, xvfs::USE_PREAD_STORAGE);
+}
+
+xvfs_sharded::xvfs_sharded(const std::vector<std::string>& file_names, int sector_size, int compression_type) {
+    init_shards(file_names, sector_size, compression_type, xvfs::USE_PREAD_STORAGE);
+}
+
+xvfs_sharded::xvfs_sharded(const std::vector<std::string>& file_names, int sector_size, int compression_type, int storage_type) {
+    init_shards(file_names, sector_size, compression_type, storage_type);
+}
+
+xvfs_sharded::~xvfs_sharded() {
+    for(size_t i = 0; i < shards.size(); ++i) {
+        delete shards[i];
+    }
+}
+
+void xvfs_sharded::init_shards(const std::vector<std::string>& file_names, int sector_size, int compression_type, int storage_type) {
+    shards.resize(file_names.size());
+    for(size_t i = 0; i < file_names.size(); ++i) {
+        shards[i] = new xvfs(file_names[i], sector_size, compression_type, storage_type);
+    }
+}
+
+bool xvfs_sharded::is_open() {
+    if(shards.size() == 0) return false;
+    for(size_t i = 0; i < shards.size(); ++i) {
+        if(!shards[i]->is_open()) return false;
+    }
+    return true;
+}
+
+size_t xvfs_sharded::get_shard_index(long long hash_vfs_file) {
+    // хэш перемешиваем, чтобы файлы с близкими хэшами расходились по разным шардам
+    return (size_t)(((unsigned long long)hash_vfs_file * 0x9E3779B97F4A7C15ULL) >> 32) % shards.size();
+}
+
+long long xvfs_sharded::calculate_crc64(std::string vfs_file_name) {
+    if(shards.size() == 0) return 0;
+    return shards[0]->calculate_crc64(vfs_file_name);
+}
+
+bool xvfs_sharded::write_file(std::string vfs_file_name, char* data, unsigned long len) {
+    if(shards.size() == 0) return false;
+    return write_file(calculate_crc64(vfs_file_name), data, len);
+}
+
+bool xvfs_sharded::write_file(std::string vfs_file_name, char* data, unsigned long len, long compression_type) {
+    if(shards.size() == 0) return false;
+    return write_file(calculate_crc64(vfs_file_name), data, len, compression_type);
+}
+
+bool xvfs_sharded::write_file(long long hash_vfs_file, char* data, unsigned long len) {
+    if(shards.size() == 0) return false;
+    return shards[get_shard_index(hash_vfs_file)]->write_file(hash_vfs_file, data, len);
+}
+
+bool xvfs_sharded::write_file(long long hash_vfs_file, char* data, unsigned long len, long compression_type) {
+    if(shards.size() == 0) return false;
+    return shards[get_shard_index(hash_vfs_file)]->write_file(hash_vfs_file, data, len, compression_type);
+}
+
+long xvfs_sharded::read_file(std::string vfs_file_name, char*& data) {
+    if(shards.size() == 0) return xvfs::ERROR_VFS_FILE_NOT_OPEN;
+    return read_file(calculate_crc64(vfs_file_name), data);
+}
+
+long xvfs_sharded::read_file(long long hash_vfs_file, char*& data) {
+    if(shards.size() == 0) return xvfs::ERROR_VFS_FILE_NOT_OPEN;
+    return shards[get_shard_index(hash_vfs_file)]->read_file(hash_vfs_file, data);
+}
+
+long xvfs_sharded::read_range(std::string vfs_file_name, unsigned long offset, unsigned long length, char* data) {
+    if(shards.size() == 0) return xvfs::ERROR_VFS_FILE_NOT_OPEN;
+    return read_range(calculate_crc64(vfs_file_name), offset, length, data);
+}
+
+long xvfs_sharded::read_range(long long hash_vfs_file, unsigned long offset, unsigned long length, char* data) {
+    if(shards.size() == 0) return xvfs::ERROR_VFS_FILE_NOT_OPEN;
+    return shards[get_shard_index(hash_vfs_file)]->read_range(hash_vfs_file, offset, length, data);
+}
+
+long xvfs_sharded::read_files(const std::vector<long long>& hash_vfs_files, std::vector<char*>& data, std::vector<long>& lens) {
+    if(shards.size() == 0) return xvfs::ERROR_VFS_FILE_NOT_OPEN;
+    const size_t files_count = hash_vfs_files.size();
+    data.resize(files_count, NULL);
+    lens.assign(files_count, xvfs::ERROR_VFS_FILE_NOT_OPEN);
+    // файлы раскладываем по шардам, порядок внутри шарда сохраняется
+    std::vector<std::vector<size_t>> shards_files(shards.size());
+    for(size_t i = 0; i < files_count; ++i) {
+        shards_files[get_shard_index(hash_vfs_files[i])].push_back(i);
+    }
+    long count = 0;
+    for(size_t s = 0; s < shards.size(); ++s) {
+        const std::vector<size_t>& files = shards_files[s];
+        if(files.size() == 0) continue;
+        std::vector<long long> shard_hashes(files.size());
+        std::vector<char*> shard_data(files.size());
+        std::vector<long> shard_lens;
+        for(size_t i = 0; i < files.size(); ++i) {
+            shard_hashes[i] = hash_vfs_files[files[i]];
+            shard_data[i] = data[files[i]];
+        }
+        const long shard_count = shards[s]->read_files(shard_hashes, shard_data, shard_lens);
+        if(shard_count < 0) {
+            for(size_t i = 0; i < files.size(); ++i) {
+                lens[files[i]] = shard_count;
+            }
+            continue;
+        }
+        count += shard_count;
+        for(size_t i = 0; i < files.size(); ++i) {
+            data[files[i]] = shard_data[i];
+            lens[files[i]] = shard_lens[i];
+        }
+    }
+    return count;
+}
+
+long xvfs_sharded::read_files(const std::vector<std::string>& vfs_file_names, std::vector<char*>& data, std::vector<long>& lens) {
+    if(shards.size() == 0) return xvfs::ERROR_VFS_FILE_NOT_OPEN;
+    std::vector<long long> hash_vfs_files(vfs_file_names.size());
+    for(size_t i = 0; i < vfs_file_names.size(); ++i) {
+        hash_vfs_files[i] = calculate_crc64(vfs_file_names[i]);
+    }
+    return read_files(hash_vfs_files, data, lens);
+}
+
+long xvfs_sharded::get_len_file(std::string vfs_file_name) {
+    if(shards.size() == 0) return xvfs::ERROR_VFS_FILE_NOT_OPEN;
+    return get_len_file(calculate_crc64(vfs_file_name));
+}
+
+long xvfs_sharded::get_len_file(long long hash_vfs_file) {
+    if(shards.size() == 0) return xvfs::ERROR_VFS_FILE_NOT_OPEN;
+    return shards[get_shard_index(hash_vfs_file)]->get_len_file(hash_vfs_file);
+}
+
+bool xvfs_sharded::delete_file(std::string vfs_file_name) {
+    if(shards.size() == 0) return false;
+    return delete_file(calculate_crc64(vfs_file_name));
+}
+
+bool xvfs_sharded::delete_file(long long hash_vfs_file) {
+    if(shards.size() == 0) return false;
+    return shards[get_shard_index(hash_vfs_file)]->delete_file(hash_vfs_file);
+}
@@ -4,6 +4,18 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <future>
+#include <condition_variable>
 
 //#define XFVS_USE_ZLIB
 
@@ -19,6 +31,15 @@
 #include <lz4.h>
 #endif
 
+#ifdef XFVS_USE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#ifdef XFVS_USE_IO_URING
+#include <liburing.h>
+#endif
+
 class xvfs {
 public:
 
@@ -29,6 +50,7 @@ public:
         unsigned long size;                             /**< Размер файла */
         unsigned long real_size;                        /**< Размер файла после декомпресии */
         unsigned long start_sector;                     /**< Начальный сектор файла */
+        long compression_type;                          /**< Тип компрессии файла (из перечисления xfvsCompressionType, с флагом CHUNKED_COMPRESSION) */
 
         _xvfs_file_header() {};
 
@@ -37,6 +59,7 @@ public:
             size = _size;
             real_size = _size;
             start_sector = _start_sector;
+            compression_type = NO_COMPRESSION;
         }
 
         _xvfs_file_header(long long _hash, unsigned long _size, unsigned long _start_sector, unsigned long _real_size) {
@@ -44,66 +67,1183 @@ public:
             size = _size;
             real_size = _real_size;
             start_sector = _start_sector;
+            compression_type = NO_COMPRESSION;
+        }
+
+        _xvfs_file_header(long long _hash, unsigned long _size, unsigned long _start_sector, unsigned long _real_size, long _compression_type) {
+            hash = _hash;
+            size = _size;
+            real_size = _real_size;
+            start_sector = _start_sector;
+            compression_type = _compression_type;
+        }
+
+        bool operator<(const _xvfs_file_header& value)const{return hash < value.hash;}
+
+    };
+
+    /** \brief Структура экстента (непрерывного участка секторов) виртуального файла
+     */
+    struct _xvfs_extent {
+        unsigned long start_sector;                     /**< Первый сектор участка */
+        unsigned long sectors;                          /**< Количество секторов участка */
+
+        _xvfs_extent() {};
+
+        _xvfs_extent(unsigned long _start_sector, unsigned long _sectors) {
+            start_sector = _start_sector;
+            sectors = _sectors;
+        }
+    };
+
+    /** \brief Результат асинхронного чтения файла
+     */
+    struct _xvfs_read_result {
+        long len;                                       /**< Длина файла или код ошибки */
+        char* data;                                     /**< Данные файла (освобождаются через delete[]) */
+    };
+
+private:
+    std::fstream fvs_file;                              /**< Файл виртуальной файловой системы */
+
+    // переменные для работы с хранилищем в режимах USE_MMAP_STORAGE и USE_PREAD_STORAGE
+    int storage_type = 0;                               /**< Тип хранилища (из перечисления xfvsStorageType) */
+    std::atomic<unsigned long long> storage_size{0};    /**< Логический размер файла виртуальной файловой системы */
+#   if defined(_WIN32)
+    void* storage_handle = NULL;                        /**< HANDLE файла виртуальной файловой системы */
+    void* storage_map_handle = NULL;                    /**< HANDLE отображения файла в память */
+#   else
+    int storage_fd = -1;                                /**< Дескриптор файла виртуальной файловой системы */
+#   endif
+    std::atomic<char*> storage_map{NULL};               /**< Отображение файла в память */
+    unsigned long long storage_map_size = 0;            /**< Размер отображения (емкость файла) */
+#   if defined(XFVS_USE_IO_URING)
+    struct io_uring storage_ring;                       /**< Очередь io_uring для пакетного чтения */
+    int storage_ring_state = 0;                         /**< Состояние очереди: 0 - не создана, 1 - создана, -1 - недоступна */
+#   endif
+
+    /** \brief Структура контекста компрессии
+     * Состояние библиотек сжатия, которое переиспользуется между вызовами, поэтому сжатие и декомпрессия
+     * не создают его заново для каждого файла. Каждый поток работает со своим контекстом
+     */
+    struct _xvfs_codec_context {
+#       if defined(XFVS_USE_ZLIB)
+        z_stream zlib_deflate;                          /**< Поток сжатия zlib */
+        z_stream zlib_inflate;                          /**< Поток декомпрессии zlib */
+        int zlib_deflate_level = -1;                    /**< Уровень потока сжатия zlib (-1 - поток не создан) */
+        bool is_zlib_inflate = false;                   /**< Поток декомпрессии zlib создан */
+#       endif
+#       if defined(XFVS_USE_MINLIZO)
+        std::vector<lzo_align_t> lzo_wrkmem;            /**< Рабочая память minilzo, выделяется при первом сжатии */
+#       endif
+#       if defined(XFVS_USE_LZ4)
+        std::vector<long long> lz4_state;               /**< Состояние сжатия lz4, выделяется при первом сжатии */
+#       endif
+#       if defined(XFVS_USE_ZSTD)
+        ZSTD_CCtx* zstd_cctx = NULL;                    /**< Контекст сжатия zstd, создается при первом сжатии */
+        ZSTD_DCtx* zstd_dctx = NULL;                    /**< Контекст декомпрессии zstd, создается при первом чтении */
+#       endif
+
+        _xvfs_codec_context() {};
+        ~_xvfs_codec_context();
+        _xvfs_codec_context(const _xvfs_codec_context&) = delete;
+        _xvfs_codec_context& operator=(const _xvfs_codec_context&) = delete;
+    };
+
+    unsigned compression_threads = 1;                   /**< Количество потоков сжатия частей файла */
+    std::vector<std::thread> compression_workers;       /**< Дополнительные потоки сжатия (создаются в set_compression_threads()) */
+    std::condition_variable compression_condition;      /**< Появились задачи сжатия или потоки останавливаются */
+    std::condition_variable compression_done_condition; /**< Потоки сжатия закончили задачи */
+    const std::function<void(unsigned long, _xvfs_codec_context*)>* compression_task = NULL; /**< Текущие задачи сжатия */
+    unsigned long compression_tasks = 0;                /**< Количество текущих задач сжатия */
+    std::atomic<unsigned long> compression_next_task;   /**< Следующая задача сжатия */
+    unsigned long compression_job = 0;                  /**< Номер набора задач сжатия */
+    unsigned compression_busy_workers = 0;              /**< Потоки сжатия, которые выполняют задачи */
+    bool is_compression_stop = false;                   /**< Потоки сжатия останавливаются */
+
+    // блокировки для работы с VFS из нескольких потоков
+    std::shared_timed_mutex vfs_mutex;                  /**< Чтение файлов берет общую блокировку, изменение VFS - исключительную */
+    std::mutex vfs_writer_mutex;                        /**< Очередь изменений VFS, держится, пока изменение ждет исключительную блокировку */
+    std::atomic<unsigned> vfs_waiting_writers{0};       /**< Количество изменений, ждущих блокировку; новые чтения пропускают их вперед */
+    std::mutex index_mutex;                             /**< Поиск файла (таблица поиска и загрузка страниц индекса) при общей блокировке */
+    std::mutex storage_mutex;                           /**< Указатель std::fstream и очередь io_uring при общей блокировке */
+    std::mutex dictionary_mutex;                        /**< Словари zstd для декомпрессии при общей блокировке */
+    std::mutex compression_mutex;                       /**< Дополнительные потоки сжатия заняты одним вызовом */
+    std::mutex compression_workers_mutex;               /**< Задачи дополнительных потоков сжатия */
+
+    /** \brief Поток пула асинхронных вызовов
+     * Вызовы с одним хэшем попадают в очередь одного потока, поэтому выполняются в порядке вызова
+     */
+    struct _xvfs_async_worker {
+        std::thread thread;                             /**< Поток */
+        std::deque<std::function<void()>> tasks;        /**< Очередь вызовов потока */
+        std::condition_variable condition;              /**< Появился вызов или пул останавливается */
+    };
+
+    std::vector<_xvfs_async_worker*> async_workers;     /**< Потоки пула асинхронных вызовов (создаются при первом вызове) */
+    std::mutex async_mutex;                             /**< Очереди пула асинхронных вызовов */
+    unsigned async_threads = 0;                         /**< Количество потоков пула (0 - по количеству ядер процессора) */
+    size_t max_async_tasks = 1024;                      /**< Максимальное количество ожидающих вызовов */
+    size_t async_tasks_size = 0;                        /**< Количество ожидающих вызовов */
+    bool is_async_stop = false;                         /**< Пул останавливается */
+
+    struct _xvfs_snapshot;
+    struct _xvfs_reader_slot;
+
+    /** \brief Блокировка VFS на время вызова
+     * Вложенный вызов из потока, который уже заблокировал VFS (например, read_file внутри write_file), VFS повторно не блокирует.
+     * Если включены снимки индекса, общая блокировка вместо vfs_mutex занимает ячейку читателя и берет текущий снимок.
+     * В режиме нескольких процессов блокировка также блокирует файл общего состояния и применяет изменения других процессов
+     */
+    class _xvfs_lock {
+    public:
+        _xvfs_lock(xvfs* _vfs, bool _is_unique);
+        ~_xvfs_lock();
+
+        /** \brief Получить снимок индекса, который взял поток
+         * \param vfs VFS
+         * \return снимок индекса или NULL, если поток не читает по снимку
+         */
+        static const _xvfs_snapshot* get_snapshot(const xvfs* vfs);
+
+        /** \brief Проверить, не удалось ли заблокировать файл общего состояния
+         * Вызов, которому не удалось заблокировать VFS от других процессов, должен сразу завершиться ошибкой
+         * \return вернет true, если блокировка не взята
+         */
+        inline bool is_error() const {
+            return is_process_error;
         }
+    private:
+        xvfs* vfs;
+        bool is_unique;
+        bool is_locked;
+        _xvfs_reader_slot* slot;                        /**< Ячейка читателя (NULL - взята блокировка vfs_mutex) */
+        const _xvfs_snapshot* snapshot;                 /**< Снимок индекса читателя */
+        bool is_process_reader;                         /**< Читатель взял общую блокировку файла общего состояния */
+        bool is_process_error;                          /**< Не удалось заблокировать файл общего состояния или прочитать изменения других процессов */
+        _xvfs_lock* prev_lock;                          /**< Внешняя блокировка этого же потока */
+        static thread_local _xvfs_lock* last_lock;      /**< Последняя блокировка потока */
+    };
+#   if defined(XFVS_USE_ZSTD)
+    std::map<int, ZSTD_CDict*> zstd_cdicts;             /**< Текущий словарь zstd, подготовленный для сжатия, по уровню сжатия */
+    std::map<unsigned, ZSTD_DDict*> zstd_ddicts;        /**< Словари zstd, подготовленные для декомпрессии, по id словаря */
+    std::vector<char> zstd_dictionary;                  /**< Текущий словарь zstd */
+    unsigned zstd_dictionary_id = 0;                    /**< id текущего словаря zstd (0 - словаря нет) */
+    bool is_zstd_dictionary_loaded = false;             /**< Текущий словарь zstd уже искали в файле VFS после чтения заголовка или журнала */
+#   endif
+    // переменные для работы с функциями
+    // open, write, read, get_size, close
+    int open_mode = 0;
+    long long open_hash = 0;
+    long open_size = 0;
+    long open_pos = 0;
+    char* open_buffer_write = NULL;
+    char* open_buffer_read = NULL;
+
+    /** \brief Структура заголовка
+     */
+    struct _xvfs_header {
+        unsigned long sector_size;                      /**< Размер сектора */
+        long compression_type;                          /**< Тип компрессии */
+        std::vector<_xvfs_extent> free_bitmap_extents;  /**< Сектора карты пустых секторов */
+        unsigned long free_bitmap_sectors = 0;          /**< Количество секторов, которые описывает карта пустых секторов */
+        unsigned long index_root_sector = 0xFFFFFFFF;   /**< Сектор корневой страницы индекса файлов (0xFFFFFFFF - индекс пуст) */
+        unsigned long index_page_sectors = 0;           /**< Количество секторов страницы индекса */
+        std::vector<_xvfs_extent> log_extents;          /**< Сектора журнала изменений */
+        unsigned long log_generation = 0;               /**< Номер контрольной точки */
+        unsigned long get_size() {
+            unsigned long size = sizeof(sector_size) +
+                5 * sizeof(unsigned long); // метка формата, размер раголовка, тип компресии, количество файлов, пустых секторов
+            // секция индекса: id, размер секции, корневая страница, размер страницы, конец файла
+            size += 5 * sizeof(unsigned long);
+            // секция журнала: id, размер секции, номер контрольной точки, количество экстентов и экстенты
+            size += 4 * sizeof(unsigned long) + log_extents.size() * sizeof(_xvfs_extent);
+            // секция карты пустых секторов: id, размер секции, количество секторов, количество экстентов и экстенты
+            size += 4 * sizeof(unsigned long) + free_bitmap_extents.size() * sizeof(_xvfs_extent);
+            return size;
+        }
+    } xvfs_header;
+
+    /** \brief Метка заголовка с индексом файлов
+     * Пишется на месте размера заголовка, сам размер идет следующим полем.
+     * Старые версии библиотеки считают метку размером заголовка больше файла и не открывают такой файл VFS
+     */
+    const unsigned long index_format_mark = ~2UL;
+    const unsigned long legacy_index_format_mark = ~1UL; /**< Метка заголовка с B+ деревом без типа компрессии в записях (только чтение) */
+    const unsigned long flat_index_format_mark = ~0UL; /**< Метка заголовка с индексом одним массивом (только чтение) */
+
+    const unsigned long index_page_size = 4096;     /**< Размер страницы индекса по умолчанию */
+
+    /** \brief Секции заголовка
+     * Секции пишутся после списка пустых секторов в виде [id][размер данных][данные].
+     * Старые версии библиотеки читают заголовок только до списка пустых секторов и секции игнорируют
+     */
+    enum xfvsHeaderSection {
+        SECTION_FILES_EXTENTS = 1,                      /**< Экстенты файлов (заголовок без индекса файлов) */
+        SECTION_LOG = 2,                                /**< Журнал изменений */
+        SECTION_INDEX = 3,                              /**< Индекс файлов одним отсортированным массивом (читается при открытии и переводится в SECTION_INDEX_TREE) */
+        SECTION_INDEX_TREE = 4,                         /**< Индекс файлов в виде B+ дерева */
+        SECTION_FREE_BITMAP = 5                         /**< Карта пустых секторов */
+    };
+
+    /** \brief Запись индекса файлов
+     * Индекс файлов - B+ дерево из страниц фиксированного размера. Страница занимает непрерывный участок секторов
+     * без ссылок в конце секторов и начинается с заголовка [тип страницы][количество записей].
+     * В листьях лежат записи, отсортированные по хэшу: на каждый экстент файла одна запись, записи одного файла идут подряд
+     * (и могут продолжаться в следующем листе). У файла без секторов одна запись с нулевым количеством секторов
+     */
+    struct _xvfs_index_entry {
+        long long hash;                                 /**< Хэш файла */
+        unsigned long size;                             /**< Размер файла */
+        unsigned long real_size;                        /**< Размер файла после декомпресии */
+        unsigned long start_sector;                     /**< Первый сектор экстента */
+        unsigned long sectors;                          /**< Количество секторов экстента */
+        long compression_type;                          /**< Тип компрессии файла */
+    };
+
+    /** \brief Запись индекса старых версий формата (без типа компрессии)
+     * Так записаны индекс одним массивом и листья INDEX_LEAF_PAGE, файлы в них сжаты типом компрессии VFS
+     */
+    struct _xvfs_legacy_index_entry {
+        long long hash;
+        unsigned long size;
+        unsigned long real_size;
+        unsigned long start_sector;
+        unsigned long sectors;
+    };
+
+    /** \brief Заголовок файла старых версий формата (без типа компрессии)
+     * Так файлы записаны в заголовке VFS без индекса файлов и в записях журнала LOG_WRITE_FILE
+     */
+    struct _xvfs_legacy_file_header {
+        long long hash;
+        unsigned long size;
+        unsigned long real_size;
+        unsigned long start_sector;
+    };
+
+    /** \brief Ключ внутренней страницы индекса
+     */
+    struct _xvfs_index_key {
+        long long hash;                                 /**< Первый хэш дочерней страницы */
+        unsigned long sector;                           /**< Сектор дочерней страницы */
+    };
+
+    /** \brief Типы страниц индекса
+     */
+    enum xfvsIndexPageType {
+        INDEX_LEAF_PAGE = 1,                            /**< Лист с записями индекса старого формата (только чтение) */
+        INDEX_INNER_PAGE = 2,                           /**< Внутренняя страница с ключами дочерних страниц */
+        INDEX_CODEC_LEAF_PAGE = 3                       /**< Лист с записями индекса */
+    };
+
+    /** \brief Загруженная страница индекса
+     * В памяти держатся только страницы, которые нужны для поиска или были изменены.
+     * Измененная страница при контрольной точке пишется в новые сектора, поэтому вместе с ней меняются и все страницы на пути к корню
+     */
+    struct _xvfs_index_page {
+        unsigned long sector;                           /**< Сектор страницы в файле VFS (0xFFFFFFFF - страница еще не записана) */
+        bool is_leaf;                                   /**< Страница - лист */
+        bool is_dirty;                                  /**< Страница изменена после контрольной точки */
+        std::vector<_xvfs_index_entry> entries;         /**< Записи листа */
+        std::vector<_xvfs_index_key> keys;              /**< Ключи внутренней страницы */
+        std::vector<_xvfs_index_page*> children;        /**< Загруженные дочерние страницы (или NULL) */
+    };
+
+    _xvfs_index_page* index_root = NULL;                /**< Корневая страница индекса (NULL - индекс пуст) */
+    unsigned long index_pages = 0;                      /**< Количество загруженных страниц индекса */
+    unsigned long index_dirty_pages = 0;                /**< Количество измененных страниц индекса */
+    std::vector<_xvfs_extent> index_free_extents;       /**< Сектора страниц индекса, которые освободятся в контрольной точке */
+    unsigned long used_end_sector = 0;                  /**< Конец занятых секторов по контрольной точке и журналу */
+
+    /** \brief Ячейка таблицы поиска файлов
+     * Таблица поиска - хэш-таблица с открытой адресацией перед индексом файлов. Ячейки файла ищутся
+     * в окне из нескольких ячеек подряд, поэтому поиск не зависит от количества файлов и не выделяет память.
+     * Таблица имеет постоянный размер: при нехватке места ячейка в окне вытесняется, файл потом найдется в индексе.
+     * В таблице запоминается и отсутствие файла
+     */
+    struct _xvfs_lookup_slot {
+        long long hash;                                 /**< Хэш файла */
+        bool is_used;                                   /**< Ячейка занята */
+        bool is_file;                                   /**< Файл существует */
+        bool is_extents;                                /**< Экстенты файла поместились в ячейку */
+        _xvfs_file_header header;                       /**< Заголовок файла */
+        unsigned long extents_size;                     /**< Количество экстентов */
+        _xvfs_extent extents[3];                        /**< Экстенты файла */
+    };
+
+    const size_t lookup_table_size = 32768;             /**< Количество ячеек таблицы поиска */
+    const size_t lookup_window_size = 8;                /**< Количество ячеек, в которых ищется файл */
+    std::vector<_xvfs_lookup_slot> lookup_table;        /**< Таблица поиска файлов (создается при первом поиске) */
+    size_t lookup_victim = 0;                           /**< Счетчик для выбора вытесняемой ячейки */
+
+    /** \brief Снимок индекса файлов
+     * Неизменяемая копия индекса в памяти, по которой файлы ищутся без блокировок (см. set_index_snapshots).
+     * Писатель снимок не меняет, а публикует новый: общий с предыдущим снимком массив записей и небольшой массив
+     * изменений, который копируется при каждой записи и при росте сливается с общим массивом
+     */
+    struct _xvfs_snapshot_entry {
+        _xvfs_index_entry entry;                        /**< Запись индекса */
+        bool is_deleted;                                /**< Файл удален (запись без экстента) */
+    };
+
+    struct _xvfs_snapshot {
+        std::shared_ptr<const std::vector<_xvfs_index_entry>> entries; /**< Записи индекса по возрастанию хэша */
+        std::vector<_xvfs_snapshot_entry> changes;      /**< Файлы, измененные после entries, по возрастанию хэша */
+    };
+
+    /** \brief Ячейка читателя снимков
+     * Читатель пишет в свою ячейку эпоху, в которой взял снимок. Ячейка занимает отдельную строку кэша
+     */
+    struct _xvfs_reader_slot {
+        std::atomic<unsigned long long> epoch{0};       /**< Эпоха читателя (0 - ячейка свободна) */
+        char padding[64 - sizeof(std::atomic<unsigned long long>)];
+    };
+
+    /** \brief Объект, освобождение которого отложено до выхода читателей старых снимков
+     * Старые снимки, сектора старых версий файлов и прежнее отображение файла в память
+     */
+    struct _xvfs_retired {
+        unsigned long long epoch;                       /**< Объект можно освободить, когда все читатели дошли до этой эпохи */
+        _xvfs_snapshot* snapshot;                       /**< Снимок индекса (или NULL) */
+        std::vector<_xvfs_extent> extents;              /**< Сектора */
+        char* map;                                      /**< Отображение файла в память (или NULL) */
+        unsigned long long map_size;                    /**< Размер отображения */
+        void* map_handle;                               /**< HANDLE отображения (Windows) */
+    };
+
+    static const size_t reader_slots_size = 64;         /**< Количество ячеек читателей */
+    _xvfs_reader_slot reader_slots[reader_slots_size];  /**< Ячейки читателей снимков */
+    std::atomic<_xvfs_snapshot*> index_snapshot{NULL};  /**< Текущий снимок индекса (NULL - снимков нет) */
+    std::atomic<unsigned long long> snapshot_epoch{1};  /**< Эпоха снимков, растет при каждом откладывании освобождения */
+    std::deque<_xvfs_retired> retired_objects;          /**< Объекты с отложенным освобождением по возрастанию эпохи */
+    bool is_index_snapshots = false;                    /**< Снимки индекса включены */
+
+    /** \brief Общее состояние VFS для нескольких процессов
+     * Лежит в файле <имя файла VFS>.shm, который каждый процесс отображает в память. Состояние меняется и читается
+     * только под блокировкой файла .shm: запись берет исключительную блокировку, чтение - общую
+     */
+    struct _xvfs_shared_state {
+        unsigned long long mark;                        /**< Метка инициализированного состояния */
+        unsigned long long generation;                  /**< Поколение, растет при каждом изменении VFS */
+        unsigned long long log_generation;              /**< Номер контрольной точки журнала */
+        unsigned long long log_tail;                    /**< Конец записей журнала */
+        unsigned long long storage_size;                /**< Логический размер файла VFS */
+    };
+
+    static const unsigned long long shared_state_mark = 0x31736D6873667678ULL; /**< Метка общего состояния ("xvfshms1") */
+    _xvfs_shared_state* shared_state = NULL;            /**< Общее состояние (NULL - режим одного процесса) */
+    unsigned long long shared_generation = 0;           /**< Поколение, с которым синхронизировано состояние процесса */
+#   if defined(_WIN32)
+    void* shared_handle = NULL;                         /**< HANDLE файла общего состояния */
+    void* shared_map_handle = NULL;                     /**< HANDLE отображения общего состояния */
+#   else
+    int shared_fd = -1;                                 /**< Дескриптор файла общего состояния */
+#   endif
+    std::mutex process_mutex;                           /**< Общая блокировка файла для потоков процесса */
+    unsigned long process_readers = 0;                  /**< Количество потоков процесса, читающих под общей блокировкой файла */
+    bool is_process_locked = false;                     /**< Процесс держит исключительную блокировку файла */
+
+    /** \brief Карта пустых секторов
+     * Один бит на сектор: бит установлен, если сектор пуст. Карта хранится в отдельных секторах
+     * без ссылок в конце секторов, в контрольной точке пишутся только измененные сектора карты
+     */
+    std::vector<unsigned long long> free_bitmap;        /**< Карта пустых секторов */
+    std::vector<char> free_bitmap_dirty;                /**< Измененные сектора карты */
+
+    /** \brief Участки пустых секторов
+     * Пустые сектора в памяти хранятся непрерывными участками: соседние участки при освобождении секторов
+     * сливаются. Участки упорядочены по первому сектору и отдельно по размеру, поэтому участок
+     * нужного размера находится за O(log n). Строятся из карты пустых секторов при открытии
+     */
+    std::map<unsigned long, unsigned long> free_extents;                /**< Первый сектор участка -> количество секторов */
+    std::set<std::pair<unsigned long, unsigned long>> free_extents_size; /**< Количество секторов участка и первый сектор */
+    int allocation_type = BEST_FIT_ALLOCATION;          /**< Способ выбора участка пустых секторов */
+
+    // переменные для адаптивного сжатия
+    bool is_adaptive_compression = false;               /**< Адаптивное сжатие включено */
+    double min_compression_ratio = 1.1;                 /**< Минимальная степень сжатия, при меньшей файл пишется без сжатия */
+    double min_compression_speed = 0;                   /**< Минимальная скорость сжатия в байтах в секунду (0 - уровень сжатия не меняется) */
+    long adaptive_compression_type = NO_COMPRESSION;    /**< Тип компрессии для файлов, которые пишутся без своего типа компрессии */
+    double compression_speed = 0;                       /**< Сглаженная скорость сжатия с последней смены уровня */
+    unsigned long compression_speed_samples = 0;        /**< Количество замеров скорости сжатия с последней смены уровня */
+    const unsigned long compression_sample_size = 16384; /**< Размер части файла, по которой проверяется сжимаемость */
+
+    /** \brief Журнал изменений
+     * Заголовок целиком сохраняется только в контрольной точке. Каждое изменение файла дописывается
+     * в журнал отдельной записью, при открытии записи журнала применяются к заголовку.
+     * Когда в журнале кончается место (и при закрытии), делается новая контрольная точка.
+     * Журнал занимает отдельные сектора без ссылок в конце секторов
+     */
+    enum xfvsLogRecordType {
+        LOG_WRITE_FILE = 1,                             /**< Файл записан: заголовок файла старого формата, количество экстентов, экстенты (только чтение) */
+        LOG_DELETE_FILE = 2,                            /**< Файл удален: хэш файла */
+        LOG_BATCH = 3,                                  /**< Пакет изменений: записи в виде [тип][размер данных][данные] */
+        LOG_WRITE_CODEC_FILE = 4                        /**< Файл записан: заголовок файла с типом компрессии, количество экстентов, экстенты */
+    };
+
+    /** \brief Заголовок записи журнала
+     */
+    struct _xvfs_log_record {
+        unsigned long size;                             /**< Размер данных записи */
+        unsigned long type;                             /**< Тип записи (из перечисления xfvsLogRecordType) */
+        unsigned long generation;                       /**< Номер контрольной точки, записи с другим номером недействительны */
+        long long crc;                                  /**< CRC64 записи */
+    };
+
+    unsigned long log_tail = 0;                         /**< Размер записей журнала после контрольной точки */
+
+    // переменные для работы с пакетом изменений
+    bool is_batch = false;                              /**< Пакет изменений начат */
+    std::vector<char> batch_records;                    /**< Записи журнала пакета */
+    std::vector<_xvfs_extent> batch_free_extents;       /**< Сектора, которые освободятся при сохранении пакета */
+
+    std::vector<_xvfs_extent> header_extents;           /**< Сектора, которые занимает заголовок */
+    unsigned long end_sector = 0;                       /**< Первый сектор за концом файла виртуальной файловой системы */
+
+    std::atomic<bool> is_open_file{false};              /**< Файл виртуальной файловой системы открыт или нет */
+    std::string file_name;                              /**< Имя файла виртуальной файловой системы */
+    //unsigned long sector_size = 512;                    /**< Размер сектора */
+
+    bool check_file(std::string file_name);
+    bool create_file(std::string file_name);
+    void init_vfs(std::string file_name, int sector_size, int compression_type, int storage_type);
+
+    /** \brief Открыть хранилище
+     * \return вернет true в случае успеха
+     */
+    bool open_storage();
+
+    /** \brief Закрыть хранилище
+     * В режиме USE_MMAP_STORAGE файл обрезается до логического размера (кроме режима нескольких процессов)
+     */
+    void close_storage();
+
+    /** \brief Отобразить файл в память
+     * Отображение растет большими блоками, чтобы не переотображать файл на каждом новом секторе.
+     * Файл при этом только увеличивается, его могут отображать другие процессы
+     * \param size минимальный размер отображения
+     * \return вернет true в случае успеха
+     */
+    bool map_storage(unsigned long long size);
+    void unmap_storage();
+
+    /** \brief Открыть и отобразить в память файл общего состояния
+     * \return вернет true в случае успеха
+     */
+    bool open_shared_state();
+
+    /** \brief Закрыть файл общего состояния
+     */
+    void close_shared_state();
+
+    /** \brief Заблокировать файл общего состояния от других процессов
+     * Общую блокировку потоки процесса делят между собой
+     * \param is_unique исключительная блокировка
+     * \return вернет true в случае успеха
+     */
+    bool lock_process(bool is_unique);
+
+    /** \brief Снять блокировку файла общего состояния
+     */
+    void unlock_process();
+
+    /** \brief Проверить, меняли ли VFS другие процессы
+     * \return вернет true, если состояние процесса устарело
+     */
+    bool is_shared_changed();
+
+    /** \brief Применить изменения других процессов
+     * После контрольной точки перечитывается заголовок, иначе дочитываются новые записи журнала
+     * \return вернет true в случае успеха
+     */
+    bool sync_shared_state();
+
+    /** \brief Сообщить другим процессам об изменениях VFS
+     */
+    void publish_shared_state();
+
+    /** \brief Поставить асинхронный вызов в очередь пула
+     * \param hash_vfs_file хэш файла (выбирает поток пула)
+     * \param task вызов
+     * \return вернет false, если VFS не открыта или очередь заполнена
+     */
+    bool submit_async_task(long long hash_vfs_file, std::function<void()> task);
+
+    /** \brief Выполнять вызовы из очереди потока пула
+     * \param worker поток пула
+     */
+    void run_async_worker(_xvfs_async_worker* worker);
+
+    /** \brief Остановить пул асинхронных вызовов
+     * Вызовы, которые уже стоят в очереди, выполняются до остановки
+     */
+    void stop_async_workers();
+
+    /** \brief Закрыть отображение файла в память
+     * \param map отображение
+     * \param map_size размер отображения
+     * \param map_handle HANDLE отображения (Windows)
+     */
+    void unmap_view(char* map, unsigned long long map_size, void* map_handle);
+
+    /** \brief Читать данные из хранилища
+     * \param offset смещение в файле
+     * \param data буфер
+     * \param size размер данных
+     * \return вернет true в случае успеха
+     */
+    bool read_storage(unsigned long long offset, char* data, unsigned long size);
+
+    /** \brief Записать данные в хранилище
+     * \param offset смещение в файле
+     * \param data буфер
+     * \param size размер данных
+     * \return вернет true в случае успеха
+     */
+    bool write_storage(unsigned long long offset, const char* data, unsigned long size);
+
+    /** \brief Запрос чтения участка хранилища
+     */
+    struct _xvfs_read_request {
+        unsigned long long offset;                      /**< Смещение в файле */
+        char* data;                                     /**< Буфер */
+        unsigned long size;                             /**< Размер данных */
+        bool is_read;                                   /**< Участок прочитан */
+
+        _xvfs_read_request() {};
+
+        _xvfs_read_request(unsigned long long _offset, char* _data, unsigned long _size) {
+            offset = _offset;
+            data = _data;
+            size = _size;
+            is_read = false;
+        }
+    };
+
+    /** \brief Пакетно читать участки хранилища
+     * С XFVS_USE_IO_URING все запросы сразу отправляются в очередь io_uring и завершаются в произвольном порядке.
+     * Без него (или если ядро не поддерживает io_uring) участки читаются по очереди по возрастанию смещения
+     * \param requests запросы, у прочитанных участков выставляется is_read
+     * \return вернет true, если прочитаны все участки
+     */
+    bool read_storage_batch(std::vector<_xvfs_read_request>& requests);
+
+    /** \brief Читать данные по списку экстентов
+     * Каждый непрерывный участок секторов читается одним обращением к хранилищу
+     * \param extents экстенты
+     * \param file_data буфер
+     * \param file_size размер данных
+     * \param offset смещение данных от начала файла
+     * \return количество считанных байт или код ошибки
+     */
+    long read_data(const std::vector<_xvfs_extent>& extents, char* file_data, unsigned long file_size, unsigned long offset = 0);
+
+    /** \brief Записать данные по списку экстентов
+     * Пишутся все сектора экстентов, в конце каждого сектора сохраняется ссылка на следующий.
+     * Сектора непрерывного участка собираются в один буфер и пишутся одним обращением к хранилищу
+     * \param extents экстенты
+     * \param file_data буфер
+     * \param file_size размер данных
+     * \return количество записанных байт или код ошибки
+     */
+    long write_data(const std::vector<_xvfs_extent>& extents, char* file_data, unsigned long file_size);
+
+    /** \brief Сжатие данных файла
+     * Функция сама выделяет память под сжатые данные
+     * \param raw_data данные
+     * \param raw_size размер данных
+     * \param data сжатые данные
+     * \param size размер сжатых данных
+     * \param compression_type тип компрессии (не NO_COMPRESSION)
+     * \param context контекст компрессии (NULL - контекст вызывающего потока)
+     * \param dictionary_level уровень сжатия zstd для USE_ZSTD_DICTIONARY
+     * \return вернет true в случае успеха
+     */
+    bool compress_data(const char* raw_data, unsigned long raw_size, char*& data, unsigned long& size, long compression_type, _xvfs_codec_context* context = NULL, int dictionary_level = 3);
+
+    /** \brief Проверить сжимаемость данных по их части
+     * Сжимается только часть из середины данных, небольшие данные считаются сжимаемыми
+     * \param data данные
+     * \param size размер данных
+     * \param compression_type тип компрессии
+     * \param dictionary_level уровень сжатия zstd для USE_ZSTD_DICTIONARY
+     * \return вернет false, если часть данных сжимается хуже min_compression_ratio
+     */
+    bool is_compressible(const char* data, unsigned long size, long compression_type, int dictionary_level = 3);
+
+    /** \brief Учесть скорость сжатия и при необходимости сменить уровень сжатия
+     * \param size размер сжатых данных до сжатия
+     * \param seconds время сжатия
+     */
+    void update_compression_speed(unsigned long size, double seconds);
+
+    /** \brief Получить соседний уровень того же способа сжатия
+     * \param compression_type тип компрессии
+     * \param step шаг уровня (-1 - быстрее, 1 - сильнее)
+     * \return тип компрессии (для способов сжатия без уровней не меняется)
+     */
+    long get_compression_level(long compression_type, int step);
+
+    /** \brief Декомпрессия данных файла
+     * \param raw_data сжатые данные
+     * \param raw_size размер сжатых данных
+     * \param data буфер под данные после декомпрессии
+     * \param real_size размер данных после декомпрессии
+     * \param compression_type тип компрессии файла
+     * \param context контекст компрессии (NULL - контекст вызывающего потока)
+     * \return размер данных после декомпрессии или код ошибки
+     */
+    long decompress_data(const char* raw_data, unsigned long raw_size, char* data, unsigned long real_size, long compression_type, _xvfs_codec_context* context = NULL);
+
+    bool read_header();
+
+    /** \brief Сохранить заголовок целиком (контрольная точка)
+     * После контрольной точки журнал изменений начинается заново
+     * \return вернет true в случае успеха
+     */
+    bool save_header();
+
+    /** \brief Читать данные участка секторов без ссылок в конце секторов
+     * \param extents экстенты участка
+     * \param offset смещение от начала участка
+     * \param data буфер
+     * \param size размер данных
+     * \return вернет true в случае успеха
+     */
+    bool read_region(const std::vector<_xvfs_extent>& extents, unsigned long offset, char* data, unsigned long size);
+
+    /** \brief Записать данные в участок секторов без ссылок в конце секторов
+     * \param extents экстенты участка
+     * \param offset смещение от начала участка
+     * \param data буфер
+     * \param size размер данных
+     * \return вернет true в случае успеха
+     */
+    bool write_region(const std::vector<_xvfs_extent>& extents, unsigned long offset, const char* data, unsigned long size);
+
+    /** \brief Дописать запись в журнал изменений
+     * Если журнала нет или в нем не хватает места, вместо записи делается контрольная точка
+     * \param type тип записи
+     * \param data данные записи
+     * \param size размер данных
+     * \return вернет true в случае успеха
+     */
+    bool save_log_record(unsigned long type, const char* data, unsigned long size);
+
+    /** \brief Сохранить изменение файла
+     * \param file_header заголовок файла
+     * \param extents экстенты файла
+     * \return вернет true в случае успеха
+     */
+    bool save_file_header(const _xvfs_file_header& file_header, const std::vector<_xvfs_extent>& extents);
+
+    /** \brief Сохранить удаление файла
+     * \param hash_vfs_file хэш файла
+     * \return вернет true в случае успеха
+     */
+    bool save_file_deletion(long long hash_vfs_file);
+
+    /** \brief Применить записи журнала изменений
+     * Записи читаются до первой записи с другим номером контрольной точки или неверной CRC64
+     * \param offset смещение первой непримененной записи (0 - журнал читается с начала)
+     * \return вернет true в случае успеха
+     */
+    bool read_log(unsigned long offset = 0);
+
+    /** \brief Загрузить страницу индекса
+     * \param sector сектор страницы
+     * \return страница или NULL в случае ошибки
+     */
+    _xvfs_index_page* load_index_page(unsigned long sector);
+
+    /** \brief Получить дочернюю страницу индекса, при необходимости загрузить ее
+     * \param page внутренняя страница
+     * \param pos номер дочерней страницы
+     * \return страница или NULL в случае ошибки
+     */
+    _xvfs_index_page* get_index_child(_xvfs_index_page* page, size_t pos);
+
+    /** \brief Выгрузить страницу индекса вместе с загруженными дочерними страницами
+     * \param page страница
+     */
+    void free_index_page(_xvfs_index_page* page);
+
+    /** \brief Выгрузить неизмененные страницы индекса, если их загружено слишком много
+     */
+    void evict_index_pages();
+    void evict_index_pages(_xvfs_index_page* page);
+
+    /** \brief Отметить страницу индекса измененной
+     * \param page страница
+     */
+    void set_index_page_dirty(_xvfs_index_page* page);
+
+    /** \brief Найти дочернюю страницу, с которой начинаются записи с хэшем не меньше заданного
+     * \param keys ключи внутренней страницы
+     * \param hash_vfs_file хэш файла
+     * \return номер дочерней страницы
+     */
+    size_t get_index_child_pos(const std::vector<_xvfs_index_key>& keys, long long hash_vfs_file);
+
+    /** \brief Найти первую запись листа с хэшем не меньше заданного
+     * \param entries записи листа
+     * \param hash_vfs_file хэш файла
+     * \return номер записи
+     */
+    size_t get_index_entry_pos(const std::vector<_xvfs_index_entry>& entries, long long hash_vfs_file);
+
+    /** \brief Разделить переполненную страницу индекса
+     * Записи (или ключи), которые не помещаются на странице, переносятся в новые страницы
+     * \param page страница
+     * \param new_pages новые страницы, которые надо добавить в родительскую страницу сразу после page
+     */
+    void split_index_page(_xvfs_index_page* page, std::vector<_xvfs_index_page*>& new_pages);
+
+    /** \brief Добавить записи файла в поддерево индекса
+     * \param page корень поддерева
+     * \param entries записи файла
+     * \param new_pages новые страницы после разделения page
+     * \return вернет true в случае успеха
+     */
+    bool insert_index_entries(_xvfs_index_page* page, const std::vector<_xvfs_index_entry>& entries, std::vector<_xvfs_index_page*>& new_pages);
+
+    /** \brief Удалить записи файла из поддерева индекса
+     * Страницы не сливаются, из дерева убираются только опустевшие страницы
+     * \param page корень поддерева
+     * \param hash_vfs_file хэш файла
+     * \param is_changed вернет true, если записи были удалены
+     * \return вернет true в случае успеха
+     */
+    bool erase_index_entries(_xvfs_index_page* page, long long hash_vfs_file, bool& is_changed);
+
+    /** \brief Построить индекс из отсортированных записей
+     * \param entries записи индекса
+     */
+    void build_index(const std::vector<_xvfs_index_entry>& entries);
+
+    /** \brief Выделить сектора под страницы индекса
+     * \param count количество страниц
+     * \param sectors первые сектора страниц по возрастанию
+     */
+    void allocate_index_pages(unsigned long count, std::vector<unsigned long>& sectors);
+
+    /** \brief Перевести запись индекса старого формата в запись с типом компрессии
+     * \param entry запись индекса старого формата
+     * \return запись индекса, файл сжат типом компрессии VFS
+     */
+    _xvfs_index_entry get_index_entry(const _xvfs_legacy_index_entry& entry);
+
+    /** \brief Собрать записи поддерева индекса
+     * Страницы, которых не было в памяти, после чтения сразу выгружаются
+     * \param page корень поддерева
+     * \param entries записи индекса
+     * \param pages_extents сектора страниц поддерева (или NULL)
+     * \return вернет true в случае успеха
+     */
+    bool get_index_entries(_xvfs_index_page* page, std::vector<_xvfs_index_entry>& entries, std::vector<_xvfs_extent>* pages_extents = NULL);
+
+    /** \brief Найти ячейку файла в таблице поиска
+     * \param hash_vfs_file хэш файла
+     * \return ячейка или NULL, если файла нет в таблице
+     */
+    _xvfs_lookup_slot* find_lookup_slot(long long hash_vfs_file);
+
+    /** \brief Запомнить файл в таблице поиска
+     * \param hash_vfs_file хэш файла
+     * \param is_file файл существует
+     * \param file_header заголовок файла
+     * \param extents экстенты файла (или NULL, если они неизвестны)
+     */
+    void set_lookup_slot(long long hash_vfs_file, bool is_file, const _xvfs_file_header& file_header, const std::vector<_xvfs_extent>* extents);
+
+    /** \brief Найти файл
+     * \param hash_vfs_file хэш файла
+     * \param file_header заголовок файла
+     * \param extents экстенты файла (или NULL, если они не нужны)
+     * \return вернет true, если файл найден
+     */
+    bool find_file(long long hash_vfs_file, _xvfs_file_header& file_header, std::vector<_xvfs_extent>* extents);
+
+    /** \brief Найти файл в индексе, минуя таблицу поиска
+     * \param hash_vfs_file хэш файла
+     * \param file_header заголовок файла
+     * \param extents экстенты файла (или NULL, если они не нужны)
+     * \return вернет true, если файл найден
+     */
+    bool find_index_file(long long hash_vfs_file, _xvfs_file_header& file_header, std::vector<_xvfs_extent>* extents);
+
+    /** \brief Изменить или добавить файл
+     * \param file_header заголовок файла
+     * \param extents экстенты файла
+     * \return вернет true в случае успеха
+     */
+    bool set_file(const _xvfs_file_header& file_header, const std::vector<_xvfs_extent>& extents);
+
+    /** \brief Удалить файл
+     * \param hash_vfs_file хэш файла
+     * \return вернет true в случае успеха
+     */
+    bool erase_file(long long hash_vfs_file);
+
+    /** \brief Найти файл в снимке индекса
+     * \param snapshot снимок индекса
+     * \param hash_vfs_file хэш файла
+     * \param file_header заголовок файла
+     * \param extents экстенты файла (или NULL, если они не нужны)
+     * \return вернет true, если файл найден
+     */
+    bool find_snapshot_file(const _xvfs_snapshot* snapshot, long long hash_vfs_file, _xvfs_file_header& file_header, std::vector<_xvfs_extent>* extents);
+
+    /** \brief Построить снимок индекса по индексу файлов и опубликовать его
+     * \return вернет true в случае успеха
+     */
+    bool build_snapshot();
+
+    /** \brief Опубликовать снимок индекса с изменением одного файла
+     * \param hash_vfs_file хэш файла
+     * \param entries новые записи индекса файла (пустой массив - файл удален)
+     */
+    void update_snapshot(long long hash_vfs_file, const std::vector<_xvfs_index_entry>& entries);
+
+    /** \brief Опубликовать снимок индекса
+     * Прежний снимок освобождается, когда его перестанут читать
+     * \param snapshot новый снимок (или NULL)
+     */
+    void publish_snapshot(_xvfs_snapshot* snapshot);
+
+    /** \brief Отложить освобождение объекта до выхода читателей старых снимков
+     * \param retired объект (эпоха назначается функцией)
+     */
+    void retire_object(_xvfs_retired& retired);
+
+    /** \brief Освободить объекты, которые больше не читаются
+     * \param is_wait дождаться выхода всех читателей старых снимков и освободить все объекты
+     */
+    void reclaim_retired(bool is_wait);
+
+    /** \brief Сохранить измененные страницы индекса
+     * Страницы пишутся в новые сектора, прежние страницы остаются целыми до записи заголовка
+     * \param old_extents сектора прежних страниц, которые можно освободить
+     * \return вернет true в случае успеха
+     */
+    bool save_index(std::vector<_xvfs_extent>& old_extents);
+
+    /** \brief Получить заголовки всех файлов
+     * \param files заголовки файлов, отсортированные по хэшу
+     */
+    void get_files(std::vector<_xvfs_file_header>& files);
+
+    bool apply_log_record(unsigned long type, const char* data, unsigned long size);
+    long long get_log_crc(const _xvfs_log_record& record, const char* data);
+    bool parse_log(const char* data, unsigned long size);
+
+    /** \brief Освободить сектора
+     * Сектора экстентов добавляются в список пустых секторов
+     * \param extents экстенты
+     */
+    void clear_data(const std::vector<_xvfs_extent>& extents);
+
+    /** \brief Освободить сектора файла
+     * В пакете изменений сектора освобождаются только при commit(), чтобы до сохранения пакета их нельзя было перезаписать.
+     * Со снимками индекса сектора освобождаются после выхода читателей старых снимков
+     * \param extents экстенты
+     */
+    void release_extents(const std::vector<_xvfs_extent>& extents);
+
+    /** \brief Освободить сектора после выхода читателей старых снимков
+     * \param extents экстенты
+     */
+    void retire_extents(const std::vector<_xvfs_extent>& extents);
+
+    /** \brief Занять сектора
+     * Сектора экстентов убираются из списка пустых секторов
+     * \param extents экстенты
+     */
+    void take_sectors(const std::vector<_xvfs_extent>& extents);
+    unsigned long get_last_new_sector();
+
+    /** \brief Получить количество секторов для данных
+     * \param size размер данных
+     * \return количество секторов
+     */
+    inline unsigned long get_sectors(unsigned long size) {
+        const unsigned long sector_data_size = xvfs_header.sector_size - sizeof(unsigned long);
+        return (size + sector_data_size - 1) / sector_data_size;
+    }
+
+    /** \brief Получить количество секторов в списке экстентов
+     * \param extents экстенты
+     * \return количество секторов
+     */
+    inline unsigned long get_extents_sectors(const std::vector<_xvfs_extent>& extents) {
+        unsigned long sectors = 0;
+        for(size_t i = 0; i < extents.size(); ++i) {
+            sectors += extents[i].sectors;
+        }
+        return sectors;
+    }
+
+    /** \brief Получить сектор за последним сектором списка экстентов
+     * \param extents экстенты
+     * \return первый сектор после всех экстентов (0, если экстентов нет)
+     */
+    inline unsigned long get_extents_end(const std::vector<_xvfs_extent>& extents) {
+        unsigned long end = 0;
+        for(size_t i = 0; i < extents.size(); ++i) {
+            end = std::max(end, extents[i].start_sector + extents[i].sectors);
+        }
+        return end;
+    }
+
+    /** \brief Добавить или убрать участок пустых секторов
+     * \param start_sector первый сектор
+     * \param sectors количество секторов
+     * \param is_free сектора пустые
+     */
+    void set_free_extent(unsigned long start_sector, unsigned long sectors, bool is_free);
+
+    /** \brief Отметить сектора пустыми или занятыми
+     * \param start_sector первый сектор
+     * \param sectors количество секторов
+     * \param is_free сектора пустые
+     */
+    void set_free_sectors(unsigned long start_sector, unsigned long sectors, bool is_free);
+
+    /** \brief Найти первый пустой сектор
+     * \param start_sector сектор, с которого начинается поиск
+     * \return пустой сектор или 0xFFFFFFFF, если пустых секторов нет
+     */
+    unsigned long find_free_sector(unsigned long start_sector);
+
+    /** \brief Получить количество пустых секторов подряд
+     * \param start_sector первый сектор
+     * \param max_sectors больше этого количества сектора не считаются
+     * \return количество пустых секторов подряд, начиная с start_sector
+     */
+    unsigned long get_free_run(unsigned long start_sector, unsigned long max_sectors);
+
+    /** \brief Получить сектор за последним пустым сектором
+     * \return сектор за последним пустым сектором (0, если пустых секторов нет)
+     */
+    unsigned long get_free_sectors_end();
+
+    /** \brief Прочитать карту пустых секторов
+     * \return вернет true в случае успеха
+     */
+    bool read_free_bitmap();
+
+    /** \brief Выделить сектора под карту пустых секторов
+     * Карта выделяется с запасом, чтобы при росте файла VFS ее не приходилось каждый раз выделять заново
+     */
+    void resize_free_bitmap();
+
+    /** \brief Записать измененные сектора карты пустых секторов
+     * \return вернет true в случае успеха
+     */
+    bool save_free_bitmap();
+
+    /** \brief Выделить сектора
+     * Сектора выделяются непрерывными участками. Сначала проверяется участок, начинающийся с hint_sector,
+     * затем подходящий участок из пустых секторов (наименьший или первый, см. set_allocation_type),
+     * затем участок в конце файла, затем самые большие участки, остаток берется в конце файла
+     * \param sectors количество секторов
+     * \param hint_sector желаемый первый сектор (или 0xFFFFFFFF)
+     * \param extents экстенты, в конец которых добавляются выделенные сектора
+     */
+    void allocate_sectors(unsigned long sectors, unsigned long hint_sector, std::vector<_xvfs_extent>& extents);
+
+    /** \brief Изменить количество секторов в списке экстентов
+     * Лишние сектора освобождаются, недостающие выделяются по возможности сразу за последним сектором
+     * \param extents экстенты
+     * \param sectors нужное количество секторов
+     */
+    void resize_extents(std::vector<_xvfs_extent>& extents, unsigned long sectors);
+
+    /** \brief Добавить сектора в конец списка экстентов
+     * Если сектора продолжают последний экстент, он просто увеличивается
+     * \param extents экстенты
+     * \param start_sector первый сектор
+     * \param sectors количество секторов
+     */
+    void add_extent(std::vector<_xvfs_extent>& extents, unsigned long start_sector, unsigned long sectors);
+
+    bool parse_files_extents(const char* data, unsigned long size, std::vector<std::vector<_xvfs_extent>>& files_extents);
+
+    /** \brief Ссылка сектора, которая не ведет на следующий по порядку сектор
+     */
+    struct _xvfs_link {
+        unsigned long sector;                           /**< Сектор */
+        unsigned long next_sector;                      /**< Следующий сектор цепочки (или 0xFFFFFFFF) */
+
+        _xvfs_link() {};
+
+        _xvfs_link(unsigned long _sector, unsigned long _next_sector) {
+            sector = _sector;
+            next_sector = _next_sector;
+        }
+
+        bool operator<(const _xvfs_link& value)const{return sector < value.sector;}
+    };
+
+    /** \brief Читать данные по цепочке секторов
+     * Сектора цепочки обычно идут подряд, поэтому читаются блоками. Блок растет, пока цепочка не прерывается
+     * \param start_sector первый сектор цепочки
+     * \param data буфер
+     * \param size размер данных
+     * \param extents экстенты, в конец которых добавляются сектора цепочки
+     * \param next_sector ссылка из последнего прочитанного сектора
+     * \return вернет true в случае успеха
+     */
+    bool read_chain(unsigned long start_sector, char* data, unsigned long size, std::vector<_xvfs_extent>& extents, unsigned long& next_sector);
+
+    /** \brief Загрузить таблицу ссылок секторов
+     * Файл читается одним последовательным проходом, в таблице остаются только разрывы цепочек
+     * \param links таблица ссылок, отсортированная по номеру сектора
+     * \return вернет true в случае успеха
+     */
+    bool load_sectors_links(std::vector<_xvfs_link>& links);
+
+    /** \brief Получить экстенты цепочки секторов по таблице ссылок
+     * \param links таблица ссылок
+     * \param start_sector первый сектор цепочки
+     * \param sectors количество секторов цепочки
+     * \param extents экстенты
+     * \return вернет true в случае успеха
+     */
+    bool get_chain_extents(const std::vector<_xvfs_link>& links, unsigned long start_sector, unsigned long sectors, std::vector<_xvfs_extent>& extents);
+
+    void init_xvfs_header();
+    void init_xvfs_header(int sector_size);
+    void init_xvfs_header(int sector_size, int compression_type);
+
+    /** \brief Проверить тип компрессии
+     * \param compression_type тип компресии
+     * \return вернет true, если тип компрессии есть в перечислении xfvsCompressionType
+     */
+    inline bool is_compression_type(long compression_type) {
+        return (compression_type >= NO_COMPRESSION && compression_type <= USE_ZLIB_LEVEL_9) ||
+            compression_type == USE_MINLIZO || compression_type == USE_LZ4 || is_zstd_compression(compression_type) ||
+            compression_type == USE_ZSTD_DICTIONARY;
+    };
+
+    /** \brief Словари zstd
+     * Словари хранятся в самом файле VFS как обычные файлы без сжатия: словарь - под хэшем zstd_dictionary_hash | id словаря,
+     * а под хэшем zstd_dictionary_hash лежит id текущего словаря. Старые словари не удаляются, они нужны для чтения старых файлов.
+     * Публичные функции чтения, записи и удаления эти хэши не принимают, а get_info() их не показывает.
+     * id словаря, которым сжат файл, записан в заголовке сжатых данных zstd
+     */
+    const long long zstd_dictionary_hash = 0x7876667300000000LL;
+    const unsigned long max_dictionary_file_size = 16384; /**< Со словарем сжимаются файлы не больше этого размера */
+
+    /** \brief Сжатие по частям
+     * Файл больше compression_chunk_size сжимается независимыми частями, чтобы его часть можно было прочитать
+     * без декомпрессии всего файла (см. read_range). Данные такого файла: [размер части][количество частей],
+     * затем концы частей (смещения от начала первой части), затем сами части. Часть, которая не сжалась, хранится без сжатия
+     */
+    const unsigned long compression_chunk_size = 65536;
+
+    /** \brief Сжатие данных файла по частям
+     * \param raw_data данные
+     * \param raw_size размер данных
+     * \param data сжатые данные (память выделяет функция)
+     * \param size размер сжатых данных
+     * \param compression_type тип компрессии частей
+     * \return вернет true в случае успеха
+     */
+    bool compress_chunks(const char* raw_data, unsigned long raw_size, char*& data, unsigned long& size, long compression_type);
+
+    /** \brief Декомпрессия одной части файла
+     * \param raw_data сжатые данные части
+     * \param raw_size размер сжатых данных части
+     * \param data буфер под данные части
+     * \param real_size размер данных части
+     * \param compression_type тип компрессии частей
+     * \param context контекст компрессии (NULL - контекст вызывающего потока)
+     * \return размер данных части или код ошибки
+     */
+    long decompress_chunk(const char* raw_data, unsigned long raw_size, char* data, unsigned long real_size, long compression_type, _xvfs_codec_context* context = NULL);
+
+    /** \brief Выполнить задачи в потоках сжатия
+     * Задачи разбирают по порядку дополнительные потоки сжатия и вызывающий поток.
+     * Если потоки сжатия заняты другим вызовом, задачи выполняются в вызывающем потоке
+     * \param tasks количество задач
+     * \param task задача, получает номер задачи и контекст компрессии потока
+     */
+    void run_compression_tasks(unsigned long tasks, const std::function<void(unsigned long, _xvfs_codec_context*)>& task);
+
+    /** \brief Выполнять задачи сжатия в дополнительном потоке
+     */
+    void run_compression_worker();
 
-        bool operator<(const _xvfs_file_header& value)const{return hash < value.hash;}
+    /** \brief Остановить дополнительные потоки сжатия
+     */
+    void stop_compression_workers();
 
-    };
+    /** \brief Получить контекст компрессии вызывающего потока
+     * Контекст создается при первом обращении из потока, общий для всех VFS и освобождается при завершении потока
+     * \return контекст компрессии
+     */
+    static _xvfs_codec_context* get_codec_context();
 
-private:
-    std::fstream fvs_file;                              /**< Файл виртуальной файловой системы */
-    // переменные для работы с функциями
-    // open, write, read, get_size, close
-    int open_mode = 0;
-    long long open_hash = 0;
-    long open_size = 0;
-    long open_pos = 0;
-    char* open_buffer_write = NULL;
-    char* open_buffer_read = NULL;
+    /** \brief Проверить, что хэш зарезервирован под словари zstd
+     * \param hash_vfs_file хэш файла
+     * \return вернет true, если хэш зарезервирован
+     */
+    inline bool is_dictionary_hash(long long hash_vfs_file) {
+        return (hash_vfs_file & ~0xFFFFFFFFLL) == zstd_dictionary_hash;
+    };
 
-    /** \brief Бинарный поиск (для заголовка vfs файла)
-     * \param arr массив заголовка
-     * \param key ключ
-     * \param left начальный элемент поиска
-     * \param right конечный элемент поиска
-     * \return позиция найденного элемента
+    /** \brief Записать в файл, в том числе под зарезервированным хэшем
+     * write_file() не принимает хэши словарей zstd, словари пишутся через эту функцию
+     * \param hash_vfs_file хэш файла
+     * \param data данные
+     * \param len длина файла
+     * \param compression_type тип компресии файла (из перечисления xfvsCompressionType)
+     * \return вернет true в случае успеха
      */
-    long binary_search_first(std::vector<_xvfs_file_header> arr, long long key, long left, long right);
+    bool write_vfs_file(long long hash_vfs_file, char* data, unsigned long len, long compression_type);
 
-    /** \brief Структура заголовка
+    /** \brief Читать файл, в том числе под зарезервированным хэшем
+     * \param hash_vfs_file хэш файла
+     * \param data данные
+     * \return вернет длину файла в случае успеха или код ошибки
      */
-    struct _xvfs_header {
-        unsigned long sector_size;                      /**< Размер сектора */
-        long compression_type;                          /**< Тип компрессии */
-        std::vector<_xvfs_file_header> files;           /**< Файлы */
-        std::vector<unsigned long> empty_sectors;       /**< Пустые сектора */
-        unsigned long get_size() {
-            unsigned long size = sizeof(sector_size) +
-                4 * sizeof(unsigned long) + // размер раголовка, количества файлов, пустых секторов
-                files.size() * sizeof(_xvfs_file_header) + // объем всех файлов
-                empty_sectors.size() * sizeof(unsigned long); // пустые сектора
-            return size;
-        }
-    } xvfs_header;
+    long read_vfs_file(long long hash_vfs_file, char*& data);
 
-    bool is_open_file = false;                          /**< Файл виртуальной файловой системы открыт или нет */
-    std::string file_name;                              /**< Имя файла виртуальной файловой системы */
-    //unsigned long sector_size = 512;                    /**< Размер сектора */
+#   if defined(XFVS_USE_ZSTD)
+    /** \brief Найти текущий словарь zstd
+     * Словарь ищется в файле VFS заново после чтения заголовка или журнала, ведь его мог обучить другой процесс.
+     * Если словарь сменился, подготовленные для сжатия словари освобождаются
+     * \return вернет true, если текущий словарь есть
+     */
+    bool load_zstd_dictionary();
 
-    bool check_file(std::string file_name);
-    bool create_file(std::string file_name);
-    long read_data(unsigned long start_sector, char* file_data, unsigned long file_size);
-    long write_data(unsigned long start_sector, char* file_data, unsigned long file_size);
+    /** \brief Получить текущий словарь zstd, подготовленный для сжатия
+     * \param level уровень сжатия
+     * \return подготовленный словарь или NULL, если словаря нет
+     */
+    ZSTD_CDict* get_zstd_cdict(int level);
 
-    bool read_header();
-    bool save_header();
+    /** \brief Освободить словари zstd, подготовленные для сжатия
+     */
+    void free_zstd_cdicts();
 
-    bool clear_data(unsigned long start_sector, bool is_first_sector);
-    unsigned long get_last_new_sector();
+    /** \brief Получить словарь zstd для декомпрессии
+     * \param dictionary_id id словаря
+     * \return подготовленный словарь или NULL, если словаря нет
+     */
+    ZSTD_DDict* get_zstd_ddict(unsigned dictionary_id);
+#   endif
 
-    void init_xvfs_header();
-    void init_xvfs_header(int sector_size);
-    void init_xvfs_header(int sector_size, int compression_type);
+    /** \brief Проверить, что тип компрессии - один из уровней zstd
+     * \param compression_type тип компресии
+     * \return вернет true, если тип компрессии из семейства USE_ZSTD_LEVEL_n
+     */
+    inline bool is_zstd_compression(long compression_type) {
+        return (compression_type >= USE_ZSTD_LEVEL_NEG_7 && compression_type <= USE_ZSTD_LEVEL_NEG_1) ||
+            (compression_type >= USE_ZSTD_LEVEL_1 && compression_type <= USE_ZSTD_LEVEL_22);
+    };
 
     const long long poly = 0xC96C5795D7870F42;
     void generate_table();
@@ -116,7 +1256,19 @@ public:
         ERROR_VIRTUAL_FILE_NOT_FOUND = -4,
         ERROR_VIRTUAL_FILE_DECOMPRESSION = -5,
         ERROR_UNKNOWN_DECOMPRESSION_METHOD = -6,
-        ERROR_VIRTUAL_FILE_NOT_OPEN = -7
+        ERROR_VIRTUAL_FILE_NOT_OPEN = -7,
+        ERROR_ASYNC_QUEUE_FULL = -8
+    };
+
+    enum xfvsStorageType {
+        USE_FSTREAM_STORAGE = 0,                        /**< Чтение и запись через std::fstream */
+        USE_MMAP_STORAGE = 1,                           /**< Файл отображается в память, сектора копируются напрямую из отображения */
+        USE_PREAD_STORAGE = 2                           /**< Позиционные чтение и запись (pread/pwrite) без общего указателя файла */
+    };
+
+    enum xfvsAllocationType {
+        BEST_FIT_ALLOCATION = 0,                        /**< Наименьший участок пустых секторов, в который помещается файл */
+        FIRST_FIT_ALLOCATION = 1                        /**< Первый по порядку участок пустых секторов, в который помещается файл */
     };
 
     enum xfvsCompressionType {
@@ -131,7 +1283,42 @@ public:
         USE_ZLIB_LEVEL_8 = 8,
         USE_ZLIB_LEVEL_9 = 9,
         USE_MINLIZO = 100,
-        USE_LZ4 = 200
+        USE_LZ4 = 200,
+        // уровни zstd: уровень равен типу компрессии минус 300,
+        // отрицательные уровни - быстрые режимы с меньшей степенью сжатия
+        USE_ZSTD_LEVEL_NEG_7 = 293,
+        USE_ZSTD_LEVEL_NEG_6 = 294,
+        USE_ZSTD_LEVEL_NEG_5 = 295,
+        USE_ZSTD_LEVEL_NEG_4 = 296,
+        USE_ZSTD_LEVEL_NEG_3 = 297,
+        USE_ZSTD_LEVEL_NEG_2 = 298,
+        USE_ZSTD_LEVEL_NEG_1 = 299,
+        USE_ZSTD_LEVEL_1 = 301,
+        USE_ZSTD_LEVEL_2 = 302,
+        USE_ZSTD_LEVEL_3 = 303,
+        USE_ZSTD_LEVEL_4 = 304,
+        USE_ZSTD_LEVEL_5 = 305,
+        USE_ZSTD_LEVEL_6 = 306,
+        USE_ZSTD_LEVEL_7 = 307,
+        USE_ZSTD_LEVEL_8 = 308,
+        USE_ZSTD_LEVEL_9 = 309,
+        USE_ZSTD_LEVEL_10 = 310,
+        USE_ZSTD_LEVEL_11 = 311,
+        USE_ZSTD_LEVEL_12 = 312,
+        USE_ZSTD_LEVEL_13 = 313,
+        USE_ZSTD_LEVEL_14 = 314,
+        USE_ZSTD_LEVEL_15 = 315,
+        USE_ZSTD_LEVEL_16 = 316,
+        USE_ZSTD_LEVEL_17 = 317,
+        USE_ZSTD_LEVEL_18 = 318,
+        USE_ZSTD_LEVEL_19 = 319,
+        USE_ZSTD_LEVEL_20 = 320,
+        USE_ZSTD_LEVEL_21 = 321,
+        USE_ZSTD_LEVEL_22 = 322,
+        // zstd с общим словарем VFS (см. train_dictionary), уровень сжатия берется от запрошенного уровня zstd
+        USE_ZSTD_DICTIONARY = 400,
+        // флаг в заголовке файла: файл сжат независимыми частями, остальные биты - тип компрессии частей
+        CHUNKED_COMPRESSION = 0x10000
     };
 
     /** \brief Инициализировать виртуальную файловую систему
@@ -155,6 +1342,16 @@ public:
      */
     xvfs(std::string file_name, int sector_size, int compression_type);
 
+    /** \brief Инициализировать виртуальную файловую систему
+     * Данный конструктор открывает или создает файл виртуальноц файловой системы с размером сектора sector_size байт, указанным типом компресии и типом хранилища.
+     * Остальные конструкторы используют хранилище USE_PREAD_STORAGE
+     * \param file_name имя файла виртуальной файловой системы
+     * \param sector_size желаемый размер сектора при создании файла
+     * \param compression_type желаемый тип компресии (из перечисления xfvsCompressionType)
+     * \param storage_type тип хранилища (из перечисления xfvsStorageType)
+     */
+    xvfs(std::string file_name, int sector_size, int compression_type, int storage_type);
+
     ~xvfs();
 
     /** \brief Состояние файла виртуальной файловой системы
@@ -178,6 +1375,25 @@ public:
      */
     bool write_file(long long hash_vfs_file, char* _data, unsigned long _len);
 
+    /** \brief Записать в файл со своим типом компрессии
+     * Тип компрессии запоминается в индексе для каждого файла, поэтому уже сжатые данные можно записать без сжатия
+     * \param vfs_file_name имя файла
+     * \param data данные
+     * \param len длина файла
+     * \param compression_type тип компресии файла (из перечисления xfvsCompressionType)
+     * \return вернет true в случае успеха
+     */
+    bool write_file(std::string vfs_file_name, char* data, unsigned long len, long compression_type);
+
+    /** \brief Записать в файл со своим типом компрессии
+     * \param hash_vfs_file хэш файла
+     * \param data данные
+     * \param len длина файла
+     * \param compression_type тип компресии файла (из перечисления xfvsCompressionType)
+     * \return вернет true в случае успеха
+     */
+    bool write_file(long long hash_vfs_file, char* _data, unsigned long _len, long compression_type);
+
     /** \brief Читать файл
      * Функция сама выделяет память под данные
      * \param vfs_file_name имя файла
@@ -196,6 +1412,46 @@ public:
      */
     long read_file(long long hash_vfs_file, char*& data);
 
+    /** \brief Читать часть файла
+     * Файл без сжатия читается с нужного смещения. У файла, сжатого по частям, читаются и распаковываются
+     * только части, в которые попадает диапазон. Файл, сжатый целиком, распаковывается полностью
+     * \param vfs_file_name имя файла
+     * \param offset смещение в файле (в данных после декомпрессии)
+     * \param length длина диапазона
+     * \param data буфер не меньше length
+     * \return количество прочитанных байт (меньше length в конце файла) или код ошибки
+     */
+    long read_range(std::string vfs_file_name, unsigned long offset, unsigned long length, char* data);
+
+    /** \brief Читать часть файла
+     * \param hash_vfs_file хэш файла
+     * \param offset смещение в файле (в данных после декомпрессии)
+     * \param length длина диапазона
+     * \param data буфер не меньше length
+     * \return количество прочитанных байт (меньше length в конце файла) или код ошибки
+     */
+    long read_range(long long hash_vfs_file, unsigned long offset, unsigned long length, char* data);
+
+    /** \brief Читать несколько файлов
+     * Чтения секторов всех файлов отправляются в хранилище одной пачкой (в режиме USE_PREAD_STORAGE),
+     * поэтому много мелких файлов читается быстрее, чем отдельными вызовами read_file().
+     * Функция сама выделяет память под данные файла, если его указатель в data равен NULL
+     * \param hash_vfs_files хэши файлов
+     * \param data данные файлов
+     * \param lens длины файлов или коды ошибок (в том же порядке, что и hash_vfs_files)
+     * \return количество прочитанных файлов или код ошибки
+     */
+    long read_files(const std::vector<long long>& hash_vfs_files, std::vector<char*>& data, std::vector<long>& lens);
+
+    /** \brief Читать несколько файлов
+     * Функция сама выделяет память под данные файла, если его указатель в data равен NULL
+     * \param vfs_file_names имена файлов
+     * \param data данные файлов
+     * \param lens длины файлов или коды ошибок (в том же порядке, что и vfs_file_names)
+     * \return количество прочитанных файлов или код ошибки
+     */
+    long read_files(const std::vector<std::string>& vfs_file_names, std::vector<char*>& data, std::vector<long>& lens);
+
     /** \brief Получить длину файла
      * \param vfs_file_name имя файла
      * \return длина файла в случае успеха или -1 в случае ошибки
@@ -220,16 +1476,184 @@ public:
      */
     bool delete_file(long long hash_vfs_file);
 
+    /** \brief Начать пакет изменений
+     * Изменения файлов пакета сохраняются в журнал одной записью при commit().
+     * Данные файлов пишутся в новые сектора, поэтому пока пакет не сохранен, файл VFS на диске остается в прежнем состоянии
+     * \return вернет true в случае успеха
+     */
+    bool begin_batch();
+
+    /** \brief Сохранить пакет изменений
+     * \return вернет true в случае успеха. В случае ошибки изменения пакета отменяются
+     */
+    bool commit();
+
+    /** \brief Отменить пакет изменений
+     * Заголовок заново читается из файла VFS
+     * \return вернет true в случае успеха
+     */
+    bool rollback();
+
+    /** \brief Обучить словарь zstd по небольшим файлам VFS
+     * Для обучения читаются до max_samples файлов размером не больше 16 КБ, взятых равномерно по всему индексу.
+     * Словарь сохраняется в файле VFS, после этого такие же небольшие файлы, которые сжимаются zstd,
+     * сжимаются со словарем. Обучать словарь внутри пакета изменений нельзя
+     * \param max_dictionary_size максимальный размер словаря
+     * \param max_samples максимальное количество файлов для обучения
+     * \return вернет true в случае успеха
+     */
+    bool train_dictionary(unsigned long max_dictionary_size = 16384, unsigned long max_samples = 4096);
+
+    /** \brief Состояние пакета изменений
+     * \return вернет true, если пакет изменений начат
+     */
+    inline bool is_batch_started() {return is_batch;};
+
+    /** \brief Выбрать способ выделения пустых секторов
+     * \param type способ выделения (BEST_FIT_ALLOCATION или FIRST_FIT_ALLOCATION)
+     */
+    inline void set_allocation_type(int type) {allocation_type = type;};
+
+    /** \brief Настроить адаптивное сжатие
+     * Перед сжатием большого файла сжимается его часть, и если она сжимается плохо, файл пишется без сжатия.
+     * Файл, который после сжатия меньше исходного менее чем в min_ratio раз, тоже пишется без сжатия.
+     * Если задана минимальная скорость сжатия, то для файлов без своего типа компрессии уровень сжатия
+     * понижается, когда сжатие идет медленнее, и возвращается к типу компрессии VFS, когда сжатие идет быстрее
+     * \param is_adaptive адаптивное сжатие включено
+     * \param min_ratio минимальная степень сжатия (размер данных / размер сжатых данных)
+     * \param min_speed минимальная скорость сжатия в байтах в секунду (0 - уровень сжатия не меняется)
+     */
+    void set_adaptive_compression(bool is_adaptive, double min_ratio = 1.1, double min_speed = 0);
+
+    /** \brief Включить снимки индекса для чтения без блокировок
+     * Индекс файлов целиком копируется в память. Чтение файлов берет текущий неизменяемый снимок индекса
+     * и не блокирует VFS, запись публикует новый снимок. Пока включены снимки, старые сектора
+     * перезаписанных файлов освобождаются после выхода читателей, которые могли их читать.
+     * Память под снимок растет с количеством файлов
+     * \param is_snapshots снимки включены
+     * \return вернет true в случае успеха
+     */
+    bool set_index_snapshots(bool is_snapshots);
+
+    /** \brief Включить режим нескольких процессов
+     * Одну VFS могут открыть несколько процессов. Заголовок файла и журнал остаются общими, а поколение изменений,
+     * конец журнала и размер файла лежат в отображенном в память файле <имя файла VFS>.shm. Чтение берет общую
+     * блокировку этого файла, запись - исключительную (пакет изменений держит ее до commit() или rollback()).
+     * Процесс, заметивший новое поколение, дочитывает только новые записи журнала, а после контрольной точки
+     * перечитывает заголовок. Режим нужно включить во всех процессах, которые открывают VFS.
+     * Со снимками индекса (set_index_snapshots()) режим не совместим
+     * \param is_shared режим включен
+     * \return вернет true в случае успеха
+     */
+    bool set_shared_access(bool is_shared);
+
+    /** \brief Настроить пул асинхронных вызовов
+     * Потоки пула создаются при первом асинхронном вызове. Если пул уже работает, он останавливается
+     * после выполнения поставленных вызовов. Нельзя вызывать из обработчика асинхронного вызова
+     * \param threads количество потоков (0 - по количеству ядер процессора)
+     * \param max_tasks максимальное количество ожидающих вызовов, сверх него вызовы отклоняются
+     */
+    void set_async_threads(unsigned threads, size_t max_tasks = 1024);
+
+    /** \brief Читать файл асинхронно
+     * Вызов выполняется в потоке пула, вызовы с одним хэшем выполняются в порядке вызова.
+     * Если очередь пула заполнена, результат сразу содержит ERROR_ASYNC_QUEUE_FULL
+     * \param hash_vfs_file хэш файла
+     * \return результат чтения (данные освобождает вызывающий)
+     */
+    std::future<_xvfs_read_result> async_read_file(long long hash_vfs_file);
+
+    /** \brief Читать файл асинхронно
+     * \param vfs_file_name имя файла
+     * \return результат чтения (данные освобождает вызывающий)
+     */
+    std::future<_xvfs_read_result> async_read_file(std::string vfs_file_name);
+
+    /** \brief Читать файл асинхронно с обработчиком
+     * Обработчик вызывается в потоке пула и получает длину файла или код ошибки и данные (освобождает обработчик)
+     * \param hash_vfs_file хэш файла
+     * \param callback обработчик
+     * \return вернет false, если вызов не поставлен в очередь (обработчик тогда не вызывается)
+     */
+    bool async_read_file(long long hash_vfs_file, std::function<void(long, char*)> callback);
+
+    /** \brief Записать в файл асинхронно
+     * Данные копируются до возврата из функции
+     * \param hash_vfs_file хэш файла
+     * \param data данные
+     * \param len длина файла
+     * \return результат записи (false, если очередь пула заполнена)
+     */
+    std::future<bool> async_write_file(long long hash_vfs_file, const char* data, unsigned long len);
+
+    /** \brief Записать в файл асинхронно
+     * \param hash_vfs_file хэш файла
+     * \param data данные
+     * \param len длина файла
+     * \param compression_type тип компресии файла (из перечисления xfvsCompressionType)
+     * \return результат записи (false, если очередь пула заполнена)
+     */
+    std::future<bool> async_write_file(long long hash_vfs_file, const char* data, unsigned long len, long compression_type);
+
+    /** \brief Записать в файл асинхронно
+     * \param vfs_file_name имя файла
+     * \param data данные
+     * \param len длина файла
+     * \return результат записи (false, если очередь пула заполнена)
+     */
+    std::future<bool> async_write_file(std::string vfs_file_name, const char* data, unsigned long len);
+
+    /** \brief Записать в файл асинхронно с обработчиком
+     * \param hash_vfs_file хэш файла
+     * \param data данные
+     * \param len длина файла
+     * \param callback обработчик результата записи
+     * \return вернет false, если вызов не поставлен в очередь (обработчик тогда не вызывается)
+     */
+    bool async_write_file(long long hash_vfs_file, const char* data, unsigned long len, std::function<void(bool)> callback);
+
+    /** \brief Удалить файл асинхронно
+     * \param hash_vfs_file хэш файла
+     * \return результат удаления (false, если очередь пула заполнена)
+     */
+    std::future<bool> async_delete_file(long long hash_vfs_file);
+
+    /** \brief Удалить файл асинхронно
+     * \param vfs_file_name имя файла
+     * \return результат удаления (false, если очередь пула заполнена)
+     */
+    std::future<bool> async_delete_file(std::string vfs_file_name);
+
+    /** \brief Удалить файл асинхронно с обработчиком
+     * \param hash_vfs_file хэш файла
+     * \param callback обработчик результата удаления
+     * \return вернет false, если вызов не поставлен в очередь (обработчик тогда не вызывается)
+     */
+    bool async_delete_file(long long hash_vfs_file, std::function<void(bool)> callback);
+
+    /** \brief Задать количество потоков сжатия
+     * Части файла, сжатого по частям, сжимаются и распаковываются параллельно и пишутся в исходном порядке.
+     * Дополнительные потоки создаются здесь и работают до закрытия VFS, вызывающий поток сжимает части вместе с ними
+     * \param threads количество потоков (1 - сжатие в вызывающем потоке, 0 - по количеству ядер процессора)
+     */
+    void set_compression_threads(unsigned threads);
+
     /** \brief Получить информацию о файлах
      * \param sector_size размер сектора
      * \param files файлы
      * \param empty_sectors пустые секторы
      */
     inline void get_info(unsigned long& sector_size, long& compression_type, std::vector<_xvfs_file_header>& files, std::vector<unsigned long>& empty_sectors) {
+        _xvfs_lock lock(this, true);
+        files.clear();
+        empty_sectors.clear();
+        if(lock.is_error()) return;
         sector_size = xvfs_header.sector_size;
         compression_type = xvfs_header.compression_type;
-        files = xvfs_header.files;
-        empty_sectors = xvfs_header.empty_sectors;
+        get_files(files);
+        for(unsigned long sector = find_free_sector(0); sector != 0xFFFFFFFF; sector = find_free_sector(sector + 1)) {
+            empty_sectors.push_back(sector);
+        }
     }
 
     enum xfvsOpenFileMode {
@@ -239,7 +1663,8 @@ public:
 
     /** \brief Открыть виртуальный файл для записи или чтения
      * Данная функция подразумевает использование write() или read().
-     * В конце объязательно вызвать close()
+     * В конце объязательно вызвать close(). Открытый файл у VFS один, поэтому open(), read(), write()
+     * и close() нужно вызывать из одного потока
      * \param hash_vfs_file хэш файла
      * \param mode режим (READ_FILE или WRITE_FILE)
      * \return true в случае успеха
@@ -305,4 +1730,195 @@ public:
     long long calculate_crc64(std::string vfs_file_name);
 };
 
+/** \brief Пакет изменений виртуальной файловой системы
+ * Пакет начинается в конструкторе. Если до вызова деструктора не был вызван commit(), изменения отменяются
+ */
+class xvfs_batch {
+public:
+    xvfs_batch(xvfs& vfs) : vfs(vfs) {
+        is_started = vfs.begin_batch();
+    }
+
+    ~xvfs_batch() {
+        if(is_started) vfs.rollback();
+    }
+
+    /** \brief Сохранить пакет изменений
+     * \return вернет true в случае успеха
+     */
+    bool commit() {
+        if(!is_started) return false;
+        is_started = false;
+        return vfs.commit();
+    }
+
+private:
+    xvfs& vfs;
+    bool is_started = false;
+};
+
+/** \brief Набор виртуальных файловых систем, по которым файлы распределяются по хэшу
+ * Каждый файл хранится в одной VFS набора (шарде), шард выбирается по хэшу файла. У каждого шарда свои заголовок,
+ * журнал, карта пустых секторов и блокировка, поэтому запись в разные шарды идет параллельно, а контрольные точки
+ * остаются небольшими. Файлы шардов можно разместить на разных дисках. Количество и порядок файлов шардов
+ * менять нельзя: по ним находятся уже записанные файлы. Конструкторы без storage_type, как и у xvfs, открывают
+ * шарды с USE_PREAD_STORAGE
+ */
+class xvfs_sharded {
+public:
+    xvfs_sharded(const std::vector<std::string>& file_names);
+    xvfs_sharded(const std::vector<std::string>& file_names, int sector_size);
+    xvfs_sharded(const std::vector<std::string>& file_names, int sector_size, int compression_type);
+    xvfs_sharded(const std::vector<std::string>& file_names, int sector_size, int compression_type, int storage_type);
+    ~xvfs_sharded();
+
+    xvfs_sharded(const xvfs_sharded&) = delete;
+    xvfs_sharded& operator=(const xvfs_sharded&) = delete;
+
+    /** \brief Состояние набора
+     * \return вернет true, если открыты файлы всех шардов
+     */
+    bool is_open();
+
+    /** \brief Получить количество шардов
+     * \return количество шардов
+     */
+    inline size_t get_shards_size() {return shards.size();};
+
+    /** \brief Получить шард
+     * Через шард можно настроить сжатие, пакеты изменений и другие режимы VFS
+     * \param index номер шарда
+     * \return шард
+     */
+    inline xvfs* get_shard(size_t index) {return shards[index];};
+
+    /** \brief Получить номер шарда файла
+     * \param hash_vfs_file хэш файла
+     * \return номер шарда
+     */
+    size_t get_shard_index(long long hash_vfs_file);
+
+    /** \brief Записать в файл
+     * \param vfs_file_name имя файла
+     * \param data данные
+     * \param len длина файла
+     * \return вернет true в случае успеха
+     */
+    bool write_file(std::string vfs_file_name, char* data, unsigned long len);
+
+    /** \brief Записать в файл
+     * \param vfs_file_name имя файла
+     * \param data данные
+     * \param len длина файла
+     * \param compression_type тип компресии файла (из перечисления xfvsCompressionType)
+     * \return вернет true в случае успеха
+     */
+    bool write_file(std::string vfs_file_name, char* data, unsigned long len, long compression_type);
+
+    /** \brief Записать в файл
+     * \param hash_vfs_file хэш файла
+     * \param data данные
+     * \param len длина файла
+     * \return вернет true в случае успеха
+     */
+    bool write_file(long long hash_vfs_file, char* data, unsigned long len);
+
+    /** \brief Записать в файл
+     * \param hash_vfs_file хэш файла
+     * \param data данные
+     * \param len длина файла
+     * \param compression_type тип компресии файла (из перечисления xfvsCompressionType)
+     * \return вернет true в случае успеха
+     */
+    bool write_file(long long hash_vfs_file, char* data, unsigned long len, long compression_type);
+
+    /** \brief Читать файл
+     * Функция сама выделяет память под данные
+     * \param vfs_file_name имя файла
+     * \param data данные
+     * \return вернет длину файла в случае успеха или код ошибки
+     */
+    long read_file(std::string vfs_file_name, char*& data);
+
+    /** \brief Читать файл
+     * Функция сама выделяет память под данные
+     * \param hash_vfs_file хэш файла
+     * \param data данные
+     * \return вернет длину файла в случае успеха или код ошибки
+     */
+    long read_file(long long hash_vfs_file, char*& data);
+
+    /** \brief Читать часть файла
+     * \param vfs_file_name имя файла
+     * \param offset смещение в файле (в данных после декомпрессии)
+     * \param length длина диапазона
+     * \param data буфер не меньше length
+     * \return количество прочитанных байт (меньше length в конце файла) или код ошибки
+     */
+    long read_range(std::string vfs_file_name, unsigned long offset, unsigned long length, char* data);
+
+    /** \brief Читать часть файла
+     * \param hash_vfs_file хэш файла
+     * \param offset смещение в файле (в данных после декомпрессии)
+     * \param length длина диапазона
+     * \param data буфер не меньше length
+     * \return количество прочитанных байт (меньше length в конце файла) или код ошибки
+     */
+    long read_range(long long hash_vfs_file, unsigned long offset, unsigned long length, char* data);
+
+    /** \brief Читать несколько файлов
+     * Файлы каждого шарда читаются одним вызовом xvfs::read_files().
+     * Функция сама выделяет память под данные файла, если его указатель в data равен NULL
+     * \param hash_vfs_files хэши файлов
+     * \param data данные файлов
+     * \param lens длины файлов или коды ошибок (в том же порядке, что и hash_vfs_files)
+     * \return количество прочитанных файлов или код ошибки
+     */
+    long read_files(const std::vector<long long>& hash_vfs_files, std::vector<char*>& data, std::vector<long>& lens);
+
+    /** \brief Читать несколько файлов
+     * \param vfs_file_names имена файлов
+     * \param data данные файлов
+     * \param lens длины файлов или коды ошибок (в том же порядке, что и vfs_file_names)
+     * \return количество прочитанных файлов или код ошибки
+     */
+    long read_files(const std::vector<std::string>& vfs_file_names, std::vector<char*>& data, std::vector<long>& lens);
+
+    /** \brief Получить длину файла
+     * \param vfs_file_name имя файла
+     * \return длина файла в случае успеха или код ошибки
+     */
+    long get_len_file(std::string vfs_file_name);
+
+    /** \brief Получить длину файла
+     * \param hash_vfs_file хэш файла
+     * \return длина файла в случае успеха или код ошибки
+     */
+    long get_len_file(long long hash_vfs_file);
+
+    /** \brief Удалить файл
+     * \param vfs_file_name имя файла
+     * \return вернет true в случае успеха
+     */
+    bool delete_file(std::string vfs_file_name);
+
+    /** \brief Удалить файл
+     * \param hash_vfs_file хэш файла
+     * \return вернет true в случае успеха
+     */
+    bool delete_file(long long hash_vfs_file);
+
+    /** \brief Посчитать CRC64 имени файла
+     * Хэш совпадает с xvfs::calculate_crc64()
+     * \param vfs_file_name имя файла
+     * \return CRC64
+     */
+    long long calculate_crc64(std::string vfs_file_name);
+
+private:
+    std::vector<xvfs*> shards;                          /**< Шарды */
+
+    void init_shards(const std::vector<std::string>& file_names, int sector_size, int compression_type, int storage_type);
+};
+
 #endif // XVFS_HPP_INCLUDED